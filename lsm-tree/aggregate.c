@@ -0,0 +1,299 @@
+/*
+ * This file contains aggregate range queries: the count, sum, smallest and
+ * largest value of the live pairs in [bottom, top).
+ *
+ * Unlike range(), these never build a list of the pairs. Each level gets a
+ * cursor over its part of the range, and the cursors are merged in key
+ * order, so every key is seen once with its newest version and folded
+ * straight into the result.
+ *
+ * Each disk level also keeps a summary of every block (its key bounds and
+ * the aggregate of its live pairs), built when compaction rewrites the
+ * level. When the merge reaches the start of a block that lies entirely
+ * inside the range, and no other level holds a key within the block's
+ * bounds nor does a newer range tombstone touch them, the block's pairs are
+ * exactly the live versions of those keys, so the summary is used and the
+ * block is never read.
+ */
+
+#include "lsm_tree.h"
+
+struct block_summary {
+    key_t min_key;
+    key_t max_key;
+    struct aggregate agg;
+};
+
+struct summary {
+    size_t nblocks;
+    struct block_summary *blocks;
+};
+
+/* a position in the part of one level that falls in the range */
+struct agg_cursor {
+    struct level *level;
+    size_t pos;
+    size_t end;
+
+    /* the key at pos, and the pair once it has been read */
+    key_t key;
+    int loaded;
+    struct kv_pair kv;
+
+    /* disk levels are read one block at a time, and asked for up to ahead */
+    struct kv_pair buf[BLOCK_PAIRS];
+    size_t base;
+    size_t n;
+    size_t ahead;
+
+    /* range tombstones of the levels above this one */
+    struct rtomb_set dead;
+};
+
+static void aggregate_init(struct aggregate *agg);
+static void aggregate_add(struct aggregate *agg, val_t val);
+static void aggregate_merge(struct aggregate *dst, struct aggregate *src);
+static void cursor_seek(struct agg_cursor *c);
+static void cursor_load(struct agg_cursor *c);
+static int cursor_skip_block(struct agg_cursor *cursors, int n, int win,
+    struct aggregate *agg);
+
+
+/*** SUMMARIES ***/
+
+/*
+ * summarize each block of a disk level. The level must not be empty
+ */
+struct summary *summary_build(struct level *level) {
+    assert(level->type == DISK_LEVEL);
+    assert(level->used > 0);
+
+    struct summary *s = (struct summary *) lsm_malloc(sizeof(struct summary));
+    s->nblocks = (level->used + BLOCK_PAIRS - 1) / BLOCK_PAIRS;
+    s->blocks = (struct block_summary *) lsm_malloc(s->nblocks
+        * sizeof(struct block_summary));
+
+    struct kv_pair buf[BLOCK_PAIRS];
+    fseek(level->d.file_ptr, 0, SEEK_SET);
+    for (size_t b = 0; b < s->nblocks; b++) {
+        struct block_summary *bs = s->blocks + b;
+        size_t base = b*BLOCK_PAIRS;
+        size_t n = level->used - base < BLOCK_PAIRS
+            ? level->used - base : BLOCK_PAIRS;
+        fread(buf, sizeof(struct kv_pair), n, level->d.file_ptr);
+
+        bs->min_key = buf[0].key;
+        bs->max_key = buf[n-1].key;
+        aggregate_init(&bs->agg);
+        for (size_t i = 0; i < n; i++) {
+            if (buf[i].valid == KV_VALID && buf[i].op == OP_ADD)
+                aggregate_add(&bs->agg, buf[i].val);
+        }
+    }
+    return s;
+}
+
+void summary_destroy(struct summary *s) {
+    if (!s)
+        return;
+    free(s->blocks);
+    free(s);
+}
+
+
+/*** QUERIES ***/
+
+/*
+ * range_aggregate:
+ * Aggregate the values of the live pairs with keys in [bottom, top) into
+ * agg. For an empty range the count is 0 and min and max are meaningless
+ */
+void range_aggregate(struct lsm_tree *tree, key_t bottom, key_t top,
+        struct aggregate *agg) {
+    uint64_t start = trace_now(tree->trace);
+    int n = tree->nlevels;
+    struct arena *arena = arena_thread();
+    struct agg_cursor *cursors = (struct agg_cursor *) arena_alloc(arena,
+        n*sizeof(struct agg_cursor), sizeof(void *));
+    aggregate_init(agg);
+
+    for (int i = 0; i < n; i++) {
+        struct agg_cursor *c = cursors + i;
+        struct level *level = tree->levels + i;
+        c->level = level;
+        c->pos = 0;
+        c->end = 0;
+        c->base = 0;
+        c->n = 0;
+        c->ahead = 0;
+
+        rtomb_init(&c->dead);
+        if (i > 0) {
+            rtomb_merge(&c->dead, &cursors[i-1].dead);
+            rtomb_merge(&c->dead, &tree->levels[i-1].rtombs);
+        }
+
+        if (top <= bottom || level->used == 0 || (level->rfilter
+                && range_filter_check(level->rfilter, bottom, top)
+                == RFILTER_NOTFOUND))
+            continue;
+        c->pos = level_find(level, bottom);
+        c->end = level_find(level, top);
+        c->ahead = level_readahead(level, c->pos, c->end);
+    }
+
+    /* the reads of every level are in flight before any is waited on */
+    for (int i = 0; i < n; i++) {
+        if (cursors[i].pos < cursors[i].end)
+            cursor_seek(cursors + i);
+    }
+
+    while (1) {
+        /* the smallest key left, taken from the newest level holding it */
+        int win = -1;
+        for (int i = 0; i < n; i++) {
+            if (cursors[i].pos < cursors[i].end
+                    && (win < 0 || cursors[i].key < cursors[win].key))
+                win = i;
+        }
+        if (win < 0)
+            break;
+
+        if (cursor_skip_block(cursors, n, win, agg))
+            continue;
+
+        struct agg_cursor *c = cursors + win;
+        cursor_load(c);
+        struct kv_pair kv = c->kv;
+        if (kv.op == OP_ADD && !rtomb_covers(&c->dead, kv.key))
+            aggregate_add(agg, kv.val);
+
+        /* move past this key in every level */
+        for (int i = 0; i < n; i++) {
+            if (cursors[i].pos < cursors[i].end && cursors[i].key == kv.key) {
+                cursors[i].pos++;
+                if (cursors[i].pos < cursors[i].end)
+                    cursor_seek(cursors + i);
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+        rtomb_destroy(&cursors[i].dead);
+    arena_reset(arena);
+    trace_op(tree->trace, TRACE_AGGREGATE, bottom, top, start);
+    tune_op(tree->tuner, TRACE_AGGREGATE, (long) agg->count);
+}
+
+/*
+ * if the winning cursor is at the start of a block that can be answered
+ * from its summary, add the summary to agg, move past the block and return
+ * 1. Otherwise return 0
+ */
+static int cursor_skip_block(struct agg_cursor *cursors, int n, int win,
+        struct aggregate *agg) {
+    struct agg_cursor *c = cursors + win;
+    struct summary *s = c->level->summary;
+    if (c->level->type != DISK_LEVEL || !s || c->pos % BLOCK_PAIRS != 0)
+        return 0;
+
+    size_t b = c->pos / BLOCK_PAIRS;
+    size_t next = c->pos + BLOCK_PAIRS;
+    if (next > c->level->used)
+        next = c->level->used;
+    if (next > c->end)
+        return 0;
+
+    /* no other version of a key in the block, and no newer tombstone */
+    struct block_summary *bs = s->blocks + b;
+    for (int i = 0; i < n; i++) {
+        if (i != win && cursors[i].pos < cursors[i].end
+                && cursors[i].key <= bs->max_key)
+            return 0;
+    }
+    if (rtomb_overlaps(&c->dead, bs->min_key, bs->max_key))
+        return 0;
+
+    aggregate_merge(agg, &bs->agg);
+    c->pos = next;
+    if (c->pos < c->end)
+        cursor_seek(c);
+    return 1;
+}
+
+
+/*** CURSORS ***/
+
+/*
+ * find the key at the cursor's position. At the start of a summarized
+ * block it is taken from the summary, so that the block need not be read
+ */
+static void cursor_seek(struct agg_cursor *c) {
+    struct level *level = c->level;
+    c->loaded = 0;
+    if (level->type == DISK_LEVEL && level->summary
+            && c->pos % BLOCK_PAIRS == 0
+            && !(c->pos >= c->base && c->pos < c->base + c->n)) {
+        c->key = level->summary->blocks[c->pos / BLOCK_PAIRS].min_key;
+        return;
+    }
+    cursor_load(c);
+    c->key = c->kv.key;
+}
+
+/* read the pair at the cursor's position */
+static void cursor_load(struct agg_cursor *c) {
+    struct level *level = c->level;
+    if (c->loaded)
+        return;
+
+    if (level->type == MAIN_LEVEL) {
+        read_pair(level, c->pos, &c->kv);
+    } else {
+        if (!(c->pos >= c->base && c->pos < c->base + c->n)) {
+            c->base = c->pos - c->pos % BLOCK_PAIRS;
+            c->n = level->used - c->base < BLOCK_PAIRS
+                ? level->used - c->base : BLOCK_PAIRS;
+
+            /* ask for the next window once half of this one is read */
+            if (c->ahead < c->base)
+                c->ahead = c->base;
+            if (c->ahead - c->base <= level->d.readahead*BLOCK_PAIRS/2)
+                c->ahead = level_readahead(level, c->ahead, c->end);
+            fseek(level->d.file_ptr, c->base*sizeof(struct kv_pair), SEEK_SET);
+            fread(c->buf, sizeof(struct kv_pair), c->n, level->d.file_ptr);
+        }
+        c->kv = c->buf[c->pos - c->base];
+    }
+    c->loaded = 1;
+}
+
+
+/*** HELPERS ***/
+
+static void aggregate_init(struct aggregate *agg) {
+    agg->count = 0;
+    agg->sum = 0;
+    agg->min = 0;
+    agg->max = 0;
+}
+
+static void aggregate_add(struct aggregate *agg, val_t val) {
+    if (agg->count == 0 || val < agg->min)
+        agg->min = val;
+    if (agg->count == 0 || val > agg->max)
+        agg->max = val;
+    agg->count++;
+    agg->sum += val;
+}
+
+static void aggregate_merge(struct aggregate *dst, struct aggregate *src) {
+    if (src->count == 0)
+        return;
+    if (dst->count == 0 || src->min < dst->min)
+        dst->min = src->min;
+    if (dst->count == 0 || src->max > dst->max)
+        dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+}
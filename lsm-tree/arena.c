@@ -0,0 +1,170 @@
+/*
+ * This file contains the tree's allocators.
+ *
+ * All heap allocations made by the tree go through lsm_malloc() and
+ * friends, which count them so that stat() can show whether a path
+ * allocates in the steady state.
+ *
+ * An arena hands out memory by bumping a pointer through a list of chunks
+ * and is released in one shot by arena_reset(), which keeps the chunks for
+ * reuse, so once an arena has grown to its working size it stops calling
+ * malloc altogether. The B+-tree main level allocates its nodes from an
+ * arena that is reset when the level is flushed, and queries take their
+ * scratch memory from an arena belonging to the calling thread.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include "lsm_tree.h"
+
+#define ARENA_ALIGN 64
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    unsigned char *data;
+};
+
+struct arena {
+    size_t chunk_size;
+
+    /* chunks in allocation order, and the one being filled */
+    struct arena_chunk *head;
+    struct arena_chunk *cur;
+};
+
+static struct arena_chunk *arena_chunk_new(size_t size);
+static void arena_thread_init(void);
+static void arena_thread_destroy(void *arena);
+
+static long alloc_count = 0;
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+
+/*** COUNTED ALLOCATION ***/
+
+void *lsm_malloc(size_t size) {
+    __sync_fetch_and_add(&alloc_count, 1);
+    return malloc(size);
+}
+
+void *lsm_calloc(size_t n, size_t size) {
+    __sync_fetch_and_add(&alloc_count, 1);
+    return calloc(n, size);
+}
+
+void *lsm_realloc(void *ptr, size_t size) {
+    __sync_fetch_and_add(&alloc_count, 1);
+    return realloc(ptr, size);
+}
+
+/* memory aligned to align bytes, or NULL */
+void *lsm_aligned_alloc(size_t align, size_t size) {
+    void *mem;
+    __sync_fetch_and_add(&alloc_count, 1);
+    if (posix_memalign(&mem, align, size))
+        return NULL;
+    return mem;
+}
+
+/* number of allocations made so far */
+long lsm_alloc_count(void) {
+    return __sync_fetch_and_add(&alloc_count, 0);
+}
+
+
+/*** ARENAS ***/
+
+struct arena *arena_init(size_t chunk_size) {
+    struct arena *a = (struct arena *) lsm_malloc(sizeof(struct arena));
+    a->chunk_size = chunk_size;
+    a->head = NULL;
+    a->cur = NULL;
+    return a;
+}
+
+void arena_destroy(struct arena *a) {
+    struct arena_chunk *chunk = a->head;
+    while (chunk) {
+        struct arena_chunk *next = chunk->next;
+        free(chunk->data);
+        free(chunk);
+        chunk = next;
+    }
+    free(a);
+}
+
+/*
+ * allocate bytes from the arena, aligned to align (a power of two no
+ * larger than ARENA_ALIGN). The memory lives until the next reset
+ */
+void *arena_alloc(struct arena *a, size_t bytes, size_t align) {
+    assert(align > 0 && align <= ARENA_ALIGN && (align & (align-1)) == 0);
+
+    /* find room in the current chunk or one kept from before a reset */
+    while (a->cur) {
+        size_t off = (a->cur->used + align - 1) & ~(align - 1);
+        if (off + bytes <= a->cur->size) {
+            a->cur->used = off + bytes;
+            return a->cur->data + off;
+        }
+        if (!a->cur->next)
+            break;
+        a->cur = a->cur->next;
+        a->cur->used = 0;
+    }
+
+    /* a new chunk, big enough for oversized requests */
+    size_t size = bytes > a->chunk_size ? bytes : a->chunk_size;
+    struct arena_chunk *chunk = arena_chunk_new(size);
+    if (a->cur)
+        a->cur->next = chunk;
+    else
+        a->head = chunk;
+    a->cur = chunk;
+    chunk->used = bytes;
+    return chunk->data;
+}
+
+/* release everything allocated from the arena, keeping its chunks */
+void arena_reset(struct arena *a) {
+    a->cur = a->head;
+    if (a->cur)
+        a->cur->used = 0;
+}
+
+static struct arena_chunk *arena_chunk_new(size_t size) {
+    struct arena_chunk *chunk =
+        (struct arena_chunk *) lsm_malloc(sizeof(struct arena_chunk));
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->data = (unsigned char *) lsm_aligned_alloc(ARENA_ALIGN, size);
+    return chunk;
+}
+
+
+/*** PER-THREAD ARENAS ***/
+
+/*
+ * the scratch arena of the calling thread, created on first use and
+ * destroyed when the thread exits
+ */
+struct arena *arena_thread(void) {
+    pthread_once(&arena_key_once, arena_thread_init);
+    struct arena *a = (struct arena *) pthread_getspecific(arena_key);
+    if (!a) {
+        a = arena_init(ARENA_CHUNK);
+        pthread_setspecific(arena_key, a);
+    }
+    return a;
+}
+
+static void arena_thread_init(void) {
+    pthread_key_create(&arena_key, arena_thread_destroy);
+}
+
+static void arena_thread_destroy(void *arena) {
+    arena_destroy((struct arena *) arena);
+}
@@ -0,0 +1,88 @@
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "lsm_tree.h"
+
+#define BENCH_NAME "bench-lsm"
+#define NUM_SIZES 4
+
+/*
+ * Benchmark for the main-memory level. Fills a single-level tree with random
+ * keys, reads them all back and then deletes them all again, for several
+ * level sizes. Puts and deletes go through write_batch() and gets through
+ * tree_get(), so that no operation pays for a thread of its own and the
+ * times are those of the main level.
+ * Build with `make benchmark` for the sorted array, `make benchmark-btree`
+ * for the B+-tree and `make benchmark-hash` for the hash table, and compare
+ * the output.
+ */
+
+static double elapsed(struct timeval *start, struct timeval *stop) {
+    return (double) (stop->tv_usec - start->tv_usec) / 1000000 
+        + (double) (stop->tv_sec - start->tv_sec);
+}
+
+int main(void) {
+    size_t sizes[NUM_SIZES] = {4096, 16384, 65536, 262144};
+    struct timeval start, stop;
+
+#if defined(BENCH_HASH)
+    printf("Main level: hash table\n");
+#elif defined(_USE_BTREE)
+    printf("Main level: B+-tree (%d byte nodes)\n", B_NODE_BYTES);
+#else
+    printf("Main level: sorted array\n");
+#endif
+
+    for (int s = 0; s < NUM_SIZES; s++) {
+        /* leave a free slot so deletes never trigger a migrate */
+        size_t num = sizes[s];
+        size_t capacity = num + 1;
+        struct lsm_tree *tree = init(BENCH_NAME, 1, 1, &capacity);
+#ifdef BENCH_HASH
+        set_memtable(tree, MEMTABLE_HASH);
+#endif
+        struct kv_pair *kvs = (struct kv_pair *) malloc(num
+            * sizeof(struct kv_pair));
+
+        srand(2);
+        for (size_t i = 0; i < num; i++) {
+            kvs[i].key = rand();
+            kvs[i].val = rand();
+            kvs[i].op = OP_ADD;
+        }
+
+        gettimeofday(&start, NULL);
+        write_batch(tree, kvs, num);
+        gettimeofday(&stop, NULL);
+        double put_secs = elapsed(&start, &stop);
+
+        /* read back in a different order than the keys went in */
+        size_t found = 0;
+        val_t val;
+        gettimeofday(&start, NULL);
+        for (size_t i = 0; i < num; i++)
+            found += tree_get(tree, kvs[(i*7919) % num].key, &val)
+                == GET_SUCCESS;
+        gettimeofday(&stop, NULL);
+        double get_secs = elapsed(&start, &stop);
+        assert(found == num);
+
+        for (size_t i = 0; i < num; i++)
+            kvs[i].op = OP_DEL;
+        gettimeofday(&start, NULL);
+        write_batch(tree, kvs, num);
+        gettimeofday(&stop, NULL);
+        double del_secs = elapsed(&start, &stop);
+
+        printf("%8zu pairs: put %.0f ns/op, get %.0f ns/op, "
+            "delete %.0f ns/op\n", num, put_secs*1e9/num, get_secs*1e9/num,
+            del_secs*1e9/num);
+
+        free(kvs);
+        destroy(tree);
+    }
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "lsm_tree.h"
+
+#define BENCH_NAME "bench-cache"
+#define NUM_KEYS 200000
+#define NUM_GETS 100000
+#define CACHE_BYTES (256*1024)
+
+/*
+ * Benchmark for the row cache. Loads a tree with three disk levels and
+ * times gets drawn uniformly and from a Zipf distribution (s = 1), without
+ * a cache and with one of CACHE_BYTES. Lookups call tree_get() directly,
+ * since starting a thread per get() would swamp the difference. Results
+ * go to stderr.
+ */
+
+static double elapsed(struct timeval *start, struct timeval *stop) {
+    return (double) (stop->tv_usec - start->tv_usec) / 1000000
+        + (double) (stop->tv_sec - start->tv_sec);
+}
+
+/* Zipf ranks by inverting the approximate CDF ln(r) / ln(n) */
+static int zipf_rank(int n) {
+    double u = (double) rand() / ((double) RAND_MAX + 1);
+    int r = (int) exp(u*log(n));
+    return r < n ? r : n - 1;
+}
+
+int main(void) {
+    size_t sizes[4] = {2048, 16384, 131072, 1048576};
+    struct lsm_tree *tree = init(BENCH_NAME, 4, 1, sizes);
+    key_t *keys = (key_t *) malloc(NUM_KEYS*sizeof(key_t));
+
+    srand(2);
+    for (int i = 0; i < NUM_KEYS; i++) {
+        keys[i] = rand();
+        put(tree, keys[i], i);
+    }
+
+    const char *dists[2] = {"uniform", "zipf"};
+    size_t caches[2] = {0, CACHE_BYTES};
+    struct timeval start, stop;
+    val_t val;
+    for (int d = 0; d < 2; d++) {
+        for (int c = 0; c < 2; c++) {
+            set_cache(tree, caches[c]);
+
+            srand(3);
+            gettimeofday(&start, NULL);
+            for (int g = 0; g < NUM_GETS; g++) {
+                int r = d ? zipf_rank(NUM_KEYS) : rand() % NUM_KEYS;
+                tree_get(tree, keys[r], &val);
+            }
+            gettimeofday(&stop, NULL);
+            double secs = elapsed(&start, &stop);
+
+            fprintf(stderr, "%-8s cache %7zu bytes: get %f s (%.0f ns/op), "
+                "hit rate %.2f%%\n", dists[d], caches[c], secs,
+                secs*1e9/NUM_GETS, tree->cache
+                ? 100*cache_hit_rate(tree->cache) : 0.0);
+        }
+    }
+
+    free(keys);
+    destroy(tree);
+    return 0;
+}
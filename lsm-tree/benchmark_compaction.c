@@ -0,0 +1,62 @@
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "lsm_tree.h"
+
+#define BENCH_NAME "bench-compaction"
+#define NUM_KEYS 2000000
+#define BATCH 65536
+#define NUM_POLICIES 4
+
+/*
+ * Benchmark for partial compaction. Loads NUM_KEYS random keys, one in ten
+ * of them a delete, into a four-level tree under each compaction policy,
+ * and reports the total load time and the slowest write_batch(), which
+ * is where a flush that cascades through the levels shows up. Results go
+ * to stderr.
+ */
+
+static const char *names[NUM_POLICIES] = {"full", "round-robin",
+    "least-overlap", "most-tombstones"};
+
+static double elapsed(struct timeval *start, struct timeval *stop) {
+    return (double) (stop->tv_usec - start->tv_usec) / 1000000
+        + (double) (stop->tv_sec - start->tv_sec);
+}
+
+int main(void) {
+    size_t sizes[4] = {65536, 262144, 1048576, 4194304};
+    struct kv_pair *batch = (struct kv_pair *) malloc(BATCH
+        * sizeof(struct kv_pair));
+    struct timeval start, stop, before, after;
+
+    for (int policy = 0; policy < NUM_POLICIES; policy++) {
+        struct lsm_tree *tree = init(BENCH_NAME, 4, 1, sizes);
+        set_compaction(tree, policy);
+
+        srand(2);
+        double slowest = 0;
+        gettimeofday(&start, NULL);
+        for (int done = 0; done < NUM_KEYS; done += BATCH) {
+            for (int i = 0; i < BATCH; i++) {
+                batch[i].key = rand() % (4*NUM_KEYS);
+                batch[i].val = done + i;
+                batch[i].op = rand() % 10 ? OP_ADD : OP_DEL;
+            }
+            gettimeofday(&before, NULL);
+            write_batch(tree, batch, BATCH);
+            gettimeofday(&after, NULL);
+            if (elapsed(&before, &after) > slowest)
+                slowest = elapsed(&before, &after);
+        }
+        gettimeofday(&stop, NULL);
+
+        fprintf(stderr, "%-16s load %f s, slowest batch %f s\n",
+            names[policy], elapsed(&start, &stop), slowest);
+        destroy(tree);
+    }
+
+    free(batch);
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "lsm_tree.h"
+
+#define BENCH_NAME "bench-filter"
+#define NUM_KEYS 200000
+#define NUM_GETS 100000
+
+/*
+ * Benchmark for the point filter memory split. Loads a tree with three disk
+ * levels, then for several budgets compares the same bits per key on every
+ * level against the Monkey split: filter memory, the predicted reads per
+ * lookup of a missing key, and the number of levels whose filter actually
+ * let such a lookup through. Results go to stderr.
+ */
+
+static double elapsed(struct timeval *start, struct timeval *stop) {
+    return (double) (stop->tv_usec - start->tv_usec) / 1000000
+        + (double) (stop->tv_sec - start->tv_sec);
+}
+
+int main(void) {
+    size_t sizes[4] = {2048, 16384, 131072, 1048576};
+    struct lsm_tree *tree = init(BENCH_NAME, 4, 1, sizes);
+
+    /* even keys are present, odd keys never are */
+    srand(2);
+    for (int i = 0; i < NUM_KEYS; i++)
+        put(tree, (rand() % (NUM_KEYS*8)) * 2, i);
+
+    const char *names[2] = {"uniform", "monkey"};
+    int policies[2] = {FILTER_UNIFORM, FILTER_MONKEY};
+    double budgets[3] = {2, 5, 10};
+    struct timeval start, stop;
+    val_t val;
+    for (int b = 0; b < 3; b++) {
+        for (int p = 0; p < 2; p++) {
+            set_filter(tree, budgets[b], policies[p]);
+            size_t mem = 0;
+            for (int i = 0; i < tree->nlevels; i++)
+                mem += point_filter_memory(tree->levels[i].filter);
+
+            /* levels each missing key gets past the filter of */
+            long probes = 0;
+            srand(3);
+            for (int g = 0; g < NUM_GETS; g++) {
+                key_t key = (rand() % (NUM_KEYS*8)) * 2 + 1;
+                for (int i = 0; i < tree->nlevels; i++) {
+                    struct level *level = tree->levels + i;
+                    if (level->type == DISK_LEVEL && level->used > 0
+                            && (!level->filter || point_filter_check(
+                            level->filter, key) == BLOOM_FOUND))
+                        probes++;
+                }
+            }
+
+            srand(3);
+            gettimeofday(&start, NULL);
+            for (int g = 0; g < NUM_GETS; g++)
+                get(tree, (rand() % (NUM_KEYS*8)) * 2 + 1, &val);
+            gettimeofday(&stop, NULL);
+            double secs = elapsed(&start, &stop);
+
+            fprintf(stderr, "%4.1f bits/key %-8s filters %8zu bytes, "
+                "%.4f reads per missing get, get %.0f ns/op\n", budgets[b],
+                names[p], mem, (double) probes / NUM_GETS,
+                secs*1e9/NUM_GETS);
+        }
+    }
+
+    destroy(tree);
+    return 0;
+}
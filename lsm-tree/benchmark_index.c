@@ -0,0 +1,68 @@
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "lsm_tree.h"
+
+#define BENCH_NAME "bench-index"
+#define NUM_KEYS 250000
+#define NUM_GETS 50000
+
+/*
+ * Benchmark for the disk level indexes. Loads a two-level tree with uniform
+ * and with skewed keys, and times point lookups with no index, fence 
+ * pointers and the learned index. Results go to stderr.
+ */
+
+static double elapsed(struct timeval *start, struct timeval *stop) {
+    return (double) (stop->tv_usec - start->tv_usec) / 1000000 
+        + (double) (stop->tv_sec - start->tv_sec);
+}
+
+/* keys concentrated near zero, so the key -> position mapping is curved */
+static key_t skewed_key(void) {
+    double u = (double) rand() / RAND_MAX;
+    return (key_t) (u*u*u*u*RAND_MAX);
+}
+
+static void run(const char *dist, int skewed) {
+    size_t sizes[2] = {8192, 1048576};
+    struct lsm_tree *tree = init(BENCH_NAME, 2, 1, sizes);
+    key_t *keys = (key_t *) malloc(NUM_KEYS*sizeof(key_t));
+
+    srand(2);
+    for (int i = 0; i < NUM_KEYS; i++) {
+        keys[i] = skewed ? skewed_key() : rand();
+        put(tree, keys[i], i);
+    }
+
+    const char *names[3] = {"none", "fence", "learned"};
+    int types[3] = {INDEX_NONE, INDEX_FENCE, INDEX_LEARNED};
+    struct timeval start, stop;
+    val_t val;
+    for (int t = 0; t < 3; t++) {
+        set_index(tree, types[t]);
+        size_t mem = 0;
+        for (int i = 0; i < tree->nlevels; i++)
+            mem += index_memory(tree->levels[i].index);
+
+        srand(3);
+        gettimeofday(&start, NULL);
+        for (int i = 0; i < NUM_GETS; i++)
+            get(tree, keys[rand() % NUM_KEYS], &val);
+        gettimeofday(&stop, NULL);
+        double secs = elapsed(&start, &stop);
+
+        fprintf(stderr, "%-8s %-8s get %f s (%.0f ns/op), index %zu bytes\n",
+            dist, names[t], secs, secs*1e9/NUM_GETS, mem);
+    }
+
+    free(keys);
+    destroy(tree);
+}
+
+int main(void) {
+    run("uniform", 0);
+    run("skewed", 1);
+    return 0;
+}
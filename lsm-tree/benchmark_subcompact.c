@@ -0,0 +1,55 @@
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "lsm_tree.h"
+
+#define BENCH_NAME "bench-subcompact"
+#define NUM_KEYS 2000000
+#define BATCH 65536
+
+/*
+ * Benchmark for parallel subcompactions. Loads NUM_KEYS random keys into a
+ * tree whose flushes cascade through levels of up to millions of pairs,
+ * with 1, 2, 4, ... threads per merge up to the number of cores. Writes go
+ * through write_batch() so that the time is mostly compaction. Results go
+ * to stderr.
+ */
+
+static double elapsed(struct timeval *start, struct timeval *stop) {
+    return (double) (stop->tv_usec - start->tv_usec) / 1000000
+        + (double) (stop->tv_sec - start->tv_sec);
+}
+
+int main(void) {
+    size_t sizes[4] = {65536, 262144, 1048576, 4194304};
+    struct kv_pair *batch = (struct kv_pair *) malloc(BATCH
+        * sizeof(struct kv_pair));
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    struct timeval start, stop;
+
+    for (int threads = 1; threads == 1 || threads <= cores; threads *= 2) {
+        struct lsm_tree *tree = init(BENCH_NAME, 4, 1, sizes);
+        set_subcompactions(tree, threads);
+
+        srand(2);
+        gettimeofday(&start, NULL);
+        for (int done = 0; done < NUM_KEYS; done += BATCH) {
+            for (int i = 0; i < BATCH; i++) {
+                batch[i].key = rand();
+                batch[i].val = done + i;
+                batch[i].op = OP_ADD;
+            }
+            write_batch(tree, batch, BATCH);
+        }
+        gettimeofday(&stop, NULL);
+
+        fprintf(stderr, "%2d threads: load %f s\n", threads,
+            elapsed(&start, &stop));
+        destroy(tree);
+    }
+
+    free(batch);
+    return 0;
+}
@@ -0,0 +1,324 @@
+/*
+ * This file contains an in-memory B+-tree, used as the main-memory level
+ * when the LSM tree is built with _USE_BTREE. All pairs live in the leaves,
+ * which are chained left to right so that a level can be read back in key
+ * order when it is migrated. Inserts and deletes only shift entries within
+ * a single node, never across the whole level, and a key larger than any
+ * in the tree is appended to the last leaf without a search. When that
+ * leaf fills up it is split at its end rather than its middle, so that
+ * increasing keys leave full leaves behind. Nodes come from an arena
+ * owned by the tree, so clearing the tree after a flush frees them all at
+ * once and the next fill reuses the same memory.
+ */
+
+#include "lsm_tree.h"
+
+#define CACHE_LINE 64
+
+static struct b_node *b_node_new(struct b_tree *bt, int leaf);
+static size_t b_node_child(struct b_node *node, key_t key);
+static size_t b_leaf_find(struct b_node *leaf, key_t key);
+static int b_node_full(struct b_node *node);
+static void b_node_split(struct b_tree *bt, struct b_node *parent, size_t i,
+    key_t key);
+static struct b_node *b_tree_leaf(struct b_tree *bt, key_t key);
+
+/*** INITIALIZATION/CLEANUP ***/
+
+struct b_tree *b_tree_init(void) {
+    struct b_tree *bt = (struct b_tree *) lsm_malloc(sizeof(struct b_tree));
+    bt->arena = arena_init(ARENA_CHUNK);
+    bt->count = 0;
+    bt->root = b_node_new(bt, 1);
+    bt->head = bt->root;
+    bt->tail = bt->root;
+    bt->cur_leaf = NULL;
+    bt->cur_base = 0;
+    return bt;
+}
+
+void b_tree_destroy(struct b_tree *bt) {
+    arena_destroy(bt->arena);
+    free(bt);
+}
+
+/*
+ * drop every pair in the tree, leaving a single empty leaf
+ */
+void b_tree_clear(struct b_tree *bt) {
+    arena_reset(bt->arena);
+    bt->count = 0;
+    bt->root = b_node_new(bt, 1);
+    bt->head = bt->root;
+    bt->tail = bt->root;
+    bt->cur_leaf = NULL;
+    bt->cur_base = 0;
+}
+
+static struct b_node *b_node_new(struct b_tree *bt, int leaf) {
+    struct b_node *node = (struct b_node *) arena_alloc(bt->arena,
+        sizeof(struct b_node), CACHE_LINE);
+    node->used = 0;
+    node->leaf = leaf;
+    node->next = NULL;
+    return node;
+}
+
+
+/*** OPERATIONS ***/
+
+/*
+ * find a key in the tree. Returns a pointer to the stored pair, which stays
+ * valid until the next insert or remove, or NULL if the key is not present
+ */
+struct kv_pair *b_tree_get(struct b_tree *bt, key_t key) {
+    struct b_node *leaf = b_tree_leaf(bt, key);
+    size_t pos = b_leaf_find(leaf, key);
+    if (pos < leaf->used && leaf->values[pos].key == key)
+        return leaf->values + pos;
+    return NULL;
+}
+
+/*
+ * insert or update a key-value pair. Full nodes are split on the way down
+ * so that the leaf always has room. Returns B_TREE_NEW if the key was not
+ * already present as a valid pair, and B_TREE_UPDATED otherwise
+ */
+int b_tree_insert(struct b_tree *bt, struct kv_pair *kv) {
+    bt->cur_leaf = NULL;
+
+    /* a new largest key goes straight to the end of the last leaf */
+    struct b_node *tail = bt->tail;
+    if (tail->used > 0 && tail->used < B_LEAF_ORDER
+            && kv->key > tail->values[tail->used-1].key) {
+        tail->values[tail->used] = *kv;
+        tail->values[tail->used].valid = KV_VALID;
+        tail->used++;
+        bt->count++;
+        return B_TREE_NEW;
+    }
+
+    /* grow the tree at the root */
+    if (b_node_full(bt->root)) {
+        struct b_node *root = b_node_new(bt, 0);
+        root->children[0] = bt->root;
+        bt->root = root;
+        b_node_split(bt, root, 0, kv->key);
+    }
+
+    struct b_node *node = bt->root;
+    while (!node->leaf) {
+        size_t i = b_node_child(node, kv->key);
+        if (b_node_full(node->children[i])) {
+            b_node_split(bt, node, i, kv->key);
+            if (kv->key >= node->keys[i])
+                i++;
+        }
+        node = node->children[i];
+    }
+
+    size_t pos = b_leaf_find(node, kv->key);
+
+    /* case 1: the key exists, so we update it */
+    if (pos < node->used && node->values[pos].key == kv->key) {
+        int res = node->values[pos].valid == KV_VALID
+            ? B_TREE_UPDATED : B_TREE_NEW;
+        node->values[pos] = *kv;
+        node->values[pos].valid = KV_VALID;
+        return res;
+    }
+
+    /* case 2: shift the tail of this leaf only */
+    memmove(node->values+pos+1, node->values+pos,
+        (node->used-pos)*sizeof(struct kv_pair));
+    node->values[pos] = *kv;
+    node->values[pos].valid = KV_VALID;
+    node->used++;
+    bt->count++;
+    return B_TREE_NEW;
+}
+
+/*
+ * remove a key from the tree. Leaves are allowed to underflow (and even
+ * become empty) since the level is cleared as a whole once it is migrated.
+ * Returns 1 if a valid pair was removed and 0 otherwise
+ */
+int b_tree_remove(struct b_tree *bt, key_t key) {
+    struct b_node *leaf = b_tree_leaf(bt, key);
+    size_t pos = b_leaf_find(leaf, key);
+    if (pos == leaf->used || leaf->values[pos].key != key)
+        return 0;
+
+    int res = leaf->values[pos].valid == KV_VALID;
+    memmove(leaf->values+pos, leaf->values+pos+1,
+        (leaf->used-pos-1)*sizeof(struct kv_pair));
+    leaf->used--;
+    bt->count--;
+    bt->cur_leaf = NULL;
+    return res;
+}
+
+/*
+ * remove every key in [bottom, top), shifting each affected leaf once.
+ * Returns the number of valid pairs removed
+ */
+size_t b_tree_remove_range(struct b_tree *bt, key_t bottom, key_t top) {
+    size_t removed = 0;
+    if (top <= bottom)
+        return 0;
+
+    struct b_node *leaf = b_tree_leaf(bt, bottom);
+    while (leaf) {
+        size_t first = b_leaf_find(leaf, bottom);
+        size_t last = b_leaf_find(leaf, top);
+        for (size_t i = first; i < last; i++)
+            removed += leaf->values[i].valid == KV_VALID;
+
+        size_t used = leaf->used;
+        memmove(leaf->values+first, leaf->values+last,
+            (used-last)*sizeof(struct kv_pair));
+        leaf->used -= last - first;
+        bt->count -= last - first;
+
+        /* this leaf holds a key past the range, so the next ones do too */
+        if (last < used)
+            break;
+        leaf = leaf->next;
+    }
+    bt->cur_leaf = NULL;
+    return removed;
+}
+
+/*
+ * position in key order of the first pair with a key not less than key.
+ * Counts the leaves before the one holding it, and leaves the cursor there
+ * so that reading on from that position with b_tree_at is O(1) per call
+ */
+size_t b_tree_find(struct b_tree *bt, key_t key) {
+    struct b_node *leaf = b_tree_leaf(bt, key);
+    size_t base = 0;
+    for (struct b_node *n = bt->head; n != leaf; n = n->next)
+        base += n->used;
+
+    bt->cur_leaf = leaf;
+    bt->cur_base = base;
+    return base + b_leaf_find(leaf, key);
+}
+
+/*
+ * return the pair at position pos in key order, or NULL if pos is past the
+ * end. Walks the leaf chain from a cursor, so reading the tree front to back
+ * (as when migrating the level) costs O(1) per call
+ */
+struct kv_pair *b_tree_at(struct b_tree *bt, size_t pos) {
+    if (pos >= bt->count)
+        return NULL;
+
+    if (!bt->cur_leaf || pos < bt->cur_base) {
+        bt->cur_leaf = bt->head;
+        bt->cur_base = 0;
+    }
+    while (pos >= bt->cur_base + bt->cur_leaf->used) {
+        bt->cur_base += bt->cur_leaf->used;
+        bt->cur_leaf = bt->cur_leaf->next;
+    }
+    return bt->cur_leaf->values + (pos - bt->cur_base);
+}
+
+
+/*** NODE HELPERS ***/
+
+/* descend to the leaf that would hold key */
+static struct b_node *b_tree_leaf(struct b_tree *bt, key_t key) {
+    struct b_node *node = bt->root;
+    while (!node->leaf)
+        node = node->children[b_node_child(node, key)];
+    return node;
+}
+
+/* index of the child of an inner node whose key range holds key */
+static size_t b_node_child(struct b_node *node, key_t key) {
+    size_t bottom = 0;
+    size_t top = node->used;
+    size_t middle;
+
+    while (top > bottom) {
+        middle = (top + bottom)/2;
+        if (node->keys[middle] <= key)
+            bottom = middle+1;
+        else
+            top = middle;
+    }
+    return bottom;
+}
+
+/* position of the first pair in a leaf with a key not less than key */
+static size_t b_leaf_find(struct b_node *leaf, key_t key) {
+    size_t bottom = 0;
+    size_t top = leaf->used;
+    size_t middle;
+
+    while (top > bottom) {
+        middle = (top + bottom)/2;
+        if (leaf->values[middle].key < key)
+            bottom = middle+1;
+        else
+            top = middle;
+    }
+    return bottom;
+}
+
+static int b_node_full(struct b_node *node) {
+    if (node->leaf)
+        return node->used == B_LEAF_ORDER;
+    return node->used == B_INNER_ORDER;
+}
+
+/*
+ * split the full child i of parent in half, adding the new right sibling
+ * and its separator key to parent. If the child is the last leaf and key,
+ * the key being inserted, is larger than all of it, the new sibling starts
+ * out empty instead. Assumes parent is not full
+ */
+static void b_node_split(struct b_tree *bt, struct b_node *parent, size_t i,
+        key_t key) {
+    struct b_node *left = parent->children[i];
+    struct b_node *right = b_node_new(bt, left->leaf);
+    key_t sep;
+
+    if (left->leaf && left == bt->tail 
+            && key > left->values[left->used-1].key) {
+        /* appending: leave the last leaf full and start a new one for key */
+        left->next = right;
+        bt->tail = right;
+        sep = key;
+    } else if (left->leaf) {
+        size_t mid = left->used/2;
+        right->used = left->used - mid;
+        memcpy(right->values, left->values+mid,
+            right->used*sizeof(struct kv_pair));
+        left->used = mid;
+        right->next = left->next;
+        left->next = right;
+        if (left == bt->tail)
+            bt->tail = right;
+        sep = right->values[0].key;
+    } else {
+        /* the middle key moves up into the parent */
+        size_t mid = left->used/2;
+        sep = left->keys[mid];
+        right->used = left->used - mid - 1;
+        memcpy(right->keys, left->keys+mid+1, right->used*sizeof(key_t));
+        memcpy(right->children, left->children+mid+1,
+            (right->used+1)*sizeof(struct b_node *));
+        left->used = mid;
+    }
+
+    memmove(parent->keys+i+1, parent->keys+i,
+        (parent->used-i)*sizeof(key_t));
+    memmove(parent->children+i+2, parent->children+i+1,
+        (parent->used-i)*sizeof(struct b_node *));
+    parent->keys[i] = sep;
+    parent->children[i+1] = right;
+    parent->used++;
+}
@@ -0,0 +1,215 @@
+/*
+ * This file contains the row cache, which answers get() for hot keys
+ * without walking the levels.
+ *
+ * The cache maps keys to their newest pair, a value or a tombstone (a get
+ * that found nothing caches a tombstone, so hot missing keys are cheap
+ * too). It has a fixed number of sets of CACHE_WAYS slots each, sized to
+ * the memory budget, and evicts within a set by CLOCK. Sets are guarded by
+ * a fixed pool of striped locks.
+ *
+ * Writes invalidate rather than update, so that two writes of one key
+ * racing to the cache cannot leave the older value behind. A get that
+ * misses notes the generation of its set before walking the levels, and
+ * only fills the cache if no write to the set has happened since, which
+ * keeps a slow get from caching a value that a write has just replaced.
+ */
+
+#include <stdint.h>
+#include "lsm_tree.h"
+
+struct cache_set {
+    /* bumped by every write that could touch a key of this set */
+    unsigned gen;
+
+    /* CLOCK reference bits and hand */
+    unsigned char ref[CACHE_WAYS];
+    unsigned char hand;
+
+    /* slots in use have valid set to KV_VALID */
+    struct kv_pair slots[CACHE_WAYS];
+};
+
+struct cache {
+    size_t nsets;
+    struct cache_set *sets;
+    pthread_mutex_t locks[CACHE_STRIPES];
+
+    /* stats */
+    long hits;
+    long misses;
+};
+
+static struct cache_set *cache_set(struct cache *c, key_t key,
+    pthread_mutex_t **lock);
+static int cache_slot(struct cache_set *set, key_t key);
+
+
+/*** INITIALIZATION/CLEANUP ***/
+
+/*
+ * set_cache:
+ * Put a row cache of at most bytes of memory in front of get(), replacing
+ * any previous one. 0 removes the cache. Not safe while other operations
+ * are running
+ */
+void set_cache(struct lsm_tree *tree, size_t bytes) {
+    cache_destroy(tree->cache);
+    tree->cache = bytes > 0 ? cache_init(bytes) : NULL;
+}
+
+struct cache *cache_init(size_t bytes) {
+    struct cache *c = (struct cache *) lsm_malloc(sizeof(struct cache));
+
+    /* a power of two sets, at least one */
+    c->nsets = 1;
+    while (2*c->nsets*sizeof(struct cache_set) <= bytes)
+        c->nsets *= 2;
+    c->sets = (struct cache_set *) lsm_calloc(c->nsets,
+        sizeof(struct cache_set));
+    for (int i = 0; i < CACHE_STRIPES; i++)
+        pthread_mutex_init(c->locks + i, NULL);
+    c->hits = 0;
+    c->misses = 0;
+    return c;
+}
+
+void cache_destroy(struct cache *c) {
+    if (!c)
+        return;
+    for (int i = 0; i < CACHE_STRIPES; i++)
+        pthread_mutex_destroy(c->locks + i);
+    free(c->sets);
+    free(c);
+}
+
+
+/*** LOOKUP ***/
+
+/*
+ * look a key up. Returns CACHE_HIT and sets kv to the cached pair, which
+ * may be a tombstone, or CACHE_MISS and sets gen for a later cache_fill()
+ */
+int cache_get(struct cache *c, key_t key, struct kv_pair *kv, unsigned *gen) {
+    pthread_mutex_t *lock;
+    struct cache_set *set = cache_set(c, key, &lock);
+
+    pthread_mutex_lock(lock);
+    int i = cache_slot(set, key);
+    if (i >= 0) {
+        *kv = set->slots[i];
+        set->ref[i] = 1;
+    }
+    *gen = set->gen;
+    pthread_mutex_unlock(lock);
+
+    __sync_fetch_and_add(i >= 0 ? &c->hits : &c->misses, 1);
+    return i >= 0 ? CACHE_HIT : CACHE_MISS;
+}
+
+/*
+ * cache the newest pair of a key, as found by a get that missed when its
+ * set was at generation gen. Dropped if a write has happened since
+ */
+void cache_fill(struct cache *c, struct kv_pair *kv, unsigned gen) {
+    pthread_mutex_t *lock;
+    struct cache_set *set = cache_set(c, kv->key, &lock);
+
+    pthread_mutex_lock(lock);
+    if (set->gen != gen) {
+        pthread_mutex_unlock(lock);
+        return;
+    }
+
+    int i = cache_slot(set, kv->key);
+    for (int j = 0; i < 0 && j < CACHE_WAYS; j++) {
+        if (set->slots[j].valid != KV_VALID)
+            i = j;
+    }
+    while (i < 0) {
+        if (set->ref[set->hand])
+            set->ref[set->hand] = 0;
+        else
+            i = set->hand;
+        set->hand = (set->hand + 1) % CACHE_WAYS;
+    }
+
+    set->slots[i] = *kv;
+    set->slots[i].valid = KV_VALID;
+    set->ref[i] = 1;
+    pthread_mutex_unlock(lock);
+}
+
+
+/*** INVALIDATION ***/
+
+/* drop a key that has just been written */
+void cache_invalidate(struct cache *c, key_t key) {
+    pthread_mutex_t *lock;
+    struct cache_set *set = cache_set(c, key, &lock);
+
+    pthread_mutex_lock(lock);
+    set->gen++;
+    int i = cache_slot(set, key);
+    if (i >= 0)
+        set->slots[i].valid = KV_INVAL;
+    pthread_mutex_unlock(lock);
+}
+
+/* drop every key in [bottom, top), which touches every set */
+void cache_invalidate_range(struct cache *c, key_t bottom, key_t top) {
+    for (size_t s = 0; s < c->nsets; s++) {
+        struct cache_set *set = c->sets + s;
+        pthread_mutex_t *lock = c->locks + s % CACHE_STRIPES;
+
+        pthread_mutex_lock(lock);
+        set->gen++;
+        for (int i = 0; i < CACHE_WAYS; i++) {
+            if (set->slots[i].key >= bottom && set->slots[i].key < top)
+                set->slots[i].valid = KV_INVAL;
+        }
+        pthread_mutex_unlock(lock);
+    }
+}
+
+
+/*** STATS ***/
+
+/* fraction of lookups answered by the cache */
+double cache_hit_rate(struct cache *c) {
+    long hits = __sync_fetch_and_add(&c->hits, 0);
+    long misses = __sync_fetch_and_add(&c->misses, 0);
+    return hits + misses > 0 ? (double) hits / (hits + misses) : 0;
+}
+
+void cache_stat(struct lsm_tree *tree) {
+    struct cache *c = tree->cache;
+    if (!c)
+        return;
+
+    long hits = __sync_fetch_and_add(&c->hits, 0);
+    long misses = __sync_fetch_and_add(&c->misses, 0);
+    printf("Row cache: %zu bytes, %ld hits, %ld misses, hit rate %.2f%%\n",
+        c->nsets*sizeof(struct cache_set), hits, misses,
+        100*cache_hit_rate(c));
+}
+
+
+/*** HELPERS ***/
+
+static struct cache_set *cache_set(struct cache *c, key_t key,
+        pthread_mutex_t **lock) {
+    uint64_t h = (uint64_t) (uint32_t) key * 0x9e3779b97f4a7c15ull;
+    size_t s = (size_t) (h >> 32) & (c->nsets - 1);
+    *lock = c->locks + s % CACHE_STRIPES;
+    return c->sets + s;
+}
+
+/* the slot holding key, or -1 */
+static int cache_slot(struct cache_set *set, key_t key) {
+    for (int i = 0; i < CACHE_WAYS; i++) {
+        if (set->slots[i].valid == KV_VALID && set->slots[i].key == key)
+            return i;
+    }
+    return -1;
+}
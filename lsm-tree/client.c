@@ -0,0 +1,252 @@
+/*
+ * Load generator for the LSM tree server.
+ *
+ * Opens a number of connections to a server started with main -s, each
+ * driven by its own thread, and sends a mix of uniformly random puts and
+ * gets. Each connection keeps up to depth requests in flight: it writes
+ * them in one go and then reads back their replies.
+ *
+ * usage: client -s <address> [-n requests] [-c connections] [-d depth]
+ *               [-k keys] [-r read percent] [-b]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "server.h"
+
+#define MAXLINE 64
+
+struct load {
+    const char *addr;
+    long requests;
+    int depth;
+    int keys;
+    int reads;
+    int binary;
+
+    /* per connection */
+    unsigned seed;
+    long hits;
+    int failed;
+};
+
+void *load_thread(void *arg);
+int load_connect(const char *addr);
+int load_write(int fd, const char *buf, size_t len);
+int load_replies(struct load *l, int fd, char *buf, size_t size,
+    const char *gets, int num);
+void usage(void);
+
+int main(int argc, char *argv[]) {
+    struct load base;
+    int nconns = 1;
+    base.addr = NULL;
+    base.requests = 100000;
+    base.depth = 16;
+    base.keys = 1000000;
+    base.reads = 50;
+    base.binary = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "s:n:c:d:k:r:b")) != -1) {
+        switch (c) {
+            case 's':
+                base.addr = optarg;
+                break;
+            case 'n':
+                base.requests = atol(optarg);
+                break;
+            case 'c':
+                nconns = atoi(optarg);
+                break;
+            case 'd':
+                base.depth = atoi(optarg);
+                break;
+            case 'k':
+                base.keys = atoi(optarg);
+                break;
+            case 'r':
+                base.reads = atoi(optarg);
+                break;
+            case 'b':
+                base.binary = 1;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (!base.addr || nconns < 1 || base.depth < 1 || base.keys < 1) {
+        usage();
+        return 1;
+    }
+
+    struct load *loads = (struct load *) malloc(nconns*sizeof(struct load));
+    pthread_t *tids = (pthread_t *) malloc(nconns*sizeof(pthread_t));
+    struct timespec before, after;
+    clock_gettime(CLOCK_MONOTONIC, &before);
+
+    for (int i = 0; i < nconns; i++) {
+        loads[i] = base;
+        loads[i].requests = base.requests / nconns
+            + (i < base.requests % nconns);
+        loads[i].seed = i + 1;
+        pthread_create(tids + i, NULL, load_thread, loads + i);
+    }
+
+    long hits = 0;
+    int failed = 0;
+    for (int i = 0; i < nconns; i++) {
+        pthread_join(tids[i], NULL);
+        hits += loads[i].hits;
+        failed |= loads[i].failed;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    if (failed)
+        return 1;
+
+    double secs = (after.tv_sec - before.tv_sec)
+        + (after.tv_nsec - before.tv_nsec) / 1e9;
+    printf("%ld requests over %d connections (depth %d, %d%% gets, %s): "
+        "%.3f s, %.0f requests/s, %ld gets hit\n", base.requests, nconns,
+        base.depth, base.reads, base.binary ? "binary" : "text", secs,
+        base.requests / secs, hits);
+
+    free(loads);
+    free(tids);
+    return 0;
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: client -s <address> [-n requests] "
+        "[-c connections] [-d depth] [-k keys] [-r read percent] [-b]\n");
+}
+
+/* drive one connection */
+void *load_thread(void *arg) {
+    struct load *l = (struct load *) arg;
+    l->hits = 0;
+    l->failed = 0;
+
+    int fd = load_connect(l->addr);
+    if (fd < 0) {
+        l->failed = 1;
+        return NULL;
+    }
+
+    size_t size = l->depth*MAXLINE;
+    char *buf = (char *) malloc(size);
+    char *gets = (char *) malloc(l->depth);
+    for (long done = 0; done < l->requests; ) {
+        int num = l->requests - done < l->depth
+            ? (int) (l->requests - done) : l->depth;
+        size_t len = 0;
+
+        for (int i = 0; i < num; i++) {
+            int get = (int) (rand_r(&l->seed) % 100) < l->reads;
+            gets[i] = get;
+            int key = rand_r(&l->seed) % l->keys;
+            int val = rand_r(&l->seed);
+
+            if (l->binary) {
+                struct srv_request req;
+                memset(&req, 0, sizeof(req));
+                req.op = get ? SRV_GET : SRV_PUT;
+                req.key1 = key;
+                req.key2 = val;
+                memcpy(buf + len, &req, sizeof(req));
+                len += sizeof(req);
+            } else if (get) {
+                len += sprintf(buf + len, "g %d\n", key);
+            } else {
+                len += sprintf(buf + len, "p %d %d\n", key, val);
+            }
+        }
+
+        if (load_write(fd, buf, len)
+                || load_replies(l, fd, buf, size, gets, num)) {
+            fprintf(stderr, "Lost connection to %s\n", l->addr);
+            l->failed = 1;
+            break;
+        }
+        done += num;
+    }
+
+    free(buf);
+    free(gets);
+    close(fd);
+    return NULL;
+}
+
+int load_connect(const char *addr) {
+    struct sockaddr_storage ss;
+    socklen_t len = srv_addr(addr, &ss);
+    if (len == 0) {
+        fprintf(stderr, "Bad server address %s\n", addr);
+        return -1;
+    }
+
+    int fd = socket(ss.ss_family, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &ss, len)) {
+        perror(addr);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int load_write(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* read the replies to num requests, counting the gets that hit */
+int load_replies(struct load *l, int fd, char *buf, size_t size,
+        const char *gets, int num) {
+    size_t len = 0;
+    int i = 0;
+    while (i < num) {
+        ssize_t n = read(fd, buf + len, size - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        len += n;
+
+        /* consume the complete replies */
+        size_t off = 0;
+        while (i < num) {
+            if (l->binary) {
+                struct srv_reply reply;
+                if (len - off < sizeof(reply))
+                    break;
+                memcpy(&reply, buf + off, sizeof(reply));
+                off += sizeof(reply);
+                l->hits += gets[i] && reply.status == SRV_OK;
+            } else {
+                char *end = memchr(buf + off, '\n', len - off);
+                if (!end)
+                    break;
+                l->hits += gets[i] && end > buf + off;
+                off = end - buf + 1;
+            }
+            i++;
+        }
+        memmove(buf, buf + off, len - off);
+        len -= off;
+    }
+    return 0;
+}
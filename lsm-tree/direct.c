@@ -0,0 +1,126 @@
+/*
+ * This file contains direct I/O for the large merges done by subcompact().
+ *
+ * With set_direct_io() on, the merge threads read both levels of a merge,
+ * and write and read back their output runs, with O_DIRECT. A merge that
+ * streams millions of pairs through then leaves the page cache to the
+ * blocks that gets and range scans read. O_DIRECT needs file offsets,
+ * lengths and buffers aligned to DIRECT_ALIGN bytes, so reads round their
+ * span out to whole blocks and point into the buffer at the first pair
+ * wanted, and runs are written in whole blocks, the last one padded, since
+ * the length of a run is kept apart from its file.
+ *
+ * The stream buffers come from a pool kept by the tree and are reused by
+ * every merge, so the memory merges take is that of the most streams ever
+ * open at once, and no more. On filesystems without O_DIRECT, the files
+ * are opened as usual and the same code runs through the page cache.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include "lsm_tree.h"
+
+/* a stream buffer: DIRECT_PAIRS pairs, and a block either side for reads */
+#define DIRECT_BUF_BYTES (DIRECT_PAIRS*sizeof(struct kv_pair) + 2*DIRECT_ALIGN)
+
+struct io_pool {
+    void **free;
+    int nfree;
+    int cap;
+    pthread_mutex_t mutex;
+};
+
+
+/*** BUFFERS ***/
+
+struct io_pool *io_pool_init(void) {
+    struct io_pool *pool =
+        (struct io_pool *) lsm_malloc(sizeof(struct io_pool));
+    pool->cap = 16;
+    pool->nfree = 0;
+    pool->free = (void **) lsm_malloc(pool->cap*sizeof(void *));
+    pthread_mutex_init(&pool->mutex, NULL);
+    return pool;
+}
+
+void io_pool_destroy(struct io_pool *pool) {
+    for (int i = 0; i < pool->nfree; i++)
+        free(pool->free[i]);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->free);
+    free(pool);
+}
+
+/* an aligned stream buffer of DIRECT_BUF_BYTES, reused if one is free */
+void *io_pool_get(struct io_pool *pool) {
+    void *buf = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->nfree > 0)
+        buf = pool->free[--pool->nfree];
+    pthread_mutex_unlock(&pool->mutex);
+    return buf ? buf : lsm_aligned_alloc(DIRECT_ALIGN, DIRECT_BUF_BYTES);
+}
+
+void io_pool_put(struct io_pool *pool, void *buf) {
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->nfree == pool->cap) {
+        pool->cap *= 2;
+        pool->free = (void **) lsm_realloc(pool->free,
+            pool->cap*sizeof(void *));
+    }
+    pool->free[pool->nfree++] = buf;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+
+/*** FILES ***/
+
+/*
+ * set_direct_io:
+ * Turn O_DIRECT for the large disk-to-disk merges on (1) or off (0, the
+ * default). With it on these merges always go through subcompact(), on a
+ * single thread if set_subcompactions() allows no more
+ */
+void set_direct_io(struct lsm_tree *tree, int on) {
+    tree->direct_io = !!on;
+}
+
+/* open a file for direct I/O, or as usual if its filesystem has none */
+int direct_open(const char *path, int flags) {
+    int fd = open(path, flags | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL)
+        fd = open(path, flags, 0644);
+    return fd;
+}
+
+/*
+ * read the n pairs from position pos of a file into a stream buffer,
+ * whole blocks at a time. Returns where the first of them landed
+ */
+struct kv_pair *direct_read(int fd, size_t pos, size_t n, void *buf) {
+    assert(n <= DIRECT_PAIRS);
+    size_t from = pos*sizeof(struct kv_pair);
+    size_t to = from + n*sizeof(struct kv_pair);
+    size_t start = from - from % DIRECT_ALIGN;
+    size_t end = (to + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+
+    /* the last block of a file may come back short */
+    ssize_t r = pread(fd, buf, end - start, start);
+    assert(r >= (ssize_t) (to - start));
+    (void) r;
+    return (struct kv_pair *) ((char *) buf + (from - start));
+}
+
+/*
+ * append n pairs from the start of a stream buffer to a file, padded to a
+ * whole block. Only the last write to a file may be short of DIRECT_PAIRS
+ */
+void direct_write(int fd, void *buf, size_t n) {
+    size_t bytes = n*sizeof(struct kv_pair);
+    size_t padded = (bytes + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    ssize_t w = write(fd, buf, padded);
+    assert(w == (ssize_t) padded);
+    (void) w;
+}
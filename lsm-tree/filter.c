@@ -0,0 +1,226 @@
+/*
+ * This file contains the Bloom filters that let get() skip disk levels
+ * that cannot hold a key, and how their memory is split between levels.
+ *
+ * The tree has a budget of filter bits per key over all disk levels. With
+ * the same bits per key everywhere (FILTER_UNIFORM) every level has about
+ * the same false positive rate. A lookup for a missing key wastes the sum
+ * of the rates in reads, and the largest level holds most of the memory
+ * while saving no more of them than a small one. Following
+ * Monkey (FILTER_MONKEY), the rates are instead set proportional to the
+ * number of keys in each level, p_i = c*n_i, which minimizes their sum for
+ * a fixed total number of bits: small levels get many bits per key, and a
+ * level whose rate would reach 1 gets no filter at all.
+ *
+ * The split depends on how full the levels are, so it is recomputed every
+ * time compaction rewrites a level and that level's filter is rebuilt with
+ * its new share.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include "lsm_tree.h"
+
+struct point_filter {
+    size_t nkeys;
+    size_t nbits;
+    int hashes;
+    uint64_t *bits;
+};
+
+static uint64_t filter_hash(key_t key);
+static void point_filter_add(struct point_filter *pf, key_t key);
+static double point_filter_fpr(struct point_filter *pf);
+
+
+/*** ALLOCATION ***/
+
+/*
+ * set_filter:
+ * Choose the filter budget in bits per disk-level key and how it is split
+ * between levels (FILTER_UNIFORM or FILTER_MONKEY), and rebuild the
+ * filters of existing levels. A budget of 0 turns the filters off
+ */
+void set_filter(struct lsm_tree *tree, double bits, int policy) {
+    assert(bits >= 0);
+    assert(policy == FILTER_UNIFORM || policy == FILTER_MONKEY);
+    tree->filter_bits = bits;
+    tree->filter_policy = policy;
+    for (int i = 0; i < tree->nlevels; i++) {
+        struct level *level = tree->levels + i;
+        if (level->type != DISK_LEVEL)
+            continue;
+        point_filter_destroy(level->filter);
+        level->filter = NULL;
+        if (level->used > 0)
+            level->filter =
+                point_filter_build(level, filter_level_bits(tree, i));
+    }
+}
+
+/*
+ * the bits per key given to the filter of a disk level, from the current
+ * sizes of all disk levels
+ */
+double filter_level_bits(struct lsm_tree *tree, int levelno) {
+    struct level *level = tree->levels + levelno;
+    assert(level->type == DISK_LEVEL);
+    if (level->used == 0)
+        return 0;
+    if (tree->filter_policy == FILTER_UNIFORM)
+        return tree->filter_bits;
+
+    /* levels still in line for a filter */
+    int active[tree->nlevels];
+    double total = 0;
+    for (int i = 0; i < tree->nlevels; i++) {
+        active[i] = tree->levels[i].type == DISK_LEVEL
+            && tree->levels[i].used > 0;
+        if (active[i])
+            total += tree->levels[i].used;
+    }
+    double ln2sq = LN2*LN2;
+    double budget = tree->filter_bits*total*ln2sq;
+
+    /*
+     * with p_i = c*n_i, the bits are sum n_i*ln(1/p_i)/ln(2)^2, which
+     * gives ln c. Levels where that makes p_i >= 1 drop out, largest first
+     */
+    double lnc = 0;
+    while (1) {
+        double n = 0, nlogn = 0;
+        int drop = -1;
+        for (int i = 0; i < tree->nlevels; i++) {
+            if (!active[i])
+                continue;
+            n += tree->levels[i].used;
+            nlogn += tree->levels[i].used*log(tree->levels[i].used);
+        }
+        if (n == 0)
+            return 0;
+        lnc = -(budget + nlogn) / n;
+        for (int i = 0; i < tree->nlevels; i++) {
+            if (active[i] && lnc + log(tree->levels[i].used) >= 0
+                    && (drop < 0 || tree->levels[i].used
+                        > tree->levels[drop].used))
+                drop = i;
+        }
+        if (drop < 0)
+            break;
+        active[drop] = 0;
+    }
+
+    if (!active[levelno])
+        return 0;
+    return -(lnc + log(level->used)) / ln2sq;
+}
+
+/* print the bits per key and false positive rate of each level's filter */
+void filter_stat(struct lsm_tree *tree) {
+    if (tree->filter_bits == 0)
+        return;
+
+    double sum = 0;
+    size_t mem = 0;
+    for (int i = 0; i < tree->nlevels; i++) {
+        struct level *level = tree->levels + i;
+        if (level->type != DISK_LEVEL || level->used == 0)
+            continue;
+        double fpr = level->filter ? point_filter_fpr(level->filter) : 1;
+        sum += fpr;
+        mem += point_filter_memory(level->filter);
+        if (level->filter)
+            printf("LVL%d filter: %.2f bits/key, %d hashes, FPR %.4f%%\n",
+                i+1, (double) level->filter->nbits / level->filter->nkeys,
+                level->filter->hashes, fpr*100);
+        else
+            printf("LVL%d filter: none\n", i+1);
+    }
+    printf("Filters (%s, %.1f bits/key): %zu bytes, %.4f expected reads "
+        "per missing key\n", tree->filter_policy == FILTER_MONKEY
+        ? "monkey" : "uniform", tree->filter_bits, mem, sum);
+}
+
+
+/*** FILTERS ***/
+
+/*
+ * build a filter over the keys of a disk level with the given bits per
+ * key. Returns NULL if that is too few bits to be worth a filter
+ */
+struct point_filter *point_filter_build(struct level *level, double bits) {
+    assert(level->type == DISK_LEVEL);
+    if (level->used == 0 || bits < FILTER_MIN_BITS)
+        return NULL;
+
+    struct point_filter *pf =
+        (struct point_filter *) lsm_malloc(sizeof(struct point_filter));
+    pf->nkeys = level->used;
+    pf->nbits = ((size_t) (bits*level->used) + 63) & ~(size_t) 63;
+    pf->hashes = (int) (bits*LN2 + 0.5);
+    if (pf->hashes < 1)
+        pf->hashes = 1;
+    if (pf->hashes > FILTER_MAX_HASHES)
+        pf->hashes = FILTER_MAX_HASHES;
+    pf->bits = (uint64_t *) lsm_calloc(pf->nbits / 64, sizeof(uint64_t));
+
+    struct kv_pair buf[BLOCK_PAIRS];
+    fseek(level->d.file_ptr, 0, SEEK_SET);
+    for (size_t base = 0; base < level->used; base += BLOCK_PAIRS) {
+        size_t n = level->used - base < BLOCK_PAIRS
+            ? level->used - base : BLOCK_PAIRS;
+        fread(buf, sizeof(struct kv_pair), n, level->d.file_ptr);
+        for (size_t i = 0; i < n; i++)
+            point_filter_add(pf, buf[i].key);
+    }
+    return pf;
+}
+
+void point_filter_destroy(struct point_filter *pf) {
+    if (!pf)
+        return;
+    free(pf->bits);
+    free(pf);
+}
+
+/* BLOOM_NOTFOUND if the key is certainly not in the level */
+int point_filter_check(struct point_filter *pf, key_t key) {
+    uint64_t h = filter_hash(key);
+    uint64_t h1 = h, h2 = (h >> 32) | 1;
+    for (int i = 0; i < pf->hashes; i++) {
+        uint64_t bit = (h1 + i*h2) % pf->nbits;
+        if (!(pf->bits[bit / 64] & (1ull << (bit % 64))))
+            return BLOOM_NOTFOUND;
+    }
+    return BLOOM_FOUND;
+}
+
+/* bytes of memory used by the filter */
+size_t point_filter_memory(struct point_filter *pf) {
+    if (!pf)
+        return 0;
+    return sizeof(struct point_filter) + pf->nbits / 8;
+}
+
+static void point_filter_add(struct point_filter *pf, key_t key) {
+    uint64_t h = filter_hash(key);
+    uint64_t h1 = h, h2 = (h >> 32) | 1;
+    for (int i = 0; i < pf->hashes; i++) {
+        uint64_t bit = (h1 + i*h2) % pf->nbits;
+        pf->bits[bit / 64] |= 1ull << (bit % 64);
+    }
+}
+
+/* expected false positive rate, (1 - e^(-kn/m))^k */
+static double point_filter_fpr(struct point_filter *pf) {
+    return pow(1 - exp(-(double) pf->hashes*pf->nkeys / pf->nbits),
+        pf->hashes);
+}
+
+static uint64_t filter_hash(key_t key) {
+    uint64_t x = (uint64_t) (uint32_t) key * 0x9e3779b97f4a7c15ull;
+    x ^= x >> 31;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 29;
+    return x;
+}
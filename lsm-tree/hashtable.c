@@ -0,0 +1,275 @@
+/*
+ * This file contains an open-addressing hash table, used as the main-memory
+ * level in place of the sorted array for trees set up with MEMTABLE_HASH.
+ *
+ * Puts, gets and deletes are a hash and a short linear probe, with no
+ * search and nothing to shift, since the pairs are kept in no order at all.
+ * The table has at least twice as many slots as the level holds pairs, so
+ * probes stay short, and a remove shifts the rest of its probe run back so
+ * that no tombstones are needed.
+ *
+ * Key order is only needed when the level is flushed, or by a range query.
+ * Then the pairs are copied out and sorted once, on several threads if
+ * there are many of them, and positions in key order refer to that sorted
+ * copy until the next write.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include <unistd.h>
+#include "lsm_tree.h"
+
+struct hash_table {
+    /* a power of two slots, in use if valid is KV_VALID */
+    struct kv_pair *slots;
+    size_t mask;
+    size_t count;
+
+    /* the pairs in key order, if sorted is set, and merge space */
+    struct kv_pair *order;
+    struct kv_pair *scratch;
+    int sorted;
+    pthread_mutex_t sort_mutex;
+};
+
+/* one run of a parallel sort */
+struct sort_run {
+    struct kv_pair *pairs;
+    size_t num;
+};
+
+static size_t hash_slot(struct hash_table *ht, key_t key);
+static size_t hash_probe(struct hash_table *ht, key_t key);
+static void hash_remove_at(struct hash_table *ht, size_t i);
+static void hash_sort(struct hash_table *ht);
+static void *hash_sort_run(void *arg);
+static int hash_compare(const void *a, const void *b);
+
+
+/*** INITIALIZATION/CLEANUP ***/
+
+/* a table for up to size pairs */
+struct hash_table *hash_table_init(size_t size) {
+    struct hash_table *ht =
+        (struct hash_table *) lsm_malloc(sizeof(struct hash_table));
+    size_t nslots = 16;
+    while (nslots < 2*size)
+        nslots *= 2;
+    ht->slots = (struct kv_pair *) lsm_calloc(nslots, sizeof(struct kv_pair));
+    ht->mask = nslots - 1;
+    ht->count = 0;
+    ht->order = (struct kv_pair *) lsm_malloc(size*sizeof(struct kv_pair));
+    ht->scratch = (struct kv_pair *) lsm_malloc(size*sizeof(struct kv_pair));
+    ht->sorted = 1;
+    pthread_mutex_init(&ht->sort_mutex, NULL);
+    return ht;
+}
+
+void hash_table_destroy(struct hash_table *ht) {
+    if (!ht)
+        return;
+    pthread_mutex_destroy(&ht->sort_mutex);
+    free(ht->slots);
+    free(ht->order);
+    free(ht->scratch);
+    free(ht);
+}
+
+/* drop every pair in the table */
+void hash_table_clear(struct hash_table *ht) {
+    memset(ht->slots, 0, (ht->mask + 1)*sizeof(struct kv_pair));
+    ht->count = 0;
+    ht->sorted = 1;
+}
+
+
+/*** OPERATIONS ***/
+
+/* the stored pair of a key, valid until the next write, or NULL */
+struct kv_pair *hash_table_get(struct hash_table *ht, key_t key) {
+    size_t i = hash_probe(ht, key);
+    return ht->slots[i].valid == KV_VALID ? ht->slots + i : NULL;
+}
+
+/*
+ * insert or update a key-value pair. Returns HASH_TABLE_NEW if the key was
+ * not present, and HASH_TABLE_UPDATED otherwise
+ */
+int hash_table_insert(struct hash_table *ht, struct kv_pair *kv) {
+    size_t i = hash_probe(ht, kv->key);
+    int res = ht->slots[i].valid == KV_VALID
+        ? HASH_TABLE_UPDATED : HASH_TABLE_NEW;
+    ht->slots[i] = *kv;
+    ht->slots[i].valid = KV_VALID;
+    ht->count += res == HASH_TABLE_NEW;
+    ht->sorted = 0;
+    return res;
+}
+
+/* remove a key. Returns 1 if it was present and 0 otherwise */
+int hash_table_remove(struct hash_table *ht, key_t key) {
+    size_t i = hash_probe(ht, key);
+    if (ht->slots[i].valid != KV_VALID)
+        return 0;
+    hash_remove_at(ht, i);
+    return 1;
+}
+
+/* remove every key in [bottom, top). Returns the number removed */
+size_t hash_table_remove_range(struct hash_table *ht, key_t bottom,
+        key_t top) {
+    size_t removed = 0;
+    if (top <= bottom || ht->count == 0)
+        return 0;
+
+    /* a removal can shift a pair into the slot just checked, so recheck */
+    for (size_t i = 0; i <= ht->mask; ) {
+        struct kv_pair *kv = ht->slots + i;
+        if (kv->valid == KV_VALID && kv->key >= bottom && kv->key < top) {
+            hash_remove_at(ht, i);
+            removed++;
+        } else {
+            i++;
+        }
+    }
+    return removed;
+}
+
+/*
+ * position in key order of the first pair with a key not less than key,
+ * sorting the pairs first if a write has happened since they last were
+ */
+size_t hash_table_find(struct hash_table *ht, key_t key) {
+    hash_table_sort(ht);
+    size_t bottom = 0;
+    size_t top = ht->count;
+    size_t middle;
+
+    while (top > bottom) {
+        middle = (top + bottom)/2;
+        if (ht->order[middle].key < key)
+            bottom = middle+1;
+        else
+            top = middle;
+    }
+    return bottom;
+}
+
+/* the pair at position pos in key order, or NULL if pos is past the end */
+struct kv_pair *hash_table_at(struct hash_table *ht, size_t pos) {
+    hash_table_sort(ht);
+    return pos < ht->count ? ht->order + pos : NULL;
+}
+
+/*
+ * put the pairs in key order, unless they already are. Called before a
+ * flush, and by the first range query after a write
+ */
+void hash_table_sort(struct hash_table *ht) {
+    if (ht->sorted)
+        return;
+    pthread_mutex_lock(&ht->sort_mutex);
+    if (!ht->sorted) {
+        hash_sort(ht);
+        __sync_synchronize();
+        ht->sorted = 1;
+    }
+    pthread_mutex_unlock(&ht->sort_mutex);
+}
+
+
+/*** HELPERS ***/
+
+static size_t hash_slot(struct hash_table *ht, key_t key) {
+    uint64_t h = (uint64_t) (uint32_t) key * 0x9e3779b97f4a7c15ull;
+    return (size_t) (h >> 32) & ht->mask;
+}
+
+/* the slot holding key, or the empty slot ending its probe run */
+static size_t hash_probe(struct hash_table *ht, key_t key) {
+    size_t i = hash_slot(ht, key);
+    while (ht->slots[i].valid == KV_VALID && ht->slots[i].key != key)
+        i = (i + 1) & ht->mask;
+    return i;
+}
+
+/*
+ * empty slot i, moving back any later pair of its probe run that could
+ * not be found past the hole otherwise
+ */
+static void hash_remove_at(struct hash_table *ht, size_t i) {
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & ht->mask;
+        if (ht->slots[j].valid != KV_VALID)
+            break;
+
+        /* the pair at j can move to i if its home is not in (i, j] */
+        size_t home = hash_slot(ht, ht->slots[j].key);
+        if (((j - home) & ht->mask) >= ((j - i) & ht->mask)) {
+            ht->slots[i] = ht->slots[j];
+            i = j;
+        }
+    }
+    memset(ht->slots + i, 0, sizeof(struct kv_pair));
+    ht->count--;
+    ht->sorted = 0;
+}
+
+/*
+ * copy the pairs out into order and sort them. Large tables are cut into
+ * a run per core, sorted on their own threads and then merged
+ */
+static void hash_sort(struct hash_table *ht) {
+    size_t n = 0;
+    for (size_t i = 0; i <= ht->mask; i++) {
+        if (ht->slots[i].valid == KV_VALID)
+            ht->order[n++] = ht->slots[i];
+    }
+    assert(n == ht->count);
+
+    int nruns = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nruns > HASH_SORT_MAX_THREADS)
+        nruns = HASH_SORT_MAX_THREADS;
+    if (n < HASH_SORT_MIN_PARALLEL || nruns < 2) {
+        qsort(ht->order, n, sizeof(struct kv_pair), hash_compare);
+        return;
+    }
+
+    struct sort_run runs[HASH_SORT_MAX_THREADS];
+    pthread_t tids[HASH_SORT_MAX_THREADS];
+    for (int r = 0; r < nruns; r++) {
+        runs[r].pairs = ht->order + n*r/nruns;
+        runs[r].num = n*(r+1)/nruns - n*r/nruns;
+        pthread_create(tids + r, NULL, hash_sort_run, runs + r);
+    }
+    for (int r = 0; r < nruns; r++)
+        pthread_join(tids[r], NULL);
+
+    /* keys are unique, so the smallest head is taken alone */
+    for (size_t out = 0; out < n; out++) {
+        int win = -1;
+        for (int r = 0; r < nruns; r++) {
+            if (runs[r].num > 0 && (win < 0
+                    || runs[r].pairs->key < runs[win].pairs->key))
+                win = r;
+        }
+        ht->scratch[out] = *runs[win].pairs++;
+        runs[win].num--;
+    }
+
+    struct kv_pair *tmp = ht->order;
+    ht->order = ht->scratch;
+    ht->scratch = tmp;
+}
+
+static void *hash_sort_run(void *arg) {
+    struct sort_run *run = (struct sort_run *) arg;
+    qsort(run->pairs, run->num, sizeof(struct kv_pair), hash_compare);
+    return NULL;
+}
+
+static int hash_compare(const void *a, const void *b) {
+    key_t ka = ((const struct kv_pair *) a)->key;
+    key_t kb = ((const struct kv_pair *) b)->key;
+    return (ka > kb) - (ka < kb);
+}
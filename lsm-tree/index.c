@@ -0,0 +1,201 @@
+/*
+ * This file contains the in-memory indexes kept for each disk level. Both
+ * kinds narrow a lookup down to a window of positions in the level file,
+ * which is then read with a single fread and searched in memory.
+ *
+ * INDEX_FENCE keeps the first key of every BLOCK_PAIRS-sized block.
+ * INDEX_LEARNED keeps a piecewise-linear model of key -> position, built
+ * greedily with a shrinking cone (as in FITing-trees) so that every key in
+ * the level is within LEARNED_EPSILON positions of its prediction. Since
+ * levels are immutable between migrations, the model is rebuilt whenever
+ * a level is rewritten.
+ */
+
+#include <float.h>
+#include "lsm_tree.h"
+
+struct segment {
+    key_t key;
+    size_t pos;
+    double slope;
+};
+
+struct index {
+    int type;
+
+    /* number of pairs covered by the index */
+    size_t used;
+
+    /* number of fences or segments */
+    size_t num;
+    key_t *fences;
+    struct segment *segments;
+};
+
+static void index_build_fences(struct index *idx, struct level *level);
+static void index_build_learned(struct index *idx, struct level *level);
+static size_t index_segment(struct index *idx, key_t key);
+
+
+/*** INITIALIZATION/CLEANUP ***/
+
+/*
+ * build an index of the given type over the valid pairs of a disk level
+ */
+struct index *index_build(struct level *level, int type) {
+    assert(level->type == DISK_LEVEL);
+    assert(type == INDEX_FENCE || type == INDEX_LEARNED);
+
+    struct index *idx = (struct index *) lsm_malloc(sizeof(struct index));
+    idx->type = type;
+    idx->used = level->used;
+    idx->num = 0;
+    idx->fences = NULL;
+    idx->segments = NULL;
+
+    if (type == INDEX_FENCE)
+        index_build_fences(idx, level);
+    else
+        index_build_learned(idx, level);
+    return idx;
+}
+
+void index_destroy(struct index *idx) {
+    if (!idx)
+        return;
+    free(idx->fences);
+    free(idx->segments);
+    free(idx);
+}
+
+/* one fence (the smallest key) per block */
+static void index_build_fences(struct index *idx, struct level *level) {
+    size_t nblocks = (level->used + BLOCK_PAIRS - 1) / BLOCK_PAIRS;
+    idx->fences = (key_t *) lsm_malloc(nblocks*sizeof(key_t));
+
+    struct kv_pair kv;
+    for (size_t b = 0; b < nblocks; b++) {
+        fseek(level->d.file_ptr, b*BLOCK_PAIRS*sizeof(struct kv_pair), SEEK_SET);
+        fread(&kv, sizeof(struct kv_pair), 1, level->d.file_ptr);
+        idx->fences[b] = kv.key;
+    }
+    idx->num = nblocks;
+}
+
+/*
+ * Greedy piecewise-linear fit. A segment starts at its first pair and keeps
+ * the range of slopes [lo, hi] for which every pair seen so far is within
+ * LEARNED_EPSILON of the line; when a pair empties that range, a new segment
+ * starts at it.
+ */
+static void index_build_learned(struct index *idx, struct level *level) {
+    size_t cap = 16;
+    idx->segments = (struct segment *) lsm_malloc(cap*sizeof(struct segment));
+
+    struct kv_pair buf[BLOCK_PAIRS];
+    struct segment *seg = NULL;
+    double lo = 0, hi = DBL_MAX;
+
+    fseek(level->d.file_ptr, 0, SEEK_SET);
+    for (size_t base = 0; base < level->used; base += BLOCK_PAIRS) {
+        size_t n = level->used - base < BLOCK_PAIRS
+            ? level->used - base : BLOCK_PAIRS;
+        fread(buf, sizeof(struct kv_pair), n, level->d.file_ptr);
+
+        for (size_t i = 0; i < n; i++) {
+            size_t pos = base + i;
+            if (seg) {
+                double dx = (double) buf[i].key - (double) seg->key;
+                double dy = (double) pos - (double) seg->pos;
+                double slo = (dy - LEARNED_EPSILON) / dx;
+                double shi = (dy + LEARNED_EPSILON) / dx;
+                if (slo <= hi && shi >= lo) {
+                    lo = slo > lo ? slo : lo;
+                    hi = shi < hi ? shi : hi;
+                    continue;
+                }
+                seg->slope = hi == DBL_MAX ? 0 : (lo + hi) / 2;
+            }
+
+            /* start a new segment at this pair */
+            if (idx->num == cap) {
+                cap *= 2;
+                idx->segments = (struct segment *) lsm_realloc(idx->segments,
+                    cap*sizeof(struct segment));
+            }
+            seg = idx->segments + idx->num++;
+            seg->key = buf[i].key;
+            seg->pos = pos;
+            seg->slope = 0;
+            lo = 0;
+            hi = DBL_MAX;
+        }
+    }
+    if (seg)
+        seg->slope = hi == DBL_MAX ? 0 : (lo + hi) / 2;
+
+    idx->segments = (struct segment *) lsm_realloc(idx->segments,
+        (idx->num ? idx->num : 1)*sizeof(struct segment));
+}
+
+
+/*** LOOKUP ***/
+
+/*
+ * narrow the search for key to positions [*bottom, *top) of the level. If
+ * the key is in the level, it is in this window. Returns 1 if the position
+ * a missing key would sort at is in the window too, as it is with fences
+ */
+int index_window(struct index *idx, key_t key, size_t *bottom, size_t *top) {
+    *bottom = 0;
+    *top = idx->used;
+    if (idx->num == 0)
+        return 1;
+
+    size_t s = index_segment(idx, key);
+    if (idx->type == INDEX_FENCE) {
+        *bottom = s*BLOCK_PAIRS;
+        if (*bottom + BLOCK_PAIRS < idx->used)
+            *top = *bottom + BLOCK_PAIRS;
+        return 1;
+    }
+
+    struct segment *seg = idx->segments + s;
+    double pred = (double) seg->pos
+        + seg->slope * ((double) key - (double) seg->key);
+    size_t p = pred < 0 ? 0 : (size_t) pred;
+    if (p >= idx->used)
+        p = idx->used - 1;
+
+    *bottom = p > LEARNED_EPSILON ? p - LEARNED_EPSILON : 0;
+    if (p + LEARNED_EPSILON + 2 < idx->used)
+        *top = p + LEARNED_EPSILON + 2;
+    return 0;
+}
+
+/* the last fence or segment starting at or below key (0 if none does) */
+static size_t index_segment(struct index *idx, key_t key) {
+    size_t bottom = 0;
+    size_t top = idx->num;
+    size_t middle;
+
+    while (top > bottom) {
+        middle = (top + bottom)/2;
+        key_t first = idx->type == INDEX_FENCE
+            ? idx->fences[middle] : idx->segments[middle].key;
+        if (first <= key)
+            bottom = middle+1;
+        else
+            top = middle;
+    }
+    return bottom > 0 ? bottom-1 : 0;
+}
+
+/* bytes of memory used by the index */
+size_t index_memory(struct index *idx) {
+    if (!idx)
+        return 0;
+    if (idx->type == INDEX_FENCE)
+        return sizeof(struct index) + idx->num*sizeof(key_t);
+    return sizeof(struct index) + idx->num*sizeof(struct segment);
+}
@@ -5,31 +5,58 @@
  * By Carl Denton
  */
 
+#include <limits.h>
 #include "lsm_tree.h"
 
 //#define _USE_BLOOM
 #define BLOOM_NUM 2
 
+/* the pairs one level contributes to a range query, in key order */
+struct range_run {
+    struct kv_pair *pairs;
+    size_t num;
+    size_t pos;
+};
+
 /* initialization/cleanup helper functions */
 static void main_level_init(struct lsm_tree *tree, size_t *sizes, int levelno);
-static void disk_level_init(struct lsm_tree *tree, size_t *sizes, int levelno);
 static void level_destroy(struct level *level);
+static void level_refresh(struct lsm_tree *tree, int levelno);
+static int flush_append(struct lsm_tree *tree);
+static void level_purge(struct lsm_tree *tree, int levelno, 
+    struct rtomb_set *set);
+static void level_range(struct level *level, key_t bottom, key_t top,
+    struct rtomb_set *dead, struct range_run *run, struct arena *arena);
+static void level_read(struct level *level, size_t from, size_t to,
+    struct range_run *run);
+
+/* compaction */
+static void compact(struct lsm_tree *tree);
+static int cascade_depth(struct lsm_tree *tree);
 
 /* main level operations */
 static void main_level_insert(struct lsm_tree *tree, struct kv_pair *kv);
+#ifndef _USE_BTREE
 static size_t main_level_find(struct level *level, key_t key);
+#endif
 static int main_level_get(struct level *level, key_t key, struct kv_pair *res);
+static void main_level_purge(struct level *level, key_t bottom, key_t top);
 
 /* disk level operations */
 static void disk_level_insert(struct lsm_tree *tree, struct kv_pair *kv);
 static size_t disk_level_find(struct level *level, key_t key);
 static int disk_level_get(struct level *level, key_t key, struct kv_pair *res);
+static void disk_level_purge(struct level *level, struct rtomb_set *set);
+static void disk_level_copy(struct level *level, size_t from, size_t to,
+    size_t dst);
 
 /* printing */
 static void print_level(struct level *level);
 
 void *put_thread(void *arg);
 void *delete_thread(void *arg);
+void *range_delete_thread(void *arg);
+void *write_batch_thread(void *arg);
 void *get_thread(void *arg);
 
 /*** INITIALIZATION/CLEANUP ***/
@@ -45,10 +72,10 @@ struct lsm_tree *init(const char* name, int total_num, int main_num,
     assert(name);
 
     /* allocate space for the table */
-    struct lsm_tree* tree = malloc(sizeof(struct lsm_tree));
+    struct lsm_tree* tree = lsm_malloc(sizeof(struct lsm_tree));
 
     /* copy the name */
-    tree->name = malloc(strlen(name) + 1);
+    tree->name = lsm_malloc(strlen(name) + 1);
     strcpy(tree->name, name);
     
     /* assign level numbers */
@@ -57,9 +84,24 @@ struct lsm_tree *init(const char* name, int total_num, int main_num,
     tree->nlevels = total_num;
     tree->nlevels_main = main_num;
     tree->nlevels_disk = disk_num;
+    tree->index_type = INDEX_FENCE;
+    tree->filter_bits = FILTER_BITS;
+    tree->filter_policy = FILTER_MONKEY;
+    tree->throttle = throttle_init();
+    tree->subcompactions = 0;
+    tree->direct_io = 0;
+    tree->io_pool = io_pool_init();
+    tree->compaction = COMPACT_FULL;
+    tree->cache = NULL;
+    tree->trace = NULL;
+    tree->tuner = NULL;
     
-    /* allocate space for array of levels */
-    tree->levels = (struct level *) malloc(tree->nlevels*sizeof(struct level));
+    /*
+     * allocate space for array of levels, with room for the auto-tuner to
+     * add levels in place: they hold mutexes and may not move
+     */
+    int room = total_num > TUNE_MAX_LEVELS ? total_num : TUNE_MAX_LEVELS;
+    tree->levels = (struct level *) lsm_malloc(room*sizeof(struct level));
     
     /* initialize levels */
     for (int i = 0; i < tree->nlevels; i++) {
@@ -79,26 +121,75 @@ struct lsm_tree *init(const char* name, int total_num, int main_num,
  * TODO: Not yet robust against failure
  */
 int destroy(struct lsm_tree *tree) {
+    trace_destroy(tree->trace);
+    tune_destroy(tree->tuner);
     free(tree->name);
     for (int i = 0; i < tree->nlevels; i++) 
         level_destroy(tree->levels + i);
 
     free(tree->levels);
+    throttle_destroy(tree->throttle);
+    io_pool_destroy(tree->io_pool);
+    cache_destroy(tree->cache);
     free(tree);
     return 0;
 }
 
+/*
+ * set_index:
+ * Choose the kind of index kept for each disk level (INDEX_NONE, 
+ * INDEX_FENCE or INDEX_LEARNED) and rebuild the indexes of existing levels
+ */
+void set_index(struct lsm_tree *tree, int type) {
+    assert(type == INDEX_NONE || type == INDEX_FENCE || type == INDEX_LEARNED);
+    tree->index_type = type;
+    for (int i = 0; i < tree->nlevels; i++)
+        level_refresh(tree, i);
+}
+
+/*
+ * set_memtable:
+ * Keep the main level in key order (MEMTABLE_SORTED, the default) or in a
+ * hash table that is only sorted when it is flushed (MEMTABLE_HASH), which
+ * makes writes and point lookups O(1) but range queries on it dearer. Only
+ * allowed while the main level is empty, so call it right after init()
+ */
+void set_memtable(struct lsm_tree *tree, int type) {
+    assert(type == MEMTABLE_SORTED || type == MEMTABLE_HASH);
+    for (int i = 0; i < tree->nlevels_main; i++) {
+        struct level *level = tree->levels + i;
+        assert(level->used == 0);
+        hash_table_destroy(level->m.ht);
+        level->m.ht = type == MEMTABLE_HASH 
+            ? hash_table_init(level->size) : NULL;
+#ifndef _USE_BTREE
+        /* the sorted array is only needed without a table */
+        free(level->m.arr);
+        level->m.arr = level->m.ht ? NULL 
+            : (struct kv_pair *) lsm_calloc(level->size, sizeof(struct kv_pair));
+#endif
+    }
+}
+
 static void main_level_init(struct lsm_tree *tree, size_t *sizes, int levelno) {
     struct level *level = tree->levels + levelno;
     size_t size = sizes[levelno];
     level->type = MAIN_LEVEL;
     level->size = size;
     level->used = 0;
+    level->filter = NULL;
+    level->index = NULL;
+    level->rfilter = NULL;
+    level->summary = NULL;
+    level->parts = NULL;
+    level->compact_next = INT_MIN;
+    rtomb_init(&level->rtombs);
 #ifdef _USE_BTREE
-    level->bt = (struct b_tree *) malloc(sizeof(struct b_tree));
+    level->m.bt = b_tree_init();
 #else
-    level->m.arr = (struct kv_pair *) calloc(size, sizeof(struct kv_pair));
+    level->m.arr = (struct kv_pair *) lsm_calloc(size, sizeof(struct kv_pair));
 #endif
+    level->m.ht = NULL;
 
     pthread_mutex_init(&level->mutex, NULL);
 
@@ -107,20 +198,30 @@ static void main_level_init(struct lsm_tree *tree, size_t *sizes, int levelno) {
 #endif
 };
 
-static void disk_level_init(struct lsm_tree *tree, size_t *sizes, int levelno) {
+void disk_level_init(struct lsm_tree *tree, size_t *sizes, int levelno) {
     struct level *level = tree->levels + levelno;
     size_t size = sizes[levelno];
 
     level->type = DISK_LEVEL;
     level->size = size;
     level->used = 0;
+    level->filter = NULL;
+    level->index = NULL;
+    level->rfilter = NULL;
+    level->summary = NULL;
+    level->parts = NULL;
+    level->compact_next = INT_MIN;
+    rtomb_init(&level->rtombs);
 
     pthread_mutex_init(&level->mutex, NULL);
 
     size_t buflen = 256;
-    assert(buflen > strlen(tree->name) + 10);
-    level->d.filename = (char *) malloc(buflen);
-    snprintf(level->d.filename, buflen, "%s.level%d.bin", tree->name, levelno);
+    assert(buflen > strlen(tree->name) + 20);
+    level->d.version = 0;
+    level->d.shared = 0;
+    level->d.readahead = RANGE_READAHEAD;
+    level->d.filename = (char *) lsm_malloc(buflen);
+    level_filename(tree, levelno, level->d.filename, buflen);
     level->d.file_ptr = fopen(level->d.filename, "wb+");
 
     /* expand the file to the requested size */
@@ -131,10 +232,6 @@ static void disk_level_init(struct lsm_tree *tree, size_t *sizes, int levelno) {
     blank_kv.valid = KV_INVAL;
     for (size_t i = 0; i < level->size; i++) 
         fwrite(&blank_kv, sizeof(struct kv_pair), 1, level->d.file_ptr); 
-
-#ifdef _USE_BLOOM
-    level->bloom = bloom_init(BLOOM_NUM);
-#endif
 }
 
 struct arg {
@@ -143,19 +240,29 @@ struct arg {
     key_t key2;
     val_t val;
     char *filename;
+    struct kv_pair *kvs;
+    size_t num;
+
+    /* results */
+    val_t *valp;
+    int status;
 };
 
 int put(struct lsm_tree *tree, key_t key, val_t val) {
-    struct arg *a = (struct arg *) malloc(sizeof(struct arg));
-    a->tree = tree;
-    a->key1 = key;
-    a->val = val;
+    uint64_t start = trace_now(tree->trace);
+
+    /* the caller waits for the thread, so the argument can live here */
+    struct arg a;
+    a.tree = tree;
+    a.key1 = key;
+    a.val = val;
 
     pthread_t tid;
-    pthread_create(&tid, NULL, put_thread, (void *) a);
+    pthread_create(&tid, NULL, put_thread, (void *) &a);
     pthread_join(tid, NULL);
-    free(a);
 
+    trace_op(tree->trace, TRACE_PUT, key, val, start);
+    tune_op(tree->tuner, TRACE_PUT, 1);
     return 0;
 }
 
@@ -175,6 +282,7 @@ void *put_thread(void *arg) {
     kv.valid = KV_VALID;
 
     int res = 0;
+    throttle_write(tree);
 
     /* insert the new item into the now free level */
     if (tree->levels[0].type == MAIN_LEVEL)
@@ -185,19 +293,23 @@ void *put_thread(void *arg) {
         assert(0);
     (void) res;
 
+    if (tree->cache)
+        cache_invalidate(tree->cache, key);
     return NULL;
 }
 
 int delete(struct lsm_tree *tree, key_t key) {
-    struct arg *a = (struct arg *) malloc(sizeof(struct arg));
-    a->tree = tree;
-    a->key1 = key;
+    uint64_t start = trace_now(tree->trace);
+    struct arg a;
+    a.tree = tree;
+    a.key1 = key;
 
     pthread_t tid;
-    pthread_create(&tid, NULL, delete_thread, (void *) a);
+    pthread_create(&tid, NULL, delete_thread, (void *) &a);
     pthread_join(tid, NULL);
-    free(a);
 
+    trace_op(tree->trace, TRACE_DELETE, key, 0, start);
+    tune_op(tree->tuner, TRACE_DELETE, 1);
     return 0;
 }
 
@@ -212,6 +324,7 @@ void *delete_thread(void *arg) {
     kv.valid = KV_VALID;
 
     int res = 0;
+    throttle_write(tree);
     if (tree->levels->type == MAIN_LEVEL)
         main_level_insert(tree, &kv);
     else if (tree->levels->type == DISK_LEVEL)
@@ -219,79 +332,316 @@ void *delete_thread(void *arg) {
     else 
         assert(0);
     (void) res;
+
+    if (tree->cache)
+        cache_invalidate(tree->cache, key);
     return NULL;
 }
 
-void get(struct lsm_tree *tree, key_t key) {
-    struct arg *a = (struct arg *) malloc(sizeof(struct arg));
-    a->tree = tree;
-    a->key1 = key;
+/*
+ * apply a batch of puts and deletes (kvs[i].op is OP_ADD or OP_DEL) in
+ * order, handing the whole batch to a single thread
+ */
+int write_batch(struct lsm_tree *tree, struct kv_pair *kvs, size_t num) {
+    uint64_t start = trace_now(tree->trace);
+    struct arg a;
+    a.tree = tree;
+    a.kvs = kvs;
+    a.num = num;
 
     pthread_t tid;
-    pthread_create(&tid, NULL, get_thread, (void *) a);
+    pthread_create(&tid, NULL, write_batch_thread, (void *) &a);
     pthread_join(tid, NULL);
-    free(a);
+
+    trace_batch(tree->trace, kvs, num, start);
+    tune_op(tree->tuner, TRACE_BATCH, (long) num);
+    return 0;
 }
 
-void *get_thread(void *arg) {
+void *write_batch_thread(void *arg) {
     struct lsm_tree *tree = ((struct arg *) arg)->tree;
-    key_t key = ((struct arg *) arg)->key1;
+    struct kv_pair *kvs = ((struct arg *) arg)->kvs;
+    size_t num = ((struct arg *) arg)->num;
+
+    assert(tree->levels->type == MAIN_LEVEL);
+    for (size_t i = 0; i < num; i++) {
+        struct kv_pair kv = kvs[i];
+        assert(kv.op == OP_ADD || kv.op == OP_DEL);
+        if (kv.op == OP_DEL)
+            kv.val = 0;
+        kv.valid = KV_VALID;
+
+        throttle_write(tree);
+        main_level_insert(tree, &kv);
+        if (tree->cache)
+            cache_invalidate(tree->cache, kv.key);
+    }
+    return NULL;
+}
+
+/*
+ * delete every key in [bottom, top). The pairs in the main level are dropped
+ * right away, and a single range tombstone hides the pairs in deeper levels
+ * until compaction pushes it down and drops them
+ */
+int range_delete(struct lsm_tree *tree, key_t bottom, key_t top) {
+    uint64_t start = trace_now(tree->trace);
+    struct arg a;
+    a.tree = tree;
+    a.key1 = bottom;
+    a.key2 = top;
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, range_delete_thread, (void *) &a);
+    pthread_join(tid, NULL);
+
+    trace_op(tree->trace, TRACE_RANGE_DELETE, bottom, top, start);
+    return 0;
+}
+
+void *range_delete_thread(void *arg) {
+    struct lsm_tree *tree = ((struct arg *) arg)->tree;
+    key_t bottom = ((struct arg *) arg)->key1;
+    key_t top = ((struct arg *) arg)->key2;
+
+    struct level *level = tree->levels;
+    assert(level->type == MAIN_LEVEL);
+
+    throttle_write(tree);
+    pthread_mutex_lock(&level->mutex);
+    main_level_purge(level, bottom, top);
+    if (tree->nlevels > 1)
+        rtomb_add(&level->rtombs, bottom, top);
+    pthread_mutex_unlock(&level->mutex);
+
+    if (tree->cache)
+        cache_invalidate_range(tree->cache, bottom, top);
+    return NULL;
+}
+
+/*
+ * look a key up. Returns GET_SUCCESS and sets *val if the key is present,
+ * and GET_FAIL if it is missing or deleted
+ */
+int get(struct lsm_tree *tree, key_t key, val_t *val) {
+    uint64_t start = trace_now(tree->trace);
+    struct arg a;
+    a.tree = tree;
+    a.key1 = key;
+    a.valp = val;
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, get_thread, (void *) &a);
+    pthread_join(tid, NULL);
+
+    trace_op(tree->trace, TRACE_GET, key, a.status, start);
+    tune_op(tree->tuner, TRACE_GET, a.status);
+    return a.status;
+}
+
+void *get_thread(void *arg) {
+    struct arg *a = (struct arg *) arg;
+    a->status = tree_get(a->tree, a->key1, a->valp);
+    return NULL;
+}
+
+/*
+ * look a key up on the calling thread, through the row cache if there is
+ * one. Returns like get()
+ */
+int tree_get(struct lsm_tree *tree, key_t key, val_t *val) {
+    struct kv_pair kv;
+    unsigned gen;
+    if (tree->cache && cache_get(tree->cache, key, &kv, &gen) == CACHE_HIT) {
+        if (kv.op != OP_ADD)
+            return GET_FAIL;
+        *val = kv.val;
+        return GET_SUCCESS;
+    }
+
+    int r = levels_get(tree->levels, tree->nlevels, key, &kv);
+    if (tree->cache) {
+        /* cache misses as tombstones */
+        if (r != GET_SUCCESS) {
+            kv.key = key;
+            kv.val = 0;
+            kv.op = OP_DEL;
+        }
+        cache_fill(tree->cache, &kv, gen);
+    }
+    if (r == GET_SUCCESS)
+        *val = kv.val;
+    return r;
+}
 
-    struct kv_pair *retval = (struct kv_pair *) malloc(sizeof(struct kv_pair));
+/*
+ * look a key up in an array of levels, newest first. Returns GET_SUCCESS
+ * and sets res if the key is present, and GET_FAIL if it is missing or
+ * deleted. Shared by the tree and by snapshots of it
+ */
+int levels_get(struct level *levels, int nlevels, key_t key, 
+        struct kv_pair *res) {
     int r;
-    for (int i = 0; i < tree->nlevels; i++) {
-        assert((tree->levels + i)->type == MAIN_LEVEL 
-            || (tree->levels + i)->type == DISK_LEVEL);
-        if ((tree->levels + i)->type == MAIN_LEVEL) {
-            r = main_level_get(tree->levels + i, key, retval);
+    for (int i = 0; i < nlevels; i++) {
+        struct level *level = levels + i;
+        assert(level->type == MAIN_LEVEL || level->type == DISK_LEVEL);
+        if (level->type == MAIN_LEVEL) {
+            r = main_level_get(level, key, res);
         } else {
-            r = disk_level_get(tree->levels + i, key, retval);
+            r = disk_level_get(level, key, res);
         }
 
         assert(r == GET_SUCCESS || r == GET_FAIL);
-        if (r == GET_SUCCESS) assert(retval->op == OP_ADD || retval->op == OP_DEL);
+        if (r == GET_SUCCESS) {
+            assert(res->op == OP_ADD || res->op == OP_DEL);
+            return res->op == OP_ADD ? GET_SUCCESS : GET_FAIL;
+        }
+        if (rtomb_covers(&level->rtombs, key))
+            return GET_FAIL;
+    }
+    return GET_FAIL;
+}
 
-        if (r == GET_SUCCESS && retval->op == OP_ADD) {
-            printf("%d\n", retval->val);
-            break;
-        } else if (r == GET_SUCCESS && retval->op == OP_DEL) {
-            printf("\n");
-            break;
-        } else if (r == GET_FAIL && i == tree->nlevels-1)
-            printf("\n");
+/*
+ * range:
+ * Copy the live pairs with keys in [bottom, top) into buf in key order, up
+ * to cap of them. Returns the number of pairs in the range, which is more
+ * than cap if buf was too small
+ */
+size_t range(struct lsm_tree *tree, key_t bottom, key_t top, 
+        struct kv_pair *buf, size_t cap) {
+    uint64_t start = trace_now(tree->trace);
+    struct range_buf rb;
+    rb.buf = buf;
+    rb.cap = cap;
+    rb.num = 0;
+    levels_range_each(tree->levels, tree->nlevels, bottom, top, 
+        range_buf_add, &rb);
+    trace_op(tree->trace, TRACE_RANGE, bottom, top, start);
+    tune_op(tree->tuner, TRACE_RANGE, (long) rb.num);
+    return rb.num;
+}
+
+/*
+ * range_each:
+ * Call fn on each live pair with a key in [bottom, top), in key order,
+ * until it returns nonzero. Returns the number of calls made
+ */
+size_t range_each(struct lsm_tree *tree, key_t bottom, key_t top, 
+        range_fn fn, void *ctx) {
+    uint64_t start = trace_now(tree->trace);
+    size_t calls = levels_range_each(tree->levels, tree->nlevels, bottom, 
+        top, fn, ctx);
+    trace_op(tree->trace, TRACE_RANGE, bottom, top, start);
+    tune_op(tree->tuner, TRACE_RANGE, (long) calls);
+    return calls;
+}
+
+/* a range_fn that copies pairs into a range_buf */
+int range_buf_add(key_t key, val_t val, void *ctx) {
+    struct range_buf *rb = (struct range_buf *) ctx;
+    if (rb->num < rb->cap) {
+        rb->buf[rb->num].key = key;
+        rb->buf[rb->num].val = val;
+        rb->buf[rb->num].op = OP_ADD;
+        rb->buf[rb->num].valid = KV_VALID;
+    }
+    rb->num++;
+    return 0;
+}
+
+/* run fn over a range of an array of levels, as range_each() does */
+size_t levels_range_each(struct level *levels, int nlevels, key_t bottom, 
+        key_t top, range_fn fn, void *ctx) {
+    struct arena *arena = arena_thread();
+    struct kv_node *head = levels_range(levels, nlevels, bottom, top, arena);
+    size_t calls = 0;
+
+    for (; head; head = head->next_node) {
+        calls++;
+        if (fn(head->kv.key, head->kv.val, ctx))
             break;
     }
-    return NULL;
+    arena_reset(arena);
+    return calls;
 }
 
-void range(struct lsm_tree *tree, key_t bottom, key_t top) {
-    struct kv_node *head = NULL;
-    for (int i = 0; i < tree->nlevels; i++) {
-        assert(tree->levels->type == MAIN_LEVEL || tree->levels->type == DISK_LEVEL);
-        if (tree->levels->type == MAIN_LEVEL)
-            main_level_range(tree->levels + i, bottom, top, &head);
-        else
-            disk_level_range(tree->levels + i, bottom, top, &head);
+/*
+ * collect the live pairs in [bottom, top) from an array of levels into a
+ * clean list, allocated from arena. Each level is read into a sorted run,
+ * and the runs are merged keeping the newest version of each key. Shared
+ * by the tree and by snapshots of it
+ */
+struct kv_node *levels_range(struct level *levels, int nlevels, 
+        key_t bottom, key_t top, struct arena *arena) {
+    struct range_run *runs = (struct range_run *) arena_alloc(arena,
+        nlevels*sizeof(struct range_run), sizeof(void *));
+
+    /* start reading every disk level's part of the range at once */
+    for (int i = 0; i < nlevels; i++) {
+        struct level *level = levels + i;
+        if (level->type == DISK_LEVEL && level->used > 0 && top > bottom
+                && !(level->rfilter && range_filter_check(level->rfilter,
+                bottom, top) == RFILTER_NOTFOUND))
+            level_readahead(level, level_find(level, bottom),
+                level_find(level, top));
     }
 
-    range_clean_list(&head);
+    /* keys hidden by range tombstones in the levels above */
+    struct rtomb_set dead;
+    rtomb_init(&dead);
+    for (int i = 0; i < nlevels; i++) {
+        struct level *level = levels + i;
+        assert(level->type == MAIN_LEVEL || level->type == DISK_LEVEL);
+        level_range(level, bottom, top, &dead, runs + i, arena);
+        rtomb_merge(&dead, &level->rtombs);
+    }
+    rtomb_destroy(&dead);
 
-    while (head) {
-        printf("%d:%d ", head->kv.key, head->kv.val);
-        head = head->next_node;
+    struct kv_node *head = NULL;
+    struct kv_node **tail = &head;
+    while (1) {
+        /* the smallest key left, taken from the newest level holding it */
+        int win = -1;
+        for (int i = 0; i < nlevels; i++) {
+            if (runs[i].pos < runs[i].num && (win < 0 
+                    || runs[i].pairs[runs[i].pos].key 
+                    < runs[win].pairs[runs[win].pos].key))
+                win = i;
+        }
+        if (win < 0)
+            break;
+
+        struct kv_pair kv = runs[win].pairs[runs[win].pos];
+        for (int i = 0; i < nlevels; i++) {
+            if (runs[i].pos < runs[i].num 
+                    && runs[i].pairs[runs[i].pos].key == kv.key)
+                runs[i].pos++;
+        }
+        if (kv.op == OP_DEL)
+            continue;
+
+        struct kv_node *node = (struct kv_node *) arena_alloc(arena,
+            sizeof(struct kv_node), sizeof(void *));
+        node->kv = kv;
+        node->next_node = NULL;
+        *tail = node;
+        tail = &node->next_node;
     }
-    printf("\n");
+    return head;
 }
 
 void load(struct lsm_tree *tree, const char *filename) {
     FILE *fptr = fopen(filename, "rb");
     key_t key;
     val_t val;
-    while (1) {
-        fread(&key, sizeof(key_t), 1, fptr);
-        fread(&val, sizeof(val_t), 1, fptr);
+    if (!fptr)
+        return;
+    while (fread(&key, sizeof(key_t), 1, fptr) == 1 
+            && fread(&val, sizeof(val_t), 1, fptr) == 1) {
         put(tree, key, val);
     }
+    fclose(fptr);
 }
 
 void stat(struct lsm_tree *tree) {
@@ -310,6 +660,7 @@ void stat(struct lsm_tree *tree) {
             printf(", LVL%d: %ld", i+1, (tree->levels+i)->used);
     }
     printf("\n");
+    printf("Allocations: %ld\n", lsm_alloc_count());
     
     struct kv_pair kv;
     for (int i = 0; i < tree->nlevels; i++) {
@@ -319,6 +670,68 @@ void stat(struct lsm_tree *tree) {
         }
         printf("\n");
     }
+
+    filter_stat(tree);
+    cache_stat(tree);
+    throttle_stat(tree);
+    trace_stat(tree);
+    tune_stat(tree);
+}
+
+
+/*
+ * read the pairs of one level with keys in [bottom, top) that are not
+ * hidden by dead into a run, skipping empty levels and disk levels whose
+ * range filter rules them out
+ */
+static void level_range(struct level *level, key_t bottom, key_t top,
+        struct rtomb_set *dead, struct range_run *run, struct arena *arena) {
+    run->pairs = NULL;
+    run->num = 0;
+    run->pos = 0;
+    if (top <= bottom || level->used == 0 || (level->rfilter
+            && range_filter_check(level->rfilter, bottom, top)
+            == RFILTER_NOTFOUND))
+        return;
+
+    size_t cap = level_find(level, top) - level_find(level, bottom);
+    if (cap == 0)
+        return;
+    run->pairs = (struct kv_pair *) arena_alloc(arena, 
+        cap*sizeof(struct kv_pair), sizeof(key_t));
+
+    key_t lo = bottom;
+    for (size_t t = 0; t <= dead->num && lo < top; t++) {
+        key_t hi = top;
+        if (t < dead->num && dead->arr[t].bottom < top)
+            hi = dead->arr[t].bottom;
+
+        if (hi > lo && (level->type == MAIN_LEVEL || !level->rfilter 
+                || range_filter_check(level->rfilter, lo, hi) == RFILTER_FOUND)) {
+            /* find the end first, which leaves a B+-tree cursor at lo */
+            size_t to = level_find(level, hi);
+            size_t from = level_find(level, lo);
+            level_read(level, from, to, run);
+        }
+
+        if (t < dead->num && dead->arr[t].top > lo)
+            lo = dead->arr[t].top;
+    }
+}
+
+/* append the pairs at positions [from, to) of a level to a run */
+static void level_read(struct level *level, size_t from, size_t to,
+        struct range_run *run) {
+    if (to <= from)
+        return;
+
+    if (level->type == DISK_LEVEL) {
+        level_read_ahead(level, from, to, run->pairs + run->num);
+        run->num += to - from;
+        return;
+    }
+    for (size_t pos = from; pos < to; pos++)
+        read_pair(level, pos, run->pairs + run->num++);
 }
 
 
@@ -331,16 +744,34 @@ void stat(struct lsm_tree *tree) {
 static int main_level_get(struct level *level, key_t key, struct kv_pair *res) {
 #ifdef _USE_BLOOM
     /* check the bloom filter first */
-    if (bloom_check(level->bloom, key) == BLOOM_NOTFOUND) {
+    if (level->bloom && bloom_check(level->bloom, key) == BLOOM_NOTFOUND) {
         return GET_FAIL;
     } 
 #endif
 
+    if (level->m.ht) {
+        struct kv_pair *kv = hash_table_get(level->m.ht, key);
+        if (kv) {
+            *res = *kv;
+            return GET_SUCCESS;
+        }
+        return GET_FAIL;
+    }
+
+#ifdef _USE_BTREE
+    struct kv_pair *kv = b_tree_get(level->m.bt, key);
+    if (kv && kv->valid == KV_VALID) {
+        *res = *kv;
+        return GET_SUCCESS;
+    }
+#else
     size_t pos = main_level_find(level, key);
-    if (level->m.arr[pos].key == key && level->m.arr[pos].valid == KV_VALID) {
+    if (pos < level->used && level->m.arr[pos].key == key
+            && level->m.arr[pos].valid == KV_VALID) {
         *res = level->m.arr[pos];
         return GET_SUCCESS;
     } 
+#endif
     return GET_FAIL;
 }
 
@@ -349,11 +780,10 @@ static int main_level_get(struct level *level, key_t key, struct kv_pair *res) {
  * and sets res, and otherwise returns GET_FAIL
  */
 static int disk_level_get(struct level *level, key_t key, struct kv_pair *res) {
-#ifdef _USE_BLOOM    
-    if (bloom_check(level->bloom, key) == BLOOM_NOTFOUND) {
+    if (level->filter 
+            && point_filter_check(level->filter, key) == BLOOM_NOTFOUND) {
         return GET_FAIL;
     } 
-#endif
 
     size_t pos = disk_level_find(level, key);
     struct kv_pair kv;
@@ -376,19 +806,51 @@ static void main_level_insert(struct lsm_tree *tree, struct kv_pair *kv) {
 
     /* migrate if necessary */
     if (level->used == level->size) {
-        migrate(tree, 0);
+        compact(tree);
     }
 
     pthread_mutex_lock(&level->mutex);
-    /* find the position to insert this key */
-    size_t pos = main_level_find(level, kv->key);
+    if (level->m.ht) {
+        if (kv->op == OP_DEL && tree->nlevels == 1)
+            level->used -= hash_table_remove(level->m.ht, kv->key);
+        else if (hash_table_insert(level->m.ht, kv) == HASH_TABLE_NEW)
+            level->used++;
+#ifdef _USE_BLOOM
+        bloom_add(level->bloom, kv->key);
+#endif
+        pthread_mutex_unlock(&level->mutex);
+        return;
+    }
+
+#ifdef _USE_BTREE
+    /* anything left in the tree after a migrate is stale */
+    if (level->used == 0 && level->m.bt->count > 0)
+        b_tree_clear(level->m.bt);
+
+    /* if this is the last level and we're deleting, get rid of this */
+    if (kv->op == OP_DEL && tree->nlevels == 1) {
+        if (b_tree_remove(level->m.bt, kv->key))
+            level->used--;
+    } else if (b_tree_insert(level->m.bt, kv) == B_TREE_NEW) {
+        level->used++;
+    }
+#else
+    /* 
+     * find the position to insert this key. A new largest key goes at the
+     * end without a search, and then there is nothing to shift
+     */
+    size_t pos;
+    if (level->used == 0 || kv->key > level->m.arr[level->used-1].key)
+        pos = level->used;
+    else
+        pos = main_level_find(level, kv->key);
 
     /* case 1: the key does not yet exist in this level */
     if ((level->m.arr[pos].key != kv->key && level->m.arr[pos].valid == KV_VALID) 
             || level->m.arr[pos].valid == KV_INVAL) {
 
         memmove(level->m.arr+pos+1, level->m.arr+pos, 
-            (level->size-pos-1)*sizeof(struct kv_pair));
+            (level->used-pos)*sizeof(struct kv_pair));
         level->m.arr[pos] = *kv;
         level->m.arr[pos].valid = KV_VALID;
         level->used++;
@@ -400,12 +862,13 @@ static void main_level_insert(struct lsm_tree *tree, struct kv_pair *kv) {
 
     /* if this is the last level and we're deleting, get rid of this */
     if (level->m.arr[pos].key == kv->key && level->m.arr[pos].valid == KV_VALID 
-            && kv->op == OP_DEL) {
+            && kv->op == OP_DEL && tree->nlevels == 1) {
         memmove(level->m.arr+pos, level->m.arr+pos+1, 
-            (level->size-pos)*sizeof(struct kv_pair));
-        invalidate_kv(level, level->size-1);
+            (level->used-pos-1)*sizeof(struct kv_pair));
+        invalidate_kv(level, level->used-1);
         level->used--;
     }
+#endif
 
 #ifdef _USE_BLOOM
     /* add to the bloom filter */
@@ -415,6 +878,36 @@ static void main_level_insert(struct lsm_tree *tree, struct kv_pair *kv) {
 }
 
 
+/* 
+ * drop every pair in [bottom, top) from a main-memory level. Assumes that
+ * the level lock is held
+ */
+static void main_level_purge(struct level *level, key_t bottom, key_t top) {
+    assert(level->type == MAIN_LEVEL);
+    if (top <= bottom)
+        return;
+    if (level->m.ht) {
+        level->used -= hash_table_remove_range(level->m.ht, bottom, top);
+        return;
+    }
+#ifdef _USE_BTREE
+    level->used -= b_tree_remove_range(level->m.bt, bottom, top);
+#else
+    size_t lo = main_level_find(level, bottom);
+    size_t hi = main_level_find(level, top);
+    size_t n = hi - lo;
+    if (n == 0)
+        return;
+
+    memmove(level->m.arr+lo, level->m.arr+hi, 
+        (level->used-hi)*sizeof(struct kv_pair));
+    for (size_t pos = level->used-n; pos < level->used; pos++)
+        invalidate_kv(level, pos);
+    level->used -= n;
+#endif
+}
+
+
 /* 
  * this function  may actually work, but there's no reason we should use it,
  * so ignore it for now
@@ -468,6 +961,7 @@ static void disk_level_insert(struct lsm_tree *tree, struct kv_pair *kv) {
 }
 
 
+#ifndef _USE_BTREE
 /* do binary search on a sorted array in main memory. Assumes 
  * that the level lock is held
  */
@@ -488,14 +982,54 @@ static size_t main_level_find(struct level *level, key_t key) {
     }
     return bottom;
 }
+#endif
 
-/* do binary search on a sorted array on disk */
+/* 
+ * do binary search on a sorted array on disk. If the level is indexed, the
+ * index narrows the search to a window that is read in one go and searched
+ * in memory
+ */
 static size_t disk_level_find(struct level *level, key_t key) {
     assert(level->type == DISK_LEVEL);
     size_t bottom = 0;
     size_t top = level->used;
     size_t middle;
 
+    if (level->index) {
+        struct kv_pair window[INDEX_WINDOW_MAX];
+        int exact = index_window(level->index, key, &bottom, &top);
+        assert(top - bottom <= INDEX_WINDOW_MAX);
+
+        size_t base = bottom;
+        size_t end = top;
+        fseek(level->d.file_ptr, base*sizeof(struct kv_pair), SEEK_SET);
+        fread(window, sizeof(struct kv_pair), end - base, level->d.file_ptr);
+        while (top > bottom) {
+            middle = (top + bottom)/2;
+            if (window[middle-base].key < key) 
+                bottom = middle+1;
+            else if (window[middle-base].key > key)
+                top = middle;
+            else
+                return middle;
+        }
+
+        /* 
+         * a missing key can sort outside the window of a learned index, 
+         * in which case search the rest of the level for its position
+         */
+        if (exact) {
+            return bottom;
+        } else if (bottom == base && base > 0) {
+            bottom = 0;
+            top = base;
+        } else if (bottom == end && end < level->used) {
+            top = level->used;
+        } else {
+            return bottom;
+        }
+    }
+
     struct kv_pair kv;
     while (top > bottom) {
         middle = (top + bottom)/2;
@@ -512,23 +1046,119 @@ static size_t disk_level_find(struct level *level, key_t key) {
 }
 
 
+/*
+ * drop every pair covered by set from a disk level, moving each run of 
+ * surviving pairs down once
+ */
+static void disk_level_purge(struct level *level, struct rtomb_set *set) {
+    assert(level->type == DISK_LEVEL);
+    size_t in = 0;
+    size_t out = 0;
+
+    for (size_t t = 0; t <= set->num; t++) {
+        size_t lo = level->used;
+        size_t hi = level->used;
+        if (t < set->num) {
+            lo = disk_level_find(level, set->arr[t].bottom);
+            hi = disk_level_find(level, set->arr[t].top);
+        }
+
+        /* keep [in, lo) */
+        if (lo > in && out != in)
+            disk_level_copy(level, in, lo, out);
+        if (lo > in)
+            out += lo - in;
+        if (hi > in)
+            in = hi;
+    }
+
+    for (size_t pos = out; pos < level->used; pos++)
+        invalidate_kv(level, pos);
+    level->used = out;
+}
+
+/* copy the pairs at positions [from, to) of a disk level to position dst */
+static void disk_level_copy(struct level *level, size_t from, size_t to,
+        size_t dst) {
+    struct kv_pair buf[BLOCK_PAIRS];
+    assert(dst <= from);
+
+    while (from < to) {
+        size_t n = to - from < BLOCK_PAIRS ? to - from : BLOCK_PAIRS;
+        fseek(level->d.file_ptr, from*sizeof(struct kv_pair), SEEK_SET);
+        fread(buf, sizeof(struct kv_pair), n, level->d.file_ptr);
+        fseek(level->d.file_ptr, dst*sizeof(struct kv_pair), SEEK_SET);
+        fwrite(buf, sizeof(struct kv_pair), n, level->d.file_ptr);
+        from += n;
+        dst += n;
+    }
+}
+
+
 void read_pair(struct level *level, size_t pos, struct kv_pair *result) {
     assert(pos < level->size);
-    if (level->type == MAIN_LEVEL) {
+    if (level->type == MAIN_LEVEL && level->m.ht) {
+        struct kv_pair *kv = hash_table_at(level->m.ht, pos);
+        if (kv) {
+            *result = *kv;
+        } else {
+            result->key = 0;
+            result->val = 0;
+            result->op = OP_DEL;
+            result->valid = KV_INVAL;
+        }
+    } else if (level->type == MAIN_LEVEL) {
+#ifdef _USE_BTREE
+        struct kv_pair *kv = b_tree_at(level->m.bt, pos);
+        if (kv) {
+            *result = *kv;
+        } else {
+            result->key = 0;
+            result->val = 0;
+            result->op = OP_DEL;
+            result->valid = KV_INVAL;
+        }
+#else
         *result = level->m.arr[pos];
+#endif
     } else if (level->type == DISK_LEVEL) {
         fseek(level->d.file_ptr, pos*sizeof(struct kv_pair), SEEK_SET);
         fread(result, sizeof(struct kv_pair), 1, level->d.file_ptr);
     }
 }
 
+/* position of the first pair of a level with a key not less than key */
+size_t level_find(struct level *level, key_t key) {
+    if (level->type == DISK_LEVEL)
+        return disk_level_find(level, key);
+    if (level->m.ht)
+        return hash_table_find(level->m.ht, key);
+#ifdef _USE_BTREE
+    return b_tree_find(level->m.bt, key);
+#else
+    return main_level_find(level, key);
+#endif
+}
+
 
 void invalidate_kv(struct level *level, size_t pos) {
-    if (level->type == MAIN_LEVEL) {
+    if (level->type == MAIN_LEVEL && level->m.ht) {
+        /* compact() clears the whole table once it is flushed */
+        struct kv_pair *kv = hash_table_at(level->m.ht, pos);
+        if (kv)
+            kv->valid = KV_INVAL;
+    } else if (level->type == MAIN_LEVEL) {
+#ifdef _USE_BTREE
+        /* leave the pair in place; the tree is cleared once it is unused */
+        struct kv_pair *kv = b_tree_at(level->m.bt, pos);
+        if (kv)
+            kv->valid = KV_INVAL;
+#else
         level->m.arr[pos].key = 0;
         level->m.arr[pos].val = 0;
         level->m.arr[pos].op = OP_DEL;
         level->m.arr[pos].valid = KV_INVAL;
+#endif
     } else if (level->type == DISK_LEVEL) {
         struct kv_pair blank;
         blank.key = 0;
@@ -542,18 +1172,213 @@ void invalidate_kv(struct level *level, size_t pos) {
 }
 
 
+/* COMPACTION */
+
+/*
+ * flush the main level and rebuild the indexes and filters of the disk
+ * levels it rewrote. If the main level can simply be appended to the first
+ * disk level, that is all. Otherwise cascade_depth() works out how deep
+ * the flush reaches, subcompact() merges the large disk levels at the
+ * bottom of that cascade in parallel, and migrate() merges the rest. The
+ * levels written are then the first ones of the tree, down to that depth.
+ * With a partial compaction policy, compact_partitions() first moves partitions
+ * down until the main level fits in the first disk level, so that the
+ * flush itself only merges into that level. The bytes merged are then
+ * charged to the compaction rate limiter.
+ *
+ * Before merging, range tombstones are pushed down one level after dropping
+ * the pairs they cover there, so that no level's tombstones ever cover its
+ * own pairs, whichever levels migrate() ends up merging. A level file
+ * pinned by a checkpoint or snapshot is moved to a new version just before
+ * it is first written, so levels the flush leaves alone stay shared
+ */
+static void compact(struct lsm_tree *tree) {
+    for (int i = tree->nlevels-2; i >= 0; i--)
+        level_push_rtombs(tree, i);
+
+    uint64_t start = trace_now(tree->trace);
+    int deepest;
+    size_t bytes = compact_partitions(tree, &deepest);
+
+    size_t *before = (size_t *) lsm_malloc(tree->nlevels*sizeof(size_t));
+    for (int i = 0; i < tree->nlevels; i++)
+        before[i] = tree->levels[i].used;
+
+    /* a hash table main level is put in key order once, here */
+    struct hash_table *ht = tree->levels->m.ht;
+    if (ht)
+        hash_table_sort(ht);
+
+    /* appending or merging, the flush writes the levels down to depth */
+    int depth = cascade_depth(tree);
+    for (int j = tree->nlevels_main; j <= depth; j++)
+        level_unshare(tree, j);
+
+    int appended = flush_append(tree);
+    int i = 1;
+    bytes += before[0]*sizeof(struct kv_pair);
+    if (appended) {
+        level_refresh(tree, 1);
+        bytes += before[0]*sizeof(struct kv_pair);
+    } else {
+        subcompact(tree, depth);
+        migrate(tree, 0);
+        for (; i <= depth; i++) {
+            level_refresh(tree, i);
+            bytes += (before[i] + tree->levels[i].used)
+                * sizeof(struct kv_pair);
+        }
+        i = depth;
+    }
+
+    /* deeper levels may only have been written by partition moves */
+    for (int j = i+1; j <= deepest; j++)
+        level_refresh(tree, j);
+    trace_compaction(tree->trace, appended && deepest == 0 ? TRACE_FLUSH
+        : TRACE_COMPACT, i > deepest ? i : deepest, before[0], start);
+    if (ht)
+        hash_table_clear(ht);
+    free(before);
+    tune_compaction(tree);
+
+    throttle_compaction(tree, bytes);
+}
+
+/*
+ * flush the main level by appending its pairs to the end of the first disk
+ * level, which needs no merge if they all sort after that level's pairs
+ * and fit in it, as they do for increasing keys. Returns 1 if it did
+ */
+static int flush_append(struct lsm_tree *tree) {
+    struct level *src = tree->levels;
+    struct level *dst = src + 1;
+    if (tree->nlevels_main != 1 || tree->nlevels < 2 || src->used == 0
+            || src->used + dst->used > dst->size)
+        return 0;
+
+    struct kv_pair kv, last;
+    if (dst->used > 0) {
+        read_pair(src, 0, &kv);
+        read_pair(dst, dst->used-1, &last);
+        if (kv.key <= last.key)
+            return 0;
+    }
+
+    /* deletes have nothing left to hide in the last level */
+    int drop = tree->nlevels == 2;
+    fseek(dst->d.file_ptr, dst->used*sizeof(struct kv_pair), SEEK_SET);
+    for (size_t i = 0; i < src->used; i++) {
+        read_pair(src, i, &kv);
+        if (drop && kv.op == OP_DEL)
+            continue;
+        fwrite(&kv, sizeof(struct kv_pair), 1, dst->d.file_ptr);
+        dst->used++;
+    }
+
+    for (size_t i = 0; i < src->used; i++)
+        invalidate_kv(src, i);
+    src->used = 0;
+    return 1;
+}
+
+/*
+ * the deepest level a flush of the main level writes. Starting from the
+ * top, each level is merged into the next one until a level can take the
+ * one above it, and the last level takes whatever reaches it
+ */
+static int cascade_depth(struct lsm_tree *tree) {
+    int depth = 1;
+    while (depth < tree->nlevels-1 && tree->levels[depth-1].used
+            + tree->levels[depth].used > tree->levels[depth].size)
+        depth++;
+    return depth;
+}
+
+
 /* BOOKKEEPING */
+
+/* 
+ * rebuild the filters, index and block summaries of a disk level after its
+ * contents changed. Empty levels have none of them
+ */
+static void level_refresh(struct lsm_tree *tree, int levelno) {
+    struct level *level = tree->levels + levelno;
+    if (level->type != DISK_LEVEL)
+        return;
+
+    point_filter_destroy(level->filter);
+    index_destroy(level->index);
+    range_filter_destroy(level->rfilter);
+    summary_destroy(level->summary);
+    partitions_destroy(level->parts);
+    level->filter = NULL;
+    level->index = NULL;
+    level->rfilter = NULL;
+    level->summary = NULL;
+    level->parts = NULL;
+    if (level->used == 0)
+        return;
+
+    level->filter =
+        point_filter_build(level, filter_level_bits(tree, levelno));
+    if (tree->index_type != INDEX_NONE)
+        level->index = index_build(level, tree->index_type);
+    level->rfilter = range_filter_build(level);
+    level->summary = summary_build(level);
+}
+
+/* drop the pairs of a level covered by a set of range tombstones */
+static void level_purge(struct lsm_tree *tree, int levelno, 
+        struct rtomb_set *set) {
+    struct level *level = tree->levels + levelno;
+    pthread_mutex_lock(&level->mutex);
+    if (level->type == MAIN_LEVEL) {
+        for (size_t t = 0; t < set->num; t++)
+            main_level_purge(level, set->arr[t].bottom, set->arr[t].top);
+    } else {
+        level_unshare(tree, levelno);
+        disk_level_purge(level, set);
+        level_refresh(tree, levelno);
+    }
+    pthread_mutex_unlock(&level->mutex);
+}
+
+/*
+ * move a level's range tombstones to the level below after dropping the
+ * pairs they cover there, or just drop those pairs if it is the last level
+ */
+void level_push_rtombs(struct lsm_tree *tree, int levelno) {
+    struct level *level = tree->levels + levelno;
+    if (level->rtombs.num == 0 || levelno+1 >= tree->nlevels)
+        return;
+    level_purge(tree, levelno+1, &level->rtombs);
+    if (levelno+1 < tree->nlevels-1)
+        rtomb_merge(&(level+1)->rtombs, &level->rtombs);
+    rtomb_clear(&level->rtombs);
+}
+
 static void level_destroy(struct level *level) {
-    if (level->type == MAIN_LEVEL)
+    if (level->type == MAIN_LEVEL) {
+        hash_table_destroy(level->m.ht);
+#ifdef _USE_BTREE
+        b_tree_destroy(level->m.bt);
+#else
         free(level->m.arr);
-    else if (level->type == DISK_LEVEL) {
+#endif
+#ifdef _USE_BLOOM
+        bloom_destroy(level->bloom);
+#endif
+    } else if (level->type == DISK_LEVEL) {
         fclose(level->d.file_ptr);
         remove(level->d.filename);
         free(level->d.filename);
+        point_filter_destroy(level->filter);
+        index_destroy(level->index);
+        range_filter_destroy(level->rfilter);
+        summary_destroy(level->summary);
+        partitions_destroy(level->parts);
     }
-#ifdef _USE_BLOOM
-    bloom_destroy(level->bloom);
-#endif
+    rtomb_destroy(&level->rtombs);
 }
 
 
@@ -567,9 +1392,10 @@ void print_tree(struct lsm_tree *tree) {
 static void print_level(struct level *level) {
     if (level->type == MAIN_LEVEL) {
         printf("main level: ");
+        struct kv_pair kv;
         for (size_t i = 0; i < level->size; i++) {
-            printf("%d/%d-%d-%d ", level->m.arr[i].key, 
-                level->m.arr[i].val, level->m.arr[i].valid, level->m.arr[i].op);
+            read_pair(level, i, &kv);
+            printf("%d/%d-%d-%d ", kv.key, kv.val, kv.valid, kv.op);
         }
         printf("\n");
     }
@@ -5,6 +5,7 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
@@ -22,6 +23,126 @@
 #define GET_SUCCESS 1
 #define BLOOM_NOTFOUND 0
 #define BLOOM_FOUND 1
+#define RFILTER_NOTFOUND 0
+#define RFILTER_FOUND 1
+#define INDEX_NONE 0
+#define INDEX_FENCE 1
+#define INDEX_LEARNED 2
+#define FILTER_UNIFORM 0
+#define FILTER_MONKEY 1
+#define CACHE_MISS 0
+#define CACHE_HIT 1
+#define TRACE_PUT 0
+#define TRACE_DELETE 1
+#define TRACE_RANGE_DELETE 2
+#define TRACE_BATCH 3
+#define TRACE_GET 4
+#define TRACE_RANGE 5
+#define TRACE_AGGREGATE 6
+#define TRACE_FLUSH 7
+#define TRACE_COMPACT 8
+#define TRACE_TYPES 9
+#define MEMTABLE_SORTED 0
+#define MEMTABLE_HASH 1
+#define COMPACT_FULL 0
+#define COMPACT_ROUND_ROBIN 1
+#define COMPACT_LEAST_OVERLAP 2
+#define COMPACT_MOST_TOMBSTONES 3
+
+/* disk levels are indexed and read in blocks of one page */
+#define BLOCK_SIZE 4096
+#define BLOCK_PAIRS (BLOCK_SIZE / sizeof(struct kv_pair))
+
+/* maximum distance between a learned index prediction and the true position */
+#define LEARNED_EPSILON 64
+#define INDEX_WINDOW_MAX (BLOCK_PAIRS > 2*LEARNED_EPSILON + 2 \
+    ? BLOCK_PAIRS : 2*LEARNED_EPSILON + 2)
+
+/* 
+ * range filter: keys are stored with 0 to RFILTER_PREFIXES-1 low bits
+ * dropped, using *_BITS bits per key for full keys and for each shorter
+ * prefix. Ranges wider than RFILTER_MAX_SPAN inside one block are not
+ * filtered
+ */
+#define RFILTER_PREFIXES 8
+#define RFILTER_KEY_BITS 10
+#define RFILTER_KEY_HASHES 6
+#define RFILTER_PREFIX_BITS 2
+#define RFILTER_PREFIX_HASHES 1
+#define RFILTER_MAX_SPAN 65536
+
+/*
+ * point filters: the default budget in bits per disk-level key, and the
+ * fewest bits per key for which a level gets a filter at all
+ */
+#define FILTER_BITS 10
+#define FILTER_MIN_BITS 0.5
+#define FILTER_MAX_HASHES 16
+#define LN2 0.69314718055994530942
+
+/* 
+ * subcompactions: disk-to-disk merges are split into ranges of at least
+ * SUBCOMPACT_MIN_PAIRS pairs, merged on up to SUBCOMPACT_MAX_THREADS threads
+ */
+#ifndef SUBCOMPACT_MIN_PAIRS
+#define SUBCOMPACT_MIN_PAIRS 65536
+#endif
+#define SUBCOMPACT_MAX_THREADS 16
+
+/* blocks of a disk level read ahead of a range scan */
+#define RANGE_READAHEAD 32
+
+/* 
+ * direct I/O: offsets, lengths and buffers are aligned to DIRECT_ALIGN
+ * bytes, and merges stream DIRECT_PAIRS pairs at a time, which take a
+ * whole number of blocks whatever the size of a pair
+ */
+#define DIRECT_ALIGN 4096
+#define DIRECT_PAIRS DIRECT_ALIGN
+
+/*
+ * auto-tuning: flushes between designs, the most levels a tree grows to,
+ * the largest size ratio, smallest main level and most filter bits per key
+ * tried, and how much more the levels must hold than the data
+ */
+#define TUNE_INTERVAL 16
+#define TUNE_MAX_LEVELS 8
+#define TUNE_MAX_RATIO 16
+#define TUNE_MIN_BUFFER 1024
+#define TUNE_MAX_BITS 20
+#define TUNE_HEADROOM 1.25
+
+/* longest path of a level file */
+#define PATHLEN 512
+
+/* row cache: slots per set, and locks shared out between the sets */
+#define CACHE_WAYS 8
+#define CACHE_STRIPES 64
+
+/* 
+ * tracing: events held by each thread's ring, how often the writer drains
+ * the rings to the trace file, and the most pairs of a write batch in one
+ * TRACE_BATCH record
+ */
+#define TRACE_RING 4096
+#define TRACE_BATCH_MAX (TRACE_RING/2 - 1)
+#define TRACE_FLUSH_MS 50
+#define TRACE_MAGIC 0x4c534d54
+#define TRACE_VERSION 1
+
+/* 
+ * hash table main level: flushes sort on up to HASH_SORT_MAX_THREADS
+ * threads once there are HASH_SORT_MIN_PARALLEL pairs
+ */
+#define HASH_SORT_MAX_THREADS 8
+#define HASH_SORT_MIN_PARALLEL 16384
+#define HASH_TABLE_UPDATED 0
+#define HASH_TABLE_NEW 1
+
+/* partial compaction moves disk levels down PARTITION_PAIRS pairs at a time */
+#ifndef PARTITION_PAIRS
+#define PARTITION_PAIRS 16384
+#endif
 
 typedef int key_t;
 typedef int val_t;
@@ -38,8 +159,80 @@ struct kv_node {
     struct kv_node *next_node;
 };
 
+/* count, sum, smallest and largest value of the live pairs in a range */
+struct aggregate {
+    size_t count;
+    long long sum;
+    val_t min;
+    val_t max;
+};
+
+/* sorted, disjoint key intervals [bottom, top) removed by range_delete */
+struct range_tombstone {
+    key_t bottom;
+    key_t top;
+};
+
+/* called on each pair of a range; returning nonzero stops the range */
+typedef int (*range_fn)(key_t key, val_t val, void *ctx);
+
+/* a caller's buffer filled by range() */
+struct range_buf {
+    struct kv_pair *buf;
+    size_t cap;
+    size_t num;
+};
+
+struct rtomb_set {
+    size_t num;
+    size_t cap;
+    struct range_tombstone *arr;
+};
+
+/* 
+ * one traced operation. A TRACE_BATCH of arg pairs is followed by a
+ * TRACE_PUT or TRACE_DELETE for each of them, with no latency of their own.
+ * A larger write batch is recorded as several TRACE_BATCHes in a row
+ */
+struct trace_event {
+    /* start in ns since the trace began, and how long it took in ns */
+    uint64_t time;
+    uint32_t latency;
+
+    /* TRACE_*, and the thread that recorded it (0 for flushes) */
+    uint16_t type;
+    uint16_t thread;
+
+    /* 
+     * key or bottom of a range, and value, top of a range or pair count.
+     * Gets record whether they found the key in arg, and flushes record
+     * the deepest level written in key
+     */
+    key_t key;
+    int32_t arg;
+};
+
+/* start of a trace file, followed by its events */
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
 /* opaque */
 struct bloom; 
+struct index;
+struct range_filter;
+struct point_filter;
+struct summary;
+struct throttle;
+struct cache;
+struct trace;
+struct hash_table;
+struct partitions;
+struct io_pool;
+struct tuner;
+struct snapshot;
+struct arena;
 
 
 /* main-memory specific information */
@@ -50,6 +243,9 @@ struct main_level {
 #else
     struct b_tree *bt;
 #endif
+
+    /* hash table used instead with MEMTABLE_HASH, or NULL */
+    struct hash_table *ht;
 };
 
 /* disk specific information */
@@ -59,6 +255,13 @@ struct disk_level {
 
     /* filename */
     char *filename;
+
+    /* version of the file, and whether a checkpoint or snapshot pins it */
+    unsigned version;
+    int shared;
+
+    /* blocks to read ahead of a range scan (0 for none) */
+    size_t readahead;
 };
 
 struct level {
@@ -66,6 +269,17 @@ struct level {
     size_t used;
     size_t size;
     struct bloom *bloom; 
+    struct point_filter *filter;
+    struct index *index;
+    struct range_filter *rfilter;
+    struct summary *summary;
+
+    /* partitions of a disk level, and where round robin picks next */
+    struct partitions *parts;
+    key_t compact_next;
+
+    /* range tombstones hiding pairs in deeper levels */
+    struct rtomb_set rtombs;
     pthread_mutex_t mutex;
 
     union {
@@ -86,6 +300,35 @@ struct lsm_tree {
     int nlevels_main;
     int nlevels_disk;
 
+    /* kind of index built over each disk level (INDEX_*) */
+    int index_type;
+
+    /* point filter budget in bits per disk-level key, and its split */
+    double filter_bits;
+    int filter_policy;
+
+    /* write controller and compaction rate limiter */
+    struct throttle *throttle;
+
+    /* threads for each large disk-to-disk merge (0 is one per core) */
+    int subcompactions;
+
+    /* whether large merges bypass the page cache, and their buffers */
+    int direct_io;
+    struct io_pool *io_pool;
+
+    /* how flushes make room in the disk levels (COMPACT_*) */
+    int compaction;
+
+    /* row cache in front of get(), or NULL */
+    struct cache *cache;
+
+    /* operation trace being recorded, or NULL */
+    struct trace *trace;
+
+    /* auto-tuner, or NULL */
+    struct tuner *tuner;
+
     /* pointer arrays to main memory and disk structs for each level */
     struct level *levels;
 };
@@ -94,18 +337,55 @@ struct lsm_tree {
 struct lsm_tree* init(const char* name, int main_num, int total_num, 
     size_t *sizes);
 int destroy(struct lsm_tree *);
+void set_index(struct lsm_tree *tree, int type);
+void set_cache(struct lsm_tree *tree, size_t bytes);
+void set_subcompactions(struct lsm_tree *tree, int threads);
+int set_trace(struct lsm_tree *tree, const char *filename);
+void set_memtable(struct lsm_tree *tree, int type);
+void set_compaction(struct lsm_tree *tree, int policy);
+void set_readahead(struct lsm_tree *tree, size_t blocks);
+void set_direct_io(struct lsm_tree *tree, int on);
+void set_autotune(struct lsm_tree *tree, size_t budget);
+void set_filter(struct lsm_tree *tree, double bits, int policy);
+void set_throttle(struct lsm_tree *tree, double soft, double hard,
+    unsigned max_delay_us, size_t rate);
 
 /* user interface to lsm tree */
 int put(struct lsm_tree*, key_t, val_t);
 int delete(struct lsm_tree*, key_t);
-void get(struct lsm_tree*, key_t);
-void range(struct lsm_tree*, key_t, key_t);
+int range_delete(struct lsm_tree*, key_t, key_t);
+int write_batch(struct lsm_tree*, struct kv_pair *, size_t);
+int get(struct lsm_tree*, key_t, val_t *);
+size_t range(struct lsm_tree*, key_t, key_t, struct kv_pair *, size_t);
+size_t range_each(struct lsm_tree*, key_t, key_t, range_fn, void *);
+void range_aggregate(struct lsm_tree*, key_t, key_t, struct aggregate *);
 void load(struct lsm_tree *tree, const char *filename);
 void stat(struct lsm_tree* tree);
 
+/* checkpoints and read snapshots */
+int checkpoint(struct lsm_tree *tree, const char *dir);
+struct snapshot *snapshot_create(struct lsm_tree *tree);
+void snapshot_release(struct snapshot *snap);
+int snapshot_get(struct snapshot *snap, key_t key, val_t *val);
+size_t snapshot_range(struct snapshot *snap, key_t bottom, key_t top,
+    struct kv_pair *buf, size_t cap);
+
 void print_tree(struct lsm_tree*);
 
 
+/* counted allocation and arenas */
+#define ARENA_CHUNK 65536
+void *lsm_malloc(size_t size);
+void *lsm_calloc(size_t n, size_t size);
+void *lsm_realloc(void *ptr, size_t size);
+void *lsm_aligned_alloc(size_t align, size_t size);
+long lsm_alloc_count(void);
+struct arena *arena_init(size_t chunk_size);
+void arena_destroy(struct arena *a);
+void *arena_alloc(struct arena *a, size_t bytes, size_t align);
+void arena_reset(struct arena *a);
+struct arena *arena_thread(void);
+
 /* bloom filter things */
 struct bloom *bloom_init(unsigned hashes);
 void bloom_destroy(struct bloom* b);
@@ -114,32 +394,191 @@ void bloom_add(struct bloom *b, key_t key);
 int bloom_check(struct bloom *b, key_t key);
 void bloom_clear(struct bloom *b);
 
+/* point filters for disk levels */
+struct point_filter *point_filter_build(struct level *level, double bits);
+void point_filter_destroy(struct point_filter *pf);
+int point_filter_check(struct point_filter *pf, key_t key);
+size_t point_filter_memory(struct point_filter *pf);
+double filter_level_bits(struct lsm_tree *tree, int levelno);
+void filter_stat(struct lsm_tree *tree);
+
+/* row cache */
+struct cache *cache_init(size_t bytes);
+void cache_destroy(struct cache *c);
+int cache_get(struct cache *c, key_t key, struct kv_pair *kv, unsigned *gen);
+void cache_fill(struct cache *c, struct kv_pair *kv, unsigned gen);
+void cache_invalidate(struct cache *c, key_t key);
+void cache_invalidate_range(struct cache *c, key_t bottom, key_t top);
+double cache_hit_rate(struct cache *c);
+void cache_stat(struct lsm_tree *tree);
+
+/* operation tracing */
+struct trace *trace_init(const char *filename);
+void trace_destroy(struct trace *t);
+uint64_t trace_now(struct trace *t);
+void trace_op(struct trace *t, int type, key_t key, int32_t arg,
+    uint64_t start);
+void trace_batch(struct trace *t, struct kv_pair *kvs, size_t num,
+    uint64_t start);
+void trace_compaction(struct trace *t, int type, int level, int32_t pairs,
+    uint64_t start);
+void trace_stat(struct lsm_tree *tree);
+
+/* disk level indexes */
+struct index *index_build(struct level *level, int type);
+void index_destroy(struct index *idx);
+int index_window(struct index *idx, key_t key, size_t *bottom, size_t *top);
+size_t index_memory(struct index *idx);
+
+/* range filters */
+struct range_filter *range_filter_build(struct level *level);
+void range_filter_destroy(struct range_filter *rf);
+int range_filter_check(struct range_filter *rf, key_t bottom, key_t top);
+size_t range_filter_memory(struct range_filter *rf);
+
+/* per-block summaries for aggregates */
+struct summary *summary_build(struct level *level);
+void summary_destroy(struct summary *s);
+
+/* range tombstones */
+void rtomb_init(struct rtomb_set *set);
+void rtomb_destroy(struct rtomb_set *set);
+void rtomb_clear(struct rtomb_set *set);
+void rtomb_add(struct rtomb_set *set, key_t bottom, key_t top);
+void rtomb_merge(struct rtomb_set *dst, struct rtomb_set *src);
+int rtomb_covers(struct rtomb_set *set, key_t key);
+int rtomb_overlaps(struct rtomb_set *set, key_t lo, key_t hi);
+
+/* write stalls and compaction rate limiting */
+struct throttle *throttle_init(void);
+void throttle_destroy(struct throttle *t);
+void throttle_write(struct lsm_tree *tree);
+void throttle_compaction(struct lsm_tree *tree, size_t bytes);
+void throttle_stat(struct lsm_tree *tree);
+
+/* range scan readahead */
+size_t level_readahead(struct level *level, size_t from, size_t to);
+void level_read_ahead(struct level *level, size_t from, size_t to,
+    struct kv_pair *buf);
+
+/* auto-tuning */
+void tune_destroy(struct tuner *t);
+void tune_op(struct tuner *t, int type, long n);
+void tune_compaction(struct lsm_tree *tree);
+void tune_stat(struct lsm_tree *tree);
+
+/* direct I/O for merges */
+struct io_pool *io_pool_init(void);
+void io_pool_destroy(struct io_pool *pool);
+void *io_pool_get(struct io_pool *pool);
+void io_pool_put(struct io_pool *pool, void *buf);
+int direct_open(const char *path, int flags);
+struct kv_pair *direct_read(int fd, size_t pos, size_t n, void *buf);
+void direct_write(int fd, void *buf, size_t n);
+
+/* partial compaction */
+size_t compact_partitions(struct lsm_tree *tree, int *deepest);
+void partitions_destroy(struct partitions *ps);
+
 /* btree */
+
+/*
+ * Nodes are sized to B_NODE_BYTES (a multiple of the cache line size) so that
+ * searching a node touches a bounded number of lines; the fan-outs below are
+ * derived from it. Override with -DB_NODE_BYTES=... to tune.
+ */
+#ifndef B_NODE_BYTES
+#define B_NODE_BYTES 512
+#endif
+#define B_NODE_HEADER 32
+#define B_LEAF_ORDER ((B_NODE_BYTES - B_NODE_HEADER) / sizeof(struct kv_pair))
+#define B_INNER_ORDER ((B_NODE_BYTES - B_NODE_HEADER - sizeof(void *)) \
+    / (sizeof(key_t) + sizeof(void *)))
+#define B_TREE_UPDATED 0
+#define B_TREE_NEW 1
+
 struct b_node {
     size_t used;
     int leaf;
-    size_t degree;
-    struct kv_pair *values;
-    struct b_node **children;
+    /* next leaf in key order (leaves only) */
+    struct b_node *next;
+
+    union {
+        /* leaf: sorted key value pairs */
+        struct kv_pair values[B_LEAF_ORDER];
+
+        /* inner: children[i] holds keys in [keys[i-1], keys[i]) */
+        struct {
+            key_t keys[B_INNER_ORDER];
+            struct b_node *children[B_INNER_ORDER + 1];
+        };
+    };
 };
 
 struct b_tree {
-    size_t degree;
+    /* nodes are allocated here and freed together */
+    struct arena *arena;
+
+    /* number of pairs stored in the leaves */
+    size_t count;
     struct b_node *root;
+
+    /* leftmost leaf, start of the in-order leaf chain, and rightmost leaf */
+    struct b_node *head;
+    struct b_node *tail;
+
+    /* cursor so that sequential b_tree_at calls are O(1) */
+    struct b_node *cur_leaf;
+    size_t cur_base;
 };
 
+struct b_tree *b_tree_init(void);
+void b_tree_destroy(struct b_tree *bt);
+void b_tree_clear(struct b_tree *bt);
 struct kv_pair *b_tree_get(struct b_tree *bt, key_t key);
 int b_tree_insert(struct b_tree *bt, struct kv_pair *kv);
+int b_tree_remove(struct b_tree *bt, key_t key);
+size_t b_tree_remove_range(struct b_tree *bt, key_t bottom, key_t top);
+size_t b_tree_find(struct b_tree *bt, key_t key);
+struct kv_pair *b_tree_at(struct b_tree *bt, size_t pos);
+
+/* hash table main level */
+struct hash_table *hash_table_init(size_t size);
+void hash_table_destroy(struct hash_table *ht);
+void hash_table_clear(struct hash_table *ht);
+struct kv_pair *hash_table_get(struct hash_table *ht, key_t key);
+int hash_table_insert(struct hash_table *ht, struct kv_pair *kv);
+int hash_table_remove(struct hash_table *ht, key_t key);
+size_t hash_table_remove_range(struct hash_table *ht, key_t bottom, 
+    key_t top);
+size_t hash_table_find(struct hash_table *ht, key_t key);
+struct kv_pair *hash_table_at(struct hash_table *ht, size_t pos);
+void hash_table_sort(struct hash_table *ht);
 
 /* random */
 void migrate(struct lsm_tree *tree, int top);
+void subcompact(struct lsm_tree *tree, int deepest);
 void invalidate_kv(struct level *level, size_t pos);
 void read_pair(struct level *level, size_t pos, struct kv_pair *result);
+size_t level_find(struct level *level, key_t key);
 void main_level_range(struct level *level, key_t bottom, key_t top, 
     struct kv_node **head);
 void disk_level_range(struct level *level, key_t bottom, key_t top, 
     struct kv_node **head);
 void range_clean_list(struct kv_node **head);
+int tree_get(struct lsm_tree *tree, key_t key, val_t *val);
+int levels_get(struct level *levels, int nlevels, key_t key, 
+    struct kv_pair *res);
+struct kv_node *levels_range(struct level *levels, int nlevels, 
+    key_t bottom, key_t top, struct arena *arena);
+size_t levels_range_each(struct level *levels, int nlevels, key_t bottom, 
+    key_t top, range_fn fn, void *ctx);
+int range_buf_add(key_t key, val_t val, void *ctx);
+void level_filename(struct lsm_tree *tree, int levelno, char *buf, 
+    size_t buflen);
+void level_unshare(struct lsm_tree *tree, int levelno);
+void level_push_rtombs(struct lsm_tree *tree, int levelno);
+void disk_level_init(struct lsm_tree *tree, size_t *sizes, int levelno);
 
 
 
@@ -5,9 +5,13 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include "lsm_tree.h"
+#include "server.h"
 
 #define MAXLINE 256
 
+/* results are written out in blocks of this size in workload mode */
+#define OUTBUF 65536
+
 #define PUT_OP 0
 #define GET_OP 1
 #define RANGE_OP 2
@@ -15,6 +19,8 @@
 #define LOAD_OP 4
 #define STAT_OP 5
 #define QUIT_OP 6
+#define RANGE_DELETE_OP 7
+#define AGGREGATE_OP 8
 
 #define MAX_LAYERS 4
 #define DEFAULT_NAME "my-lsm"
@@ -26,12 +32,15 @@
 #define DEFAULT_SIZE2 16384
 #define DEFAULT_SIZE3 65536 
 
-struct lsm_tree *lsm_tree_default_init(void);
+struct lsm_tree *lsm_tree_default_init(size_t cache, char *tfile, int memtable,
+    int autotune);
 void interactive(struct lsm_tree *tree);
 char *get_input();
 int process_input(struct lsm_tree *tree, char *input);
 void workload(struct lsm_tree *tree, char *filename);
 void quit();
+void print_aggregate(struct lsm_tree *tree, char *fn, key_t bottom, key_t top);
+int print_pair(key_t key, val_t val, void *ctx);
 
 /* main: process arguments and dispatch functionality */
 int main(int argc, char *argv[]) {
@@ -44,9 +53,24 @@ int main(int argc, char *argv[]) {
     /* workload mode */
     char *wfile = NULL;
 
+    /* server mode */
+    char *saddr = NULL;
+
+    /* row cache size in bytes */
+    size_t cache = 0;
+
+    /* file to trace operations to */
+    char *tfile = NULL;
+
+    /* kind of main level */
+    int memtable = MEMTABLE_SORTED;
+
+    /* let the tree size its levels for the workload */
+    int autotune = 0;
+
     /* process arguments */
     int c;
-    while ((c = getopt(argc, argv, "ibw:")) != -1) {
+    while ((c = getopt(argc, argv, "ibHaw:s:c:t:")) != -1) {
         switch (c) {
             case 'i':
                 iflag = 1;
@@ -57,8 +81,24 @@ int main(int argc, char *argv[]) {
             case 'b':
                 bflag = 1;
                 break;
+            case 's':
+                saddr = optarg;
+                break;
+            case 'c':
+                cache = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                tfile = optarg;
+                break;
+            case 'H':
+                memtable = MEMTABLE_HASH;
+                break;
+            case 'a':
+                autotune = 1;
+                break;
             case '?':
-                if (optopt == 'w') {
+                if (optopt == 'w' || optopt == 's' || optopt == 'c'
+                        || optopt == 't') {
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
                 } else if (isprint(optopt)) {
                     fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -71,32 +111,47 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (iflag && wfile) {
-        fprintf(stderr, "Too many arguments - try either workload or interactive mode "
-            "with -w [filename] or -i\n");
+    if (iflag + !!wfile + !!saddr > 1) {
+        fprintf(stderr, "Too many arguments - try either workload, interactive or server "
+            "mode with -w [filename], -i or -s [socket]\n");
         return 1;
-    } else if (!iflag && !wfile && !bflag) {
-        fprintf(stderr, "Not enough arguments - try either workload or interactive mode "
-            "with -w [filename] or -i\n");
+    } else if (!iflag && !wfile && !saddr && !bflag) {
+        fprintf(stderr, "Not enough arguments - try either workload, interactive or server "
+            "mode with -w [filename], -i or -s [socket]\n");
         return 1;
     }
 
 
     if (iflag) {
-        struct lsm_tree *tree = lsm_tree_default_init();
+        struct lsm_tree *tree = lsm_tree_default_init(cache, tfile, memtable,
+            autotune);
         interactive(tree);
     } else if (wfile) {
-        struct lsm_tree *tree = lsm_tree_default_init();
+        setvbuf(stdout, NULL, _IOFBF, OUTBUF);
+        struct lsm_tree *tree = lsm_tree_default_init(cache, tfile, memtable,
+            autotune);
         workload(tree, wfile);
         quit(tree);
+    } else if (saddr) {
+        struct lsm_tree *tree = lsm_tree_default_init(cache, tfile, memtable,
+            autotune);
+        if (serve(tree, saddr))
+            return 1;
+        quit(tree);
     } else if (bflag) {
         test_bloom();        
     }
 }
 
 
-/* initialize an lsm tree with default settings */
-struct lsm_tree *lsm_tree_default_init(void) {
+/* 
+ * initialize an lsm tree with default settings, a row cache of cache
+ * bytes (none if 0) and a main level of the given MEMTABLE_* kind, tracing
+ * its operations to tfile if it is not NULL and auto-tuning it if autotune
+ * is set
+ */
+struct lsm_tree *lsm_tree_default_init(size_t cache, char *tfile, 
+        int memtable, int autotune) {
     size_t *sizes = (size_t *) malloc(MAX_LAYERS*sizeof(size_t));
     sizes[0] = DEFAULT_SIZE0;
     sizes[1] = DEFAULT_SIZE1;
@@ -109,6 +164,12 @@ struct lsm_tree *lsm_tree_default_init(void) {
     gettimeofday(&tval_before, NULL);
    
     struct lsm_tree *tree = init(DEFAULT_NAME, DEFAULT_LAYERS, DEFAULT_MAIN, sizes);
+    set_memtable(tree, memtable);
+    if (autotune)
+        set_autotune(tree, 0);
+    set_cache(tree, cache);
+    if (tfile && set_trace(tree, tfile))
+        perror(tfile);
 
     gettimeofday(&tval_after, NULL);
     timersub(&tval_after, &tval_before, &tval_result);
@@ -179,6 +240,12 @@ int process_input(struct lsm_tree *tree, char *input) {
     } else if (!strcmp(token, "d")) {
         op = DELETE_OP;
         args = 1;
+    } else if (!strcmp(token, "D")) {
+        op = RANGE_DELETE_OP;
+        args = 2;
+    } else if (!strcmp(token, "a")) {
+        op = AGGREGATE_OP;
+        args = 3;
     } else if (!strcmp(token, "l")) {
         op = LOAD_OP;
         args = 1;
@@ -199,19 +266,30 @@ int process_input(struct lsm_tree *tree, char *input) {
         argv[i] = strdup(strtok(NULL, s));
     }
 
+    val_t val;
     switch (op) {
         case PUT_OP:
             put(tree, atoi(argv[0]), atoi(argv[1]));
             break;
         case GET_OP:
-            get(tree, atoi(argv[0]));
+            if (get(tree, atoi(argv[0]), &val) == GET_SUCCESS)
+                printf("%d\n", val);
+            else
+                printf("\n");
             break;
         case RANGE_OP:
-            range(tree, atoi(argv[0]), atoi(argv[1]));
+            range_each(tree, atoi(argv[0]), atoi(argv[1]), print_pair, NULL);
+            printf("\n");
             break;
         case DELETE_OP:
             delete(tree, atoi(argv[0]));
             break;
+        case RANGE_DELETE_OP:
+            range_delete(tree, atoi(argv[0]), atoi(argv[1]));
+            break;
+        case AGGREGATE_OP:
+            print_aggregate(tree, argv[0], atoi(argv[1]), atoi(argv[2]));
+            break;
         case LOAD_OP:
             load(tree, argv[0]);
             break;
@@ -225,6 +303,36 @@ int process_input(struct lsm_tree *tree, char *input) {
     return 0;
 }
 
+/* print one pair of a range */
+int print_pair(key_t key, val_t val, void *ctx) {
+    (void) ctx;
+    printf("%d:%d ", key, val);
+    return 0;
+}
+
+/* 
+ * print one aggregate (count, sum, min or max) of the values in 
+ * [bottom, top). min and max of an empty range print nothing, like a 
+ * missing get
+ */
+void print_aggregate(struct lsm_tree *tree, char *fn, key_t bottom, key_t top) {
+    struct aggregate agg;
+    range_aggregate(tree, bottom, top, &agg);
+
+    if (!strcmp(fn, "count"))
+        printf("%zu\n", agg.count);
+    else if (!strcmp(fn, "sum"))
+        printf("%lld\n", agg.sum);
+    else if (!strcmp(fn, "min") && agg.count > 0)
+        printf("%d\n", agg.min);
+    else if (!strcmp(fn, "max") && agg.count > 0)
+        printf("%d\n", agg.max);
+    else if (!strcmp(fn, "min") || !strcmp(fn, "max"))
+        printf("\n");
+    else
+        printf("Invalid aggregate, try count, sum, min or max.\n");
+}
+
 
 /* get a line of user input (for interactive mode) */
 char *get_input() {
@@ -0,0 +1,329 @@
+/*
+ * This file contains partial compaction, which moves disk levels down a
+ * partition at a time instead of merging whole levels.
+ *
+ * A disk level is cut into partitions of PARTITION_PAIRS consecutive pairs,
+ * each covering its own key range. When the main level is about to be
+ * flushed into a first disk level that has no room for it, compact() asks
+ * compact_partitions() to make that room. It picks one partition of the
+ * level, makes room for it in the level below in the same way, and merges
+ * it into just the pairs of the level below that fall in its key range.
+ * This repeats until the flush fits, so a compaction only touches what it
+ * has to move rather than the whole of every level in the cascade.
+ *
+ * Levels are still one sorted file each, so taking a partition out of a
+ * level or merging one in shifts the pairs after it along the file. The
+ * policy decides which partition goes down:
+ *
+ *   COMPACT_ROUND_ROBIN moves them in key order, each level resuming after
+ *   the key range it moved last, so every key range gets its turn.
+ *   COMPACT_LEAST_OVERLAP moves the one whose merge writes the fewest
+ *   pairs, counting both the pairs it overlaps below and the pairs shifted
+ *   in either level.
+ *   COMPACT_MOST_TOMBSTONES moves the one holding the most deletes, so that
+ *   they reach the last level and are dropped sooner.
+ *
+ * If making room would need the last level to take more than it can,
+ * nothing more is moved and compact() falls back to full merges.
+ */
+
+#include <limits.h>
+#include "lsm_tree.h"
+
+/* pairs shifted at a time */
+#define PARTITION_BUF (16*BLOCK_PAIRS)
+
+struct partition {
+    /* positions of the partition in the level, and its key range */
+    size_t from;
+    size_t to;
+    key_t min_key;
+    key_t max_key;
+    size_t tombstones;
+};
+
+struct partitions {
+    size_t num;
+    struct partition *parts;
+};
+
+static struct partitions *partitions_build(struct level *level,
+    int tombstones);
+static int partition_make_room(struct lsm_tree *tree, int levelno, size_t n,
+    size_t *bytes, int *deepest);
+static struct partition *partition_pick(struct lsm_tree *tree, int levelno);
+static void partition_overlap(struct level *level, struct partition *p,
+    size_t *lo, size_t *hi);
+static size_t partition_move(struct lsm_tree *tree, int levelno,
+    struct partition *p);
+static void partition_shift(struct level *level, size_t from, size_t to,
+    size_t n);
+static void partition_blank(struct level *level, size_t from, size_t to);
+static void partition_stale(struct level *level);
+
+
+/*** POLICY ***/
+
+/*
+ * set_compaction:
+ * Choose how flushes make room in the disk levels: COMPACT_FULL, the
+ * default, merges whole levels into the next one, and COMPACT_ROUND_ROBIN,
+ * COMPACT_LEAST_OVERLAP and COMPACT_MOST_TOMBSTONES move one partition at
+ * a time, picked as their names say
+ */
+void set_compaction(struct lsm_tree *tree, int policy) {
+    assert(policy >= COMPACT_FULL && policy <= COMPACT_MOST_TOMBSTONES);
+    tree->compaction = policy;
+}
+
+/*
+ * make room in the first disk level for the main level, moving partitions
+ * down. Returns the number of bytes read and written, and sets deepest to
+ * the deepest level written (0 if none)
+ */
+size_t compact_partitions(struct lsm_tree *tree, int *deepest) {
+    size_t bytes = 0;
+    *deepest = 0;
+    if (tree->compaction == COMPACT_FULL || tree->nlevels_main != 1
+            || tree->nlevels < 3)
+        return 0;
+
+    partition_make_room(tree, 1, tree->levels->used, &bytes, deepest);
+    return bytes;
+}
+
+void partitions_destroy(struct partitions *ps) {
+    if (!ps)
+        return;
+    free(ps->parts);
+    free(ps);
+}
+
+/* the partitions of a disk level, counting tombstones only if asked to */
+static struct partitions *partitions_build(struct level *level,
+        int tombstones) {
+    struct partitions *ps =
+        (struct partitions *) lsm_malloc(sizeof(struct partitions));
+    ps->num = (level->used + PARTITION_PAIRS - 1) / PARTITION_PAIRS;
+    ps->parts = (struct partition *) lsm_malloc(ps->num
+        * sizeof(struct partition));
+
+    struct kv_pair *buf = tombstones ? (struct kv_pair *) lsm_malloc(
+        PARTITION_BUF*sizeof(struct kv_pair)) : NULL;
+    for (size_t i = 0; i < ps->num; i++) {
+        struct partition *p = ps->parts + i;
+        struct kv_pair kv;
+        p->from = i*PARTITION_PAIRS;
+        p->to = p->from + PARTITION_PAIRS < level->used
+            ? p->from + PARTITION_PAIRS : level->used;
+        read_pair(level, p->from, &kv);
+        p->min_key = kv.key;
+        read_pair(level, p->to - 1, &kv);
+        p->max_key = kv.key;
+
+        p->tombstones = 0;
+        for (size_t pos = p->from; buf && pos < p->to; ) {
+            size_t n = p->to - pos < PARTITION_BUF ? p->to - pos
+                : PARTITION_BUF;
+            fseek(level->d.file_ptr, pos*sizeof(struct kv_pair), SEEK_SET);
+            fread(buf, sizeof(struct kv_pair), n, level->d.file_ptr);
+            for (size_t j = 0; j < n; j++)
+                p->tombstones += buf[j].op == OP_DEL;
+            pos += n;
+        }
+    }
+    free(buf);
+    return ps;
+}
+
+
+/*** MOVING PARTITIONS ***/
+
+/*
+ * move partitions of a level down until n more pairs fit in it. Returns 1
+ * once they do, and 0 if the levels below cannot take enough of them
+ */
+static int partition_make_room(struct lsm_tree *tree, int levelno, size_t n,
+        size_t *bytes, int *deepest) {
+    struct level *level = tree->levels + levelno;
+    while (level->used + n > level->size) {
+        if (levelno+1 >= tree->nlevels || level->used == 0)
+            return 0;
+
+        /* the level's tombstones must not end up above its own pairs */
+        level_push_rtombs(tree, levelno);
+        if (!level->parts)
+            level->parts = partitions_build(level,
+                tree->compaction == COMPACT_MOST_TOMBSTONES);
+
+        /* the pick may not survive making room below, so copy it */
+        struct partition p = *partition_pick(tree, levelno);
+        if (!partition_make_room(tree, levelno+1, p.to - p.from, bytes,
+                deepest))
+            return 0;
+        *bytes += partition_move(tree, levelno, &p);
+        if (levelno+1 > *deepest)
+            *deepest = levelno+1;
+    }
+    return 1;
+}
+
+static struct partition *partition_pick(struct lsm_tree *tree, int levelno) {
+    struct level *level = tree->levels + levelno;
+    struct partitions *ps = level->parts;
+    struct partition *best = ps->parts;
+
+    if (tree->compaction == COMPACT_ROUND_ROBIN) {
+        for (size_t i = 0; i < ps->num; i++) {
+            if (ps->parts[i].max_key >= level->compact_next) {
+                best = ps->parts + i;
+                break;
+            }
+        }
+        level->compact_next = best->max_key < INT_MAX
+            ? best->max_key + 1 : INT_MIN;
+    } else if (tree->compaction == COMPACT_LEAST_OVERLAP) {
+        struct level *below = level + 1;
+        double best_cost = -1;
+        for (size_t i = 0; i < ps->num; i++) {
+            struct partition *p = ps->parts + i;
+            size_t lo, hi;
+            partition_overlap(below, p, &lo, &hi);
+            double cost = (double) (hi - lo + below->used - hi
+                + level->used - p->to) / (p->to - p->from);
+            if (best_cost < 0 || cost < best_cost) {
+                best = p;
+                best_cost = cost;
+            }
+        }
+    } else {
+        /* ties go to the later partition, which shifts less */
+        for (size_t i = 0; i < ps->num; i++) {
+            if (ps->parts[i].tombstones >= best->tombstones)
+                best = ps->parts + i;
+        }
+    }
+    return best;
+}
+
+/* the positions [lo, hi) of a level with keys in a partition's range */
+static void partition_overlap(struct level *level, struct partition *p,
+        size_t *lo, size_t *hi) {
+    struct kv_pair kv;
+    *lo = level_find(level, p->min_key);
+    *hi = level_find(level, p->max_key);
+    if (*hi < level->used) {
+        read_pair(level, *hi, &kv);
+        *hi += kv.key == p->max_key;
+    }
+}
+
+/*
+ * merge a partition of a level into the level below, which must have room
+ * for it, and close the gap it leaves. Returns the bytes read and written
+ */
+static size_t partition_move(struct lsm_tree *tree, int levelno,
+        struct partition *p) {
+    struct level *src = tree->levels + levelno;
+    struct level *dst = src + 1;
+    int last = levelno+1 == tree->nlevels-1;
+    size_t np = p->to - p->from;
+    level_unshare(tree, levelno);
+    level_unshare(tree, levelno+1);
+    size_t lo, hi;
+    partition_overlap(dst, p, &lo, &hi);
+    assert(dst->used + np <= dst->size);
+
+    struct kv_pair *a = (struct kv_pair *) lsm_malloc((2*np + 2*(hi-lo))
+        * sizeof(struct kv_pair));
+    struct kv_pair *b = a + np;
+    struct kv_pair *out = b + (hi-lo);
+    fseek(src->d.file_ptr, p->from*sizeof(struct kv_pair), SEEK_SET);
+    fread(a, sizeof(struct kv_pair), np, src->d.file_ptr);
+    fseek(dst->d.file_ptr, lo*sizeof(struct kv_pair), SEEK_SET);
+    fread(b, sizeof(struct kv_pair), hi-lo, dst->d.file_ptr);
+
+    /* merge, keeping the upper level's pair for equal keys */
+    size_t i = 0, j = 0, nout = 0;
+    while (i < np || j < hi-lo) {
+        struct kv_pair pick;
+        if (j == hi-lo || (i < np && a[i].key < b[j].key)) {
+            pick = a[i++];
+        } else if (i == np || b[j].key < a[i].key) {
+            pick = b[j++];
+        } else {
+            pick = a[i++];
+            j++;
+        }
+
+        /* deletes have nothing left to hide in the last level */
+        if (last && pick.op == OP_DEL)
+            continue;
+        out[nout++] = pick;
+    }
+
+    /* put the merged pairs in place of the overlap in the level below */
+    size_t used = dst->used - (hi-lo) + nout;
+    partition_shift(dst, hi, lo + nout, dst->used - hi);
+    fseek(dst->d.file_ptr, lo*sizeof(struct kv_pair), SEEK_SET);
+    fwrite(out, sizeof(struct kv_pair), nout, dst->d.file_ptr);
+    partition_blank(dst, used, dst->used);
+    size_t moved = (dst->used - hi) + (src->used - p->to);
+    dst->used = used;
+
+    /* and take the partition out of its level */
+    partition_shift(src, p->to, p->from, src->used - p->to);
+    partition_blank(src, src->used - np, src->used);
+    src->used -= np;
+
+    partition_stale(src);
+    partition_stale(dst);
+    free(a);
+    return (np + 2*(hi-lo) + nout + 2*moved)*sizeof(struct kv_pair);
+}
+
+/* move n pairs of a level file from position from to position to */
+static void partition_shift(struct level *level, size_t from, size_t to,
+        size_t n) {
+    if (from == to || n == 0)
+        return;
+    struct kv_pair *buf = (struct kv_pair *) lsm_malloc(PARTITION_BUF
+        * sizeof(struct kv_pair));
+
+    /* moving right, copy from the end so nothing is overwritten unread */
+    for (size_t done = 0; done < n; ) {
+        size_t k = n - done < PARTITION_BUF ? n - done : PARTITION_BUF;
+        size_t off = to > from ? n - done - k : done;
+        fseek(level->d.file_ptr, (from + off)*sizeof(struct kv_pair),
+            SEEK_SET);
+        fread(buf, sizeof(struct kv_pair), k, level->d.file_ptr);
+        fseek(level->d.file_ptr, (to + off)*sizeof(struct kv_pair),
+            SEEK_SET);
+        fwrite(buf, sizeof(struct kv_pair), k, level->d.file_ptr);
+        done += k;
+    }
+    free(buf);
+}
+
+/* blank the positions [from, to) of a level file */
+static void partition_blank(struct level *level, size_t from, size_t to) {
+    for (size_t pos = from; pos < to; pos++)
+        invalidate_kv(level, pos);
+}
+
+/*
+ * drop what describes a level's old contents. compact() rebuilds the
+ * filters, index and summary once the flush is done
+ */
+static void partition_stale(struct level *level) {
+    point_filter_destroy(level->filter);
+    index_destroy(level->index);
+    range_filter_destroy(level->rfilter);
+    summary_destroy(level->summary);
+    partitions_destroy(level->parts);
+    level->filter = NULL;
+    level->index = NULL;
+    level->rfilter = NULL;
+    level->summary = NULL;
+    level->parts = NULL;
+}
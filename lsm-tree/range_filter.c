@@ -0,0 +1,198 @@
+/*
+ * This file contains the range filter kept for each disk level, which lets
+ * range() skip levels that cannot hold a key in [bottom, top).
+ *
+ * The filter has two parts. The first is the smallest and largest key of
+ * the level and of each block, which answers ranges that fall outside the
+ * level or between two blocks. The second is a Rosetta-style prefix Bloom
+ * filter for short ranges inside a block: every key is added once per
+ * prefix length key >> l, for l < RFILTER_PREFIXES. A query range is split
+ * into aligned dyadic intervals, each of which is a single prefix, and a
+ * positive prefix is only believed once one of its children down to a full
+ * key is positive as well. Since every positive ends up being checked at
+ * full key length, that length gets most of the bits; the shorter prefixes
+ * only need to prune the search.
+ */
+
+#include <stdint.h>
+#include "lsm_tree.h"
+
+struct range_filter {
+    /* smallest and largest key of the level */
+    key_t min;
+    key_t max;
+
+    /* smallest and largest key of each block */
+    size_t nblocks;
+    key_t *block_min;
+    key_t *block_max;
+
+    /* prefix bloom filter, with one region of bits per prefix length */
+    size_t nbits;
+    size_t offset[RFILTER_PREFIXES];
+    size_t length[RFILTER_PREFIXES];
+    unsigned char *bits;
+};
+
+static uint32_t rfilter_ukey(key_t key);
+static uint64_t rfilter_hash(uint32_t prefix, int l, int i);
+static int rfilter_hashes(int l);
+static void rfilter_add(struct range_filter *rf, uint32_t key);
+static int rfilter_probe(struct range_filter *rf, uint32_t prefix, int l);
+
+
+/*** INITIALIZATION/CLEANUP ***/
+
+/*
+ * build a range filter over the valid pairs of a disk level. The level
+ * must not be empty
+ */
+struct range_filter *range_filter_build(struct level *level) {
+    assert(level->type == DISK_LEVEL);
+    assert(level->used > 0);
+
+    struct range_filter *rf =
+        (struct range_filter *) lsm_malloc(sizeof(struct range_filter));
+    rf->nblocks = (level->used + BLOCK_PAIRS - 1) / BLOCK_PAIRS;
+    rf->block_min = (key_t *) lsm_malloc(rf->nblocks*sizeof(key_t));
+    rf->block_max = (key_t *) lsm_malloc(rf->nblocks*sizeof(key_t));
+    rf->nbits = 0;
+    for (int l = 0; l < RFILTER_PREFIXES; l++) {
+        size_t bits = l == 0 ? RFILTER_KEY_BITS : RFILTER_PREFIX_BITS;
+        rf->offset[l] = rf->nbits;
+        rf->length[l] = level->used*bits + 1;
+        rf->nbits += rf->length[l];
+    }
+    rf->bits = (unsigned char *) lsm_calloc((rf->nbits + 7) / 8, 1);
+
+    struct kv_pair buf[BLOCK_PAIRS];
+    fseek(level->d.file_ptr, 0, SEEK_SET);
+    for (size_t b = 0; b < rf->nblocks; b++) {
+        size_t base = b*BLOCK_PAIRS;
+        size_t n = level->used - base < BLOCK_PAIRS
+            ? level->used - base : BLOCK_PAIRS;
+        fread(buf, sizeof(struct kv_pair), n, level->d.file_ptr);
+
+        rf->block_min[b] = buf[0].key;
+        rf->block_max[b] = buf[n-1].key;
+        for (size_t i = 0; i < n; i++)
+            rfilter_add(rf, rfilter_ukey(buf[i].key));
+    }
+    rf->min = rf->block_min[0];
+    rf->max = rf->block_max[rf->nblocks-1];
+    return rf;
+}
+
+void range_filter_destroy(struct range_filter *rf) {
+    if (!rf)
+        return;
+    free(rf->block_min);
+    free(rf->block_max);
+    free(rf->bits);
+    free(rf);
+}
+
+
+/*** LOOKUP ***/
+
+/*
+ * check whether the level may hold a key in [bottom, top). Returns
+ * RFILTER_NOTFOUND only if it certainly does not
+ */
+int range_filter_check(struct range_filter *rf, key_t bottom, key_t top) {
+    if (top <= bottom || top - 1 < rf->min || bottom > rf->max)
+        return RFILTER_NOTFOUND;
+
+    /* first block whose largest key is at least bottom */
+    size_t lo = 0;
+    size_t hi = rf->nblocks;
+    while (hi > lo) {
+        size_t middle = (lo + hi)/2;
+        if (rf->block_max[middle] < bottom)
+            lo = middle+1;
+        else
+            hi = middle;
+    }
+    assert(lo < rf->nblocks);
+
+    /* the next key after bottom starts this block */
+    if (rf->block_min[lo] >= top)
+        return RFILTER_NOTFOUND;
+    if (rf->block_min[lo] >= bottom)
+        return RFILTER_FOUND;
+
+    /* the range starts inside this block: fall back on the prefix filter */
+    uint64_t first = rfilter_ukey(bottom);
+    uint64_t last = rfilter_ukey(top - 1 < rf->block_max[lo]
+        ? top - 1 : rf->block_max[lo]);
+    if (last - first >= RFILTER_MAX_SPAN)
+        return RFILTER_FOUND;
+
+    while (first <= last) {
+        /* largest aligned interval starting at first that fits */
+        int l = 0;
+        while (l < RFILTER_PREFIXES - 1 && (first & ((2ull << l) - 1)) == 0
+                && first + (2ull << l) - 1 <= last)
+            l++;
+        if (rfilter_probe(rf, (uint32_t) (first >> l), l))
+            return RFILTER_FOUND;
+        first += 1ull << l;
+    }
+    return RFILTER_NOTFOUND;
+}
+
+/* bytes of memory used by the filter */
+size_t range_filter_memory(struct range_filter *rf) {
+    if (!rf)
+        return 0;
+    return sizeof(struct range_filter) + 2*rf->nblocks*sizeof(key_t)
+        + (rf->nbits + 7) / 8;
+}
+
+
+/*** PREFIX BLOOM FILTER ***/
+
+/* map keys to unsigned integers with the same order */
+static uint32_t rfilter_ukey(key_t key) {
+    return (uint32_t) key ^ 0x80000000u;
+}
+
+static uint64_t rfilter_hash(uint32_t prefix, int l, int i) {
+    uint64_t x = ((uint64_t) prefix << 8 | (uint64_t) l)
+        * 0x9e3779b97f4a7c15ull + (uint64_t) i * 0xc2b2ae3d27d4eb4full;
+    x ^= x >> 31;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 29;
+    return x;
+}
+
+static int rfilter_hashes(int l) {
+    return l == 0 ? RFILTER_KEY_HASHES : RFILTER_PREFIX_HASHES;
+}
+
+static void rfilter_add(struct range_filter *rf, uint32_t key) {
+    for (int l = 0; l < RFILTER_PREFIXES; l++) {
+        for (int i = 0; i < rfilter_hashes(l); i++) {
+            uint64_t bit = rf->offset[l]
+                + rfilter_hash(key >> l, l, i) % rf->length[l];
+            rf->bits[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+}
+
+/*
+ * check for a key with the given prefix of length l, confirming a positive
+ * prefix against its children so that false positives do not add up
+ */
+static int rfilter_probe(struct range_filter *rf, uint32_t prefix, int l) {
+    for (int i = 0; i < rfilter_hashes(l); i++) {
+        uint64_t bit = rf->offset[l]
+            + rfilter_hash(prefix, l, i) % rf->length[l];
+        if (!(rf->bits[bit / 8] & (1 << (bit % 8))))
+            return 0;
+    }
+    if (l == 0)
+        return 1;
+    return rfilter_probe(rf, prefix << 1, l-1)
+        || rfilter_probe(rf, prefix << 1 | 1, l-1);
+}
@@ -0,0 +1,59 @@
+/*
+ * This file contains readahead for range scans of disk levels.
+ *
+ * A range query knows the part of each disk level it will read from the
+ * index before it reads any of it. levels_range() and range_aggregate()
+ * first ask the kernel to start reading the first window of that part in
+ * every level, so the reads of all the levels being merged are in flight
+ * at once, and then read each level in windows of d.readahead blocks,
+ * asking for the next window before reading the current one. The copy out
+ * of one window then overlaps the disk reading the next, and a long scan
+ * streams at sequential bandwidth instead of waiting on each page in turn.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include <fcntl.h>
+#include "lsm_tree.h"
+
+/*
+ * set_readahead:
+ * Read disk levels up to blocks blocks ahead of a range scan. 0 turns
+ * readahead off, and the default is RANGE_READAHEAD
+ */
+void set_readahead(struct lsm_tree *tree, size_t blocks) {
+    for (int i = tree->nlevels_main; i < tree->nlevels; i++)
+        tree->levels[i].d.readahead = blocks;
+}
+
+/*
+ * start reading positions [from, to) of a disk level, up to one window of
+ * them. Returns the end of what was asked for
+ */
+size_t level_readahead(struct level *level, size_t from, size_t to) {
+    if (level->type != DISK_LEVEL || level->d.readahead == 0 || to <= from)
+        return from;
+    size_t window = level->d.readahead*BLOCK_PAIRS;
+    if (to - from > window)
+        to = from + window;
+    posix_fadvise(fileno(level->d.file_ptr), from*sizeof(struct kv_pair),
+        (to - from)*sizeof(struct kv_pair), POSIX_FADV_WILLNEED);
+    return to;
+}
+
+/*
+ * read positions [from, to) of a disk level into buf a window at a time,
+ * each window asked for before the one ahead of it is read
+ */
+void level_read_ahead(struct level *level, size_t from, size_t to,
+        struct kv_pair *buf) {
+    size_t window = level->d.readahead ? level->d.readahead*BLOCK_PAIRS
+        : to - from;
+    fseek(level->d.file_ptr, from*sizeof(struct kv_pair), SEEK_SET);
+    for (size_t pos = from; pos < to; ) {
+        size_t n = to - pos < window ? to - pos : window;
+        level_readahead(level, pos + n, to);
+        fread(buf + (pos - from), sizeof(struct kv_pair), n,
+            level->d.file_ptr);
+        pos += n;
+    }
+}
@@ -0,0 +1,375 @@
+/*
+ * Replays a trace recorded with set_trace() (main -t <file>) against a
+ * fresh tree, to reproduce a slowdown under a configuration of choice.
+ *
+ * The operations each thread recorded are rerun by a thread of their own,
+ * in the order they were recorded. By default each one waits until as long
+ * after the start of the replay as it originally came after the start of
+ * the trace, so the load arrives as it did; with -m they run back to back.
+ * Flushes in the trace are not replayed, since the replayed writes cause
+ * their own, but their counts and times are reported next to the latencies
+ * of the operations, original and replayed. The replayed tree can itself
+ * be traced with -o for a closer comparison. -D turns on direct I/O for
+ * large merges, -a auto-tunes the tree, and -P picks a partial compaction
+ * policy.
+ *
+ * usage: replay [-m] [-L size,size,...] [-M main levels] [-c cache bytes]
+ *               [-f filter bits] [-x none|fence|learned]
+ *               [-j subcompaction threads] [-D] [-a]
+ *               [-P full|round-robin|least-overlap|most-tombstones]
+ *               [-o trace] <trace>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "lsm_tree.h"
+
+#define REPLAY_NAME "replay"
+#define REPLAY_MAX_LEVELS 16
+
+struct op_stats {
+    long count;
+    double orig_ns;
+    double replay_ns;
+    uint32_t max_ns;
+};
+
+/* the events of one recorded thread, and how replaying them went */
+struct stream {
+    struct lsm_tree *tree;
+    int max_speed;
+    struct timespec *start;
+
+    struct trace_event *events;
+    size_t num;
+    struct op_stats stats[TRACE_TYPES];
+};
+
+static const char *op_names[TRACE_TYPES] = {"put", "delete", "range delete",
+    "batch", "get", "range", "aggregate", "flush", "compaction"};
+
+struct trace_event *replay_read(const char *filename, size_t *num);
+void *replay_thread(void *arg);
+void replay_wait(struct timespec *start, uint64_t time);
+int replay_count(key_t key, val_t val, void *ctx);
+void stats_add(struct op_stats *s, struct trace_event *ev, uint64_t ns);
+uint64_t elapsed_ns(struct timespec *from);
+void usage(void);
+
+int main(int argc, char *argv[]) {
+    size_t sizes[REPLAY_MAX_LEVELS] = {8192, 1048576};
+    int nlevels = 2;
+    int nmain = 1;
+    size_t cache = 0;
+    double bits = FILTER_BITS;
+    int index = INDEX_FENCE;
+    int threads = 0;
+    int compaction = COMPACT_FULL;
+    int direct = 0;
+    int autotune = 0;
+    int max_speed = 0;
+    char *out = NULL;
+
+    int c;
+    while ((c = getopt(argc, argv, "mL:M:c:f:x:j:DaP:o:")) != -1) {
+        switch (c) {
+            case 'm':
+                max_speed = 1;
+                break;
+            case 'L':
+                nlevels = 0;
+                for (char *s = strtok(optarg, ","); s
+                        && nlevels < REPLAY_MAX_LEVELS; s = strtok(NULL, ","))
+                    sizes[nlevels++] = strtoul(s, NULL, 10);
+                break;
+            case 'M':
+                nmain = atoi(optarg);
+                break;
+            case 'c':
+                cache = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                bits = atof(optarg);
+                break;
+            case 'x':
+                if (!strcmp(optarg, "none"))
+                    index = INDEX_NONE;
+                else if (!strcmp(optarg, "learned"))
+                    index = INDEX_LEARNED;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'D':
+                direct = 1;
+                break;
+            case 'a':
+                autotune = 1;
+                break;
+            case 'P':
+                if (!strcmp(optarg, "round-robin"))
+                    compaction = COMPACT_ROUND_ROBIN;
+                else if (!strcmp(optarg, "least-overlap"))
+                    compaction = COMPACT_LEAST_OVERLAP;
+                else if (!strcmp(optarg, "most-tombstones"))
+                    compaction = COMPACT_MOST_TOMBSTONES;
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (optind != argc-1 || nmain < 1 || nlevels < nmain) {
+        usage();
+        return 1;
+    }
+
+    size_t num;
+    struct trace_event *events = replay_read(argv[optind], &num);
+    if (!events)
+        return 1;
+
+    /* split the events by the thread that recorded them, keeping order */
+    int nthreads = 1;
+    for (size_t i = 0; i < num; i++) {
+        if (events[i].thread >= nthreads)
+            nthreads = events[i].thread + 1;
+    }
+    struct stream *streams = (struct stream *) calloc(nthreads,
+        sizeof(struct stream));
+    for (size_t i = 0; i < num; i++)
+        streams[events[i].thread].num++;
+    struct trace_event *sorted = (struct trace_event *) malloc(num
+        * sizeof(struct trace_event));
+    size_t at = 0;
+    for (int t = 0; t < nthreads; t++) {
+        streams[t].events = sorted + at;
+        at += streams[t].num;
+        streams[t].num = 0;
+    }
+    uint64_t span = 0;
+    for (size_t i = 0; i < num; i++) {
+        struct stream *s = streams + events[i].thread;
+        s->events[s->num++] = events[i];
+        if (events[i].time + events[i].latency > span)
+            span = events[i].time + events[i].latency;
+    }
+    free(events);
+
+    struct lsm_tree *tree = init(REPLAY_NAME, nlevels, nmain, sizes);
+    set_index(tree, index);
+    set_filter(tree, bits, FILTER_MONKEY);
+    set_cache(tree, cache);
+    set_subcompactions(tree, threads);
+    set_compaction(tree, compaction);
+    set_direct_io(tree, direct);
+    if (autotune)
+        set_autotune(tree, 0);
+    if (out && set_trace(tree, out)) {
+        perror(out);
+        return 1;
+    }
+
+    /* thread 0 recorded the flushes, which are only counted */
+    pthread_t *tids = (pthread_t *) malloc(nthreads*sizeof(pthread_t));
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 1; t < nthreads; t++) {
+        streams[t].tree = tree;
+        streams[t].max_speed = max_speed;
+        streams[t].start = &start;
+        pthread_create(tids + t, NULL, replay_thread, streams + t);
+    }
+    for (size_t i = 0; i < streams[0].num; i++) {
+        struct trace_event *ev = streams[0].events + i;
+        stats_add(streams[0].stats + ev->type, ev, 0);
+    }
+
+    struct op_stats total[TRACE_TYPES];
+    memset(total, 0, sizeof(total));
+    for (int t = 0; t < nthreads; t++) {
+        if (t > 0)
+            pthread_join(tids[t], NULL);
+        for (int op = 0; op < TRACE_TYPES; op++) {
+            struct op_stats *s = streams[t].stats + op;
+            total[op].count += s->count;
+            total[op].orig_ns += s->orig_ns;
+            total[op].replay_ns += s->replay_ns;
+            if (s->max_ns > total[op].max_ns)
+                total[op].max_ns = s->max_ns;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    printf("%zu events from %d threads, %s speed: original %.3f s, "
+        "replay %.3f s\n", num, nthreads - 1, max_speed ? "maximum"
+        : "original", span / 1e9, (stop.tv_sec - start.tv_sec)
+        + (stop.tv_nsec - start.tv_nsec) / 1e9);
+    printf("%-12s %10s %14s %14s %14s\n", "op", "count", "orig mean us",
+        "replay mean us", "replay max us");
+    for (int op = 0; op < TRACE_TYPES; op++) {
+        struct op_stats *s = total + op;
+        if (s->count == 0)
+            continue;
+        if (op == TRACE_FLUSH || op == TRACE_COMPACT)
+            printf("%-12s %10ld %14.1f\n", op_names[op], s->count,
+                s->orig_ns / s->count / 1e3);
+        else
+            printf("%-12s %10ld %14.1f %14.1f %14.1f\n", op_names[op],
+                s->count, s->orig_ns / s->count / 1e3,
+                s->replay_ns / s->count / 1e3, s->max_ns / 1e3);
+    }
+
+    destroy(tree);
+    free(tids);
+    free(sorted);
+    free(streams);
+    return 0;
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: replay [-m] [-L size,size,...] [-M main levels] "
+        "[-c cache bytes] [-f filter bits] [-x none|fence|learned] "
+        "[-j subcompaction threads] [-D] [-a] "
+        "[-P full|round-robin|least-overlap|most-tombstones] [-o trace] "
+        "<trace>\n");
+}
+
+/* read a whole trace file, or print why not and return NULL */
+struct trace_event *replay_read(const char *filename, size_t *num) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        return NULL;
+    }
+
+    struct trace_header h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC
+            || h.version != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a trace\n", filename);
+        fclose(f);
+        return NULL;
+    }
+
+    size_t cap = 4096;
+    struct trace_event *events = (struct trace_event *) malloc(cap
+        * sizeof(struct trace_event));
+    *num = 0;
+    size_t n;
+    while ((n = fread(events + *num, sizeof(struct trace_event),
+            cap - *num, f)) > 0) {
+        *num += n;
+        if (*num == cap) {
+            cap *= 2;
+            events = (struct trace_event *) realloc(events,
+                cap*sizeof(struct trace_event));
+        }
+    }
+    fclose(f);
+    return events;
+}
+
+/* rerun the events of one recorded thread */
+void *replay_thread(void *arg) {
+    struct stream *s = (struct stream *) arg;
+    struct lsm_tree *tree = s->tree;
+    struct kv_pair *batch = NULL;
+    size_t batch_cap = 0;
+    struct aggregate agg;
+    struct timespec before;
+    val_t val;
+
+    for (size_t i = 0; i < s->num; i++) {
+        struct trace_event *ev = s->events + i;
+        if (!s->max_speed)
+            replay_wait(s->start, ev->time);
+
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        switch (ev->type) {
+            case TRACE_PUT:
+                put(tree, ev->key, ev->arg);
+                break;
+            case TRACE_DELETE:
+                delete(tree, ev->key);
+                break;
+            case TRACE_RANGE_DELETE:
+                range_delete(tree, ev->key, ev->arg);
+                break;
+            case TRACE_BATCH: {
+                /* its pairs follow it */
+                size_t n = (size_t) ev->arg;
+                if (n > s->num - i - 1)
+                    n = s->num - i - 1;
+                if (n > batch_cap) {
+                    batch_cap = n;
+                    batch = (struct kv_pair *) realloc(batch,
+                        batch_cap*sizeof(struct kv_pair));
+                }
+                for (size_t j = 0; j < n; j++) {
+                    struct trace_event *p = ev + 1 + j;
+                    batch[j].key = p->key;
+                    batch[j].val = p->arg;
+                    batch[j].op = p->type == TRACE_DELETE ? OP_DEL : OP_ADD;
+                }
+                write_batch(tree, batch, n);
+                stats_add(s->stats + ev->type, ev, elapsed_ns(&before));
+                i += n;
+                continue;
+            }
+            case TRACE_GET:
+                get(tree, ev->key, &val);
+                break;
+            case TRACE_RANGE:
+                range_each(tree, ev->key, ev->arg, replay_count, NULL);
+                break;
+            case TRACE_AGGREGATE:
+                range_aggregate(tree, ev->key, ev->arg, &agg);
+                break;
+            default:
+                continue;
+        }
+        stats_add(s->stats + ev->type, ev, elapsed_ns(&before));
+    }
+
+    free(batch);
+    return NULL;
+}
+
+/* sleep until time ns after start */
+void replay_wait(struct timespec *start, uint64_t time) {
+    uint64_t now = elapsed_ns(start);
+    if (now >= time)
+        return;
+    struct timespec ts;
+    ts.tv_sec = (time - now) / 1000000000;
+    ts.tv_nsec = (time - now) % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+/* a range_fn that just walks the range */
+int replay_count(key_t key, val_t val, void *ctx) {
+    (void) key;
+    (void) val;
+    (void) ctx;
+    return 0;
+}
+
+void stats_add(struct op_stats *s, struct trace_event *ev, uint64_t ns) {
+    s->count++;
+    s->orig_ns += ev->latency;
+    s->replay_ns += ns;
+    if (ns > s->max_ns)
+        s->max_ns = (uint32_t) ns;
+}
+
+uint64_t elapsed_ns(struct timespec *from) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) (now.tv_sec - from->tv_sec) * 1000000000
+        + now.tv_nsec - from->tv_nsec;
+}
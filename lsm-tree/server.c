@@ -0,0 +1,559 @@
+/*
+ * This file contains the server mode (main -s <address>), which lets many
+ * local processes share one tree.
+ *
+ * A single thread runs an epoll loop over the listening socket and every
+ * connection. Each round it reads what the ready connections have sent,
+ * parses every complete request in their buffers (so clients can pipeline
+ * as deeply as they like) and executes them in order. Consecutive puts and
+ * deletes are not applied one at a time but gathered into a batch that is
+ * handed to write_batch() in one go, before the next read or at the end of
+ * the round. Replies are queued per connection and written out once the
+ * round's batch has been applied.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "lsm_tree.h"
+#include "server.h"
+
+#define SRV_MAX_EVENTS 64
+#define SRV_BACKLOG 128
+#define SRV_READ_SIZE 65536
+#define SRV_MAX_LINE 256
+#define SRV_BATCH 4096
+
+struct buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+
+    /* bytes before off have been consumed */
+    size_t off;
+};
+
+struct conn {
+    int fd;
+    int binary;
+    int known;
+
+    struct buffer in;
+    struct buffer out;
+
+    /* touched this round, and to be closed once its replies are out */
+    int touched;
+    int closing;
+    int writing;
+};
+
+struct server {
+    struct lsm_tree *tree;
+    int listen_fd;
+    int epfd;
+    const char *path;
+
+    /* puts and deletes waiting to be applied */
+    struct kv_pair *batch;
+    size_t nbatch;
+
+    /* connections touched this round */
+    struct conn **touched;
+    size_t ntouched;
+    size_t cap_touched;
+
+    /* stats */
+    long requests;
+    long batches;
+    long batched;
+};
+
+static volatile sig_atomic_t srv_stop = 0;
+
+static int srv_listen(struct server *s, const char *addr);
+static void srv_accept(struct server *s);
+static void srv_read(struct server *s, struct conn *c);
+static void srv_process(struct server *s, struct conn *c);
+static int srv_text(struct server *s, struct conn *c, char *line);
+static void srv_binary(struct server *s, struct conn *c,
+    struct srv_request *req);
+static int srv_range_text(key_t key, val_t val, void *ctx);
+static int srv_range_binary(key_t key, val_t val, void *ctx);
+static void srv_write(struct server *s, struct kv_pair *kv);
+static void srv_apply(struct server *s);
+static void srv_touch(struct server *s, struct conn *c);
+static void srv_flush(struct server *s, struct conn *c);
+static void srv_close(struct server *s, struct conn *c);
+static void srv_signal(int sig);
+static void buf_reserve(struct buffer *b, size_t n);
+static void buf_append(struct buffer *b, const void *data, size_t n);
+static void buf_printf(struct buffer *b, const char *fmt, ...);
+static void buf_compact(struct buffer *b);
+
+
+/*** EVENT LOOP ***/
+
+/*
+ * serve:
+ * Serve the tree on addr until interrupted (SIGINT or SIGTERM). Returns 0
+ * after a clean shutdown and -1 if the server could not be started
+ */
+int serve(struct lsm_tree *tree, const char *addr) {
+    struct server s;
+    s.tree = tree;
+    s.path = NULL;
+    s.batch = (struct kv_pair *) lsm_malloc(SRV_BATCH*sizeof(struct kv_pair));
+    s.nbatch = 0;
+    s.touched = NULL;
+    s.ntouched = 0;
+    s.cap_touched = 0;
+    s.requests = 0;
+    s.batches = 0;
+    s.batched = 0;
+
+    if (srv_listen(&s, addr)) {
+        free(s.batch);
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = srv_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving on %s\n", addr);
+    fflush(stdout);
+
+    struct epoll_event events[SRV_MAX_EVENTS];
+    while (!srv_stop) {
+        int n = epoll_wait(s.epfd, events, SRV_MAX_EVENTS, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct conn *c = (struct conn *) events[i].data.ptr;
+            if (!c) {
+                srv_accept(&s);
+                continue;
+            }
+            srv_touch(&s, c);
+            if (events[i].events & EPOLLERR)
+                c->closing = 1;
+            else if (events[i].events & (EPOLLIN | EPOLLHUP))
+                srv_read(&s, c);
+        }
+
+        /* apply the round's writes, then send its replies */
+        srv_apply(&s);
+        for (size_t i = 0; i < s.ntouched; i++)
+            srv_flush(&s, s.touched[i]);
+        s.ntouched = 0;
+    }
+
+    close(s.listen_fd);
+    close(s.epfd);
+    if (s.path)
+        unlink(s.path);
+    free(s.batch);
+    free(s.touched);
+
+    printf("Served %ld requests, %ld writes in %ld batches\n", s.requests,
+        s.batched, s.batches);
+    return 0;
+}
+
+static int srv_listen(struct server *s, const char *addr) {
+    struct sockaddr_storage ss;
+    socklen_t len = srv_addr(addr, &ss);
+    if (len == 0) {
+        fprintf(stderr, "Bad server address %s\n", addr);
+        return -1;
+    }
+
+    s->listen_fd = socket(ss.ss_family, SOCK_STREAM, 0);
+    if (s->listen_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (ss.ss_family == AF_UNIX) {
+        unlink(addr);
+        s->path = addr;
+    } else {
+        int one = 1;
+        setsockopt(s->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (bind(s->listen_fd, (struct sockaddr *) &ss, len)
+            || listen(s->listen_fd, SRV_BACKLOG)) {
+        perror(addr);
+        close(s->listen_fd);
+        return -1;
+    }
+    fcntl(s->listen_fd, F_SETFL, fcntl(s->listen_fd, F_GETFL) | O_NONBLOCK);
+
+    /* the listening socket is the event with no connection */
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    s->epfd = epoll_create1(0);
+    epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->listen_fd, &ev);
+    return 0;
+}
+
+static void srv_accept(struct server *s) {
+    while (1) {
+        int fd = accept(s->listen_fd, NULL, NULL);
+        if (fd < 0)
+            return;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        struct conn *c = (struct conn *) lsm_calloc(1, sizeof(struct conn));
+        c->fd = fd;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void srv_read(struct server *s, struct conn *c) {
+    buf_compact(&c->in);
+    buf_reserve(&c->in, SRV_READ_SIZE);
+    ssize_t n = read(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        c->closing = 1;
+        return;
+    }
+    if (n > 0) {
+        c->in.len += n;
+        srv_process(s, c);
+    }
+}
+
+static void srv_signal(int sig) {
+    (void) sig;
+    srv_stop = 1;
+}
+
+
+/*** REQUESTS ***/
+
+/* execute every complete request in a connection's input */
+static void srv_process(struct server *s, struct conn *c) {
+    struct buffer *in = &c->in;
+    if (!c->known && in->len > in->off) {
+        c->binary = (unsigned char) in->data[in->off] & SRV_BINARY;
+        c->known = 1;
+    }
+
+    while (!c->closing && in->len > in->off) {
+        char *start = in->data + in->off;
+        size_t avail = in->len - in->off;
+
+        if (c->binary) {
+            if (avail < sizeof(struct srv_request))
+                break;
+            struct srv_request req;
+            memcpy(&req, start, sizeof(req));
+            in->off += sizeof(req);
+            srv_binary(s, c, &req);
+        } else {
+            char *end = memchr(start, '\n', avail);
+            if (!end) {
+                if (avail > SRV_MAX_LINE)
+                    c->closing = 1;
+                break;
+            }
+            *end = '\0';
+            in->off += end - start + 1;
+            if (end > start && end[-1] == '\r')
+                end[-1] = '\0';
+            if (srv_text(s, c, start))
+                c->closing = 1;
+        }
+        s->requests++;
+    }
+}
+
+/*
+ * execute one line of the DSL, queueing one reply line. Returns 1 if the
+ * client asked to quit
+ */
+static int srv_text(struct server *s, struct conn *c, char *line) {
+    struct lsm_tree *tree = s->tree;
+    struct buffer *out = &c->out;
+    char *save;
+    char *args[4];
+    int nargs = 0;
+
+    char *cmd = strtok_r(line, " ", &save);
+    if (!cmd) {
+        buf_printf(out, "error\n");
+        return 0;
+    }
+    while (nargs < 4 && (args[nargs] = strtok_r(NULL, " ", &save)))
+        nargs++;
+
+    struct kv_pair kv;
+    if (!strcmp(cmd, "p") && nargs == 2) {
+        kv.key = atoi(args[0]);
+        kv.val = atoi(args[1]);
+        kv.op = OP_ADD;
+        srv_write(s, &kv);
+        buf_printf(out, "ok\n");
+    } else if (!strcmp(cmd, "d") && nargs == 1) {
+        kv.key = atoi(args[0]);
+        kv.val = 0;
+        kv.op = OP_DEL;
+        srv_write(s, &kv);
+        buf_printf(out, "ok\n");
+    } else if (!strcmp(cmd, "g") && nargs == 1) {
+        srv_apply(s);
+        uint64_t start = trace_now(tree->trace);
+        kv.key = atoi(args[0]);
+        int r = tree_get(tree, kv.key, &kv.val);
+        trace_op(tree->trace, TRACE_GET, kv.key, r, start);
+        tune_op(tree->tuner, TRACE_GET, r);
+        if (r == GET_SUCCESS)
+            buf_printf(out, "%d\n", kv.val);
+        else
+            buf_printf(out, "\n");
+    } else if (!strcmp(cmd, "r") && nargs == 2) {
+        srv_apply(s);
+        range_each(tree, atoi(args[0]), atoi(args[1]), srv_range_text, out);
+        buf_printf(out, "\n");
+    } else if (!strcmp(cmd, "D") && nargs == 2) {
+        srv_apply(s);
+        range_delete(tree, atoi(args[0]), atoi(args[1]));
+        buf_printf(out, "ok\n");
+    } else if (!strcmp(cmd, "a") && nargs == 3) {
+        struct aggregate agg;
+        srv_apply(s);
+        range_aggregate(tree, atoi(args[1]), atoi(args[2]), &agg);
+        if (!strcmp(args[0], "count"))
+            buf_printf(out, "%zu\n", agg.count);
+        else if (!strcmp(args[0], "sum"))
+            buf_printf(out, "%lld\n", agg.sum);
+        else if (!strcmp(args[0], "min") && agg.count > 0)
+            buf_printf(out, "%d\n", agg.min);
+        else if (!strcmp(args[0], "max") && agg.count > 0)
+            buf_printf(out, "%d\n", agg.max);
+        else if (!strcmp(args[0], "min") || !strcmp(args[0], "max"))
+            buf_printf(out, "\n");
+        else
+            buf_printf(out, "error\n");
+    } else if (!strcmp(cmd, "l") && nargs == 1) {
+        srv_apply(s);
+        load(tree, args[0]);
+        buf_printf(out, "ok\n");
+    } else if (!strcmp(cmd, "s") && nargs == 0) {
+        long total = 0;
+        srv_apply(s);
+        for (int i = 0; i < tree->nlevels; i++)
+            total += tree->levels[i].used;
+        buf_printf(out, "Total Pairs: %ld\n", total);
+    } else if (!strcmp(cmd, "q")) {
+        return 1;
+    } else {
+        buf_printf(out, "error\n");
+    }
+    return 0;
+}
+
+/* execute one binary request, queueing its reply */
+static void srv_binary(struct server *s, struct conn *c,
+        struct srv_request *req) {
+    struct lsm_tree *tree = s->tree;
+    struct srv_reply reply;
+    struct kv_pair kv;
+    reply.status = SRV_OK;
+    reply.val = 0;
+
+    switch (req->op) {
+        case SRV_PUT:
+        case SRV_DELETE:
+            kv.key = req->key1;
+            kv.val = req->key2;
+            kv.op = req->op == SRV_PUT ? OP_ADD : OP_DEL;
+            srv_write(s, &kv);
+            break;
+        case SRV_GET: {
+            srv_apply(s);
+            uint64_t start = trace_now(tree->trace);
+            int r = tree_get(tree, req->key1, &kv.val);
+            trace_op(tree->trace, TRACE_GET, req->key1, r, start);
+            tune_op(tree->tuner, TRACE_GET, r);
+            if (r == GET_SUCCESS)
+                reply.val = kv.val;
+            else
+                reply.status = SRV_FAIL;
+            break;
+        }
+        case SRV_RANGE: {
+            srv_apply(s);
+
+            /* the count goes first, so reserve its place */
+            size_t at = c->out.len;
+            buf_append(&c->out, &reply, sizeof(reply));
+            reply.status = range_each(tree, req->key1, req->key2,
+                srv_range_binary, &c->out);
+            memcpy(c->out.data + at, &reply, sizeof(reply));
+            return;
+        }
+        case SRV_RANGE_DELETE:
+            srv_apply(s);
+            range_delete(tree, req->key1, req->key2);
+            break;
+        case SRV_STAT:
+            srv_apply(s);
+            for (int i = 0; i < tree->nlevels; i++)
+                reply.val += tree->levels[i].used;
+            break;
+        default:
+            reply.status = SRV_ERROR;
+    }
+    buf_append(&c->out, &reply, sizeof(reply));
+}
+
+/* range_fns queueing each pair of a range as text and as binary */
+static int srv_range_text(key_t key, val_t val, void *ctx) {
+    buf_printf((struct buffer *) ctx, "%d:%d ", key, val);
+    return 0;
+}
+
+static int srv_range_binary(key_t key, val_t val, void *ctx) {
+    int32_t pair[2] = { key, val };
+    buf_append((struct buffer *) ctx, pair, sizeof(pair));
+    return 0;
+}
+
+/* queue a put or delete, applying the batch if it is full */
+static void srv_write(struct server *s, struct kv_pair *kv) {
+    if (s->nbatch == SRV_BATCH)
+        srv_apply(s);
+    s->batch[s->nbatch++] = *kv;
+}
+
+/* apply the queued writes, so that reads see them */
+static void srv_apply(struct server *s) {
+    if (s->nbatch == 0)
+        return;
+    write_batch(s->tree, s->batch, s->nbatch);
+    s->batches++;
+    s->batched += s->nbatch;
+    s->nbatch = 0;
+}
+
+
+/*** CONNECTIONS ***/
+
+static void srv_touch(struct server *s, struct conn *c) {
+    if (c->touched)
+        return;
+    if (s->ntouched == s->cap_touched) {
+        s->cap_touched = s->cap_touched ? 2*s->cap_touched : 64;
+        s->touched = (struct conn **) lsm_realloc(s->touched,
+            s->cap_touched*sizeof(struct conn *));
+    }
+    s->touched[s->ntouched++] = c;
+    c->touched = 1;
+}
+
+/*
+ * write out as much of a connection's replies as the socket takes, and
+ * wait for it to drain if it does not take them all
+ */
+static void srv_flush(struct server *s, struct conn *c) {
+    struct buffer *out = &c->out;
+    c->touched = 0;
+
+    while (out->len > out->off) {
+        ssize_t n = write(c->fd, out->data + out->off, out->len - out->off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EAGAIN) {
+            c->closing = 1;
+            break;
+        }
+        if (n < 0)
+            break;
+        out->off += n;
+    }
+    if (out->off == out->len)
+        out->off = out->len = 0;
+
+    if (c->closing) {
+        srv_close(s, c);
+        return;
+    }
+
+    int writing = out->len > out->off;
+    if (writing != c->writing) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->writing = writing;
+    }
+}
+
+static void srv_close(struct server *s, struct conn *c) {
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->in.data);
+    free(c->out.data);
+    free(c);
+}
+
+
+/*** BUFFERS ***/
+
+/* make room for n more bytes */
+static void buf_reserve(struct buffer *b, size_t n) {
+    if (b->len + n <= b->cap)
+        return;
+    while (b->len + n > b->cap)
+        b->cap = b->cap ? 2*b->cap : 4096;
+    b->data = (char *) lsm_realloc(b->data, b->cap);
+}
+
+static void buf_append(struct buffer *b, const void *data, size_t n) {
+    buf_reserve(b, n);
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+}
+
+static void buf_printf(struct buffer *b, const char *fmt, ...) {
+    va_list ap;
+    buf_reserve(b, SRV_MAX_LINE);
+    va_start(ap, fmt);
+    int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+    va_end(ap);
+
+    if ((size_t) n >= b->cap - b->len) {
+        buf_reserve(b, n + 1);
+        va_start(ap, fmt);
+        vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+    }
+    b->len += n;
+}
+
+/* drop the consumed bytes from the front of a buffer */
+static void buf_compact(struct buffer *b) {
+    if (b->off == 0)
+        return;
+    memmove(b->data, b->data + b->off, b->len - b->off);
+    b->len -= b->off;
+    b->off = 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * Header file for the LSM tree server and its load-generating client
+ *
+ * A server address is either a path, for a Unix-domain socket, or
+ * host:port for TCP, where :port alone means the loopback interface.
+ *
+ * Clients speak either the text DSL, one command per line with one reply
+ * line per command, or the binary protocol below. The first byte a client
+ * sends picks the protocol for its connection: binary requests have the
+ * top bit of their op set, which no DSL command does. Either way requests
+ * can be pipelined, and replies come back in order.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* binary ops are the DSL letter with the top bit set */
+#define SRV_BINARY 0x80
+#define SRV_PUT (SRV_BINARY | 'p')
+#define SRV_GET (SRV_BINARY | 'g')
+#define SRV_RANGE (SRV_BINARY | 'r')
+#define SRV_DELETE (SRV_BINARY | 'd')
+#define SRV_RANGE_DELETE (SRV_BINARY | 'D')
+#define SRV_STAT (SRV_BINARY | 's')
+
+#define SRV_OK 1
+#define SRV_FAIL 0
+#define SRV_ERROR -1
+
+/* a binary request, in host byte order */
+struct srv_request {
+    uint8_t op;
+    uint8_t pad[3];
+    int32_t key1;
+    int32_t key2;
+};
+
+/*
+ * a binary reply. status is SRV_OK, SRV_FAIL (a missing get) or SRV_ERROR,
+ * except for ranges, where it is the number of key-value pairs of int32s
+ * that follow. A get returns its value in val and a stat the total number
+ * of pairs
+ */
+struct srv_reply {
+    int32_t status;
+    int32_t val;
+};
+
+struct lsm_tree;
+int serve(struct lsm_tree *tree, const char *addr);
+
+/*
+ * fill in the socket address for a server address. Returns its length,
+ * or 0 if the address is malformed
+ */
+static inline socklen_t srv_addr(const char *addr,
+        struct sockaddr_storage *ss) {
+    memset(ss, 0, sizeof(*ss));
+    const char *colon = strrchr(addr, ':');
+
+    if (strchr(addr, '/') || !colon) {
+        struct sockaddr_un *un = (struct sockaddr_un *) ss;
+        if (strlen(addr) >= sizeof(un->sun_path))
+            return 0;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, addr);
+        return sizeof(struct sockaddr_un);
+    }
+
+    struct sockaddr_in *in = (struct sockaddr_in *) ss;
+    int port = atoi(colon + 1);
+    if (port <= 0 || port > 65535)
+        return 0;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (colon > addr) {
+        char host[64];
+        size_t n = colon - addr;
+        if (n >= sizeof(host))
+            return 0;
+        memcpy(host, addr, n);
+        host[n] = '\0';
+        if (inet_pton(AF_INET, host, &in->sin_addr) != 1)
+            return 0;
+    }
+    return sizeof(struct sockaddr_in);
+}
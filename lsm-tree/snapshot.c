@@ -0,0 +1,270 @@
+/*
+ * This file contains checkpoints and read snapshots.
+ *
+ * Disk level files are named by level and version (name.levelN.V.bin). A
+ * checkpoint hard-links the current file of every disk level into a
+ * directory, and a snapshot keeps its own handle on them, so neither copies
+ * any data. Since migrate() updates level files in place, a level whose file
+ * is pinned this way is marked shared, and compaction moves it to a new
+ * version with level_unshare() before writing to it again. The new version
+ * is a reflink clone where the file system supports it (so only the blocks
+ * compaction rewrites get copied) and a plain copy elsewhere.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+/* ours is the disk block size used for indexing */
+#undef BLOCK_SIZE
+#endif
+#include "lsm_tree.h"
+
+struct snapshot {
+    int nlevels;
+    struct level *levels;
+};
+
+static const char *base_name(const char *path);
+static int level_clone(FILE *dst, FILE *src, size_t bytes, size_t length);
+static void snapshot_main_level(struct level *copy, struct level *level);
+
+
+/*** FILE VERSIONS ***/
+
+/* name the file for a version of a disk level */
+void level_filename(struct lsm_tree *tree, int levelno, char *buf,
+        size_t buflen) {
+    struct level *level = tree->levels + levelno;
+    snprintf(buf, buflen, "%s.level%d.%u.bin", tree->name, levelno,
+        level->d.version);
+}
+
+/*
+ * move a shared disk level to a new version of its file, leaving the old
+ * version to the checkpoints and snapshots that refer to it
+ */
+void level_unshare(struct lsm_tree *tree, int levelno) {
+    struct level *level = tree->levels + levelno;
+    assert(level->type == DISK_LEVEL);
+    if (!level->d.shared)
+        return;
+
+    char *old_name = level->d.filename;
+    FILE *old_ptr = level->d.file_ptr;
+    fflush(old_ptr);
+
+    level->d.version++;
+    level->d.filename = (char *) lsm_malloc(PATHLEN);
+    level_filename(tree, levelno, level->d.filename, PATHLEN);
+    level->d.file_ptr = fopen(level->d.filename, "wb+");
+    level_clone(level->d.file_ptr, old_ptr,
+        level->used*sizeof(struct kv_pair),
+        level->size*sizeof(struct kv_pair));
+    level->d.shared = 0;
+
+    fclose(old_ptr);
+    remove(old_name);
+    free(old_name);
+}
+
+/*
+ * copy the first bytes of a file, cloning the extents if the file system
+ * can, and give the copy the same length. The rest of a level file is
+ * blank pairs, which are all zero bytes
+ */
+static int level_clone(FILE *dst, FILE *src, size_t bytes, size_t length) {
+#ifdef FICLONE
+    if (ioctl(fileno(dst), FICLONE, fileno(src)) == 0)
+        return 0;
+#endif
+    char buf[BLOCK_SIZE];
+    fseek(src, 0, SEEK_SET);
+    fseek(dst, 0, SEEK_SET);
+    while (bytes > 0) {
+        size_t n = bytes < BLOCK_SIZE ? bytes : BLOCK_SIZE;
+        if (fread(buf, 1, n, src) != n || fwrite(buf, 1, n, dst) != n)
+            return -1;
+        bytes -= n;
+    }
+    fflush(dst);
+    return ftruncate(fileno(dst), length);
+}
+
+
+/*** CHECKPOINTS ***/
+
+/*
+ * checkpoint:
+ * Write a consistent copy of the tree to dir, which must already exist on
+ * the same file system. Disk levels are hard-linked, the main levels are
+ * written out, and a manifest lists each level's file, used and size along
+ * with its range tombstones. Returns 0 on success
+ */
+int checkpoint(struct lsm_tree *tree, const char *dir) {
+    char path[2*PATHLEN];
+
+    snprintf(path, sizeof(path), "%s/%s.manifest", dir,
+        base_name(tree->name));
+    FILE *manifest = fopen(path, "w");
+    if (!manifest)
+        return -1;
+    fprintf(manifest, "%s %d %d\n", base_name(tree->name), tree->nlevels,
+        tree->nlevels_main);
+
+    for (int i = 0; i < tree->nlevels; i++) {
+        struct level *level = tree->levels + i;
+        char file[PATHLEN];
+        pthread_mutex_lock(&level->mutex);
+
+        if (level->type == DISK_LEVEL) {
+            fflush(level->d.file_ptr);
+            snprintf(file, PATHLEN, "%s", base_name(level->d.filename));
+            snprintf(path, sizeof(path), "%s/%s", dir, file);
+            if (link(level->d.filename, path)) {
+                pthread_mutex_unlock(&level->mutex);
+                fclose(manifest);
+                return -1;
+            }
+            level->d.shared = 1;
+        } else {
+            /* main levels are small, so just write out their pairs */
+            snprintf(file, PATHLEN, "%s.level%d.bin",
+                base_name(tree->name), i);
+            snprintf(path, sizeof(path), "%s/%s", dir, file);
+            FILE *fptr = fopen(path, "wb");
+            struct kv_pair kv;
+            for (size_t j = 0; j < level->used; j++) {
+                read_pair(level, j, &kv);
+                fwrite(&kv, sizeof(struct kv_pair), 1, fptr);
+            }
+            fclose(fptr);
+        }
+
+        fprintf(manifest, "level %d %s %zu %zu\n", i, file, level->used,
+            level->size);
+        for (size_t t = 0; t < level->rtombs.num; t++)
+            fprintf(manifest, "tombstone %d %d %d\n", i,
+                level->rtombs.arr[t].bottom, level->rtombs.arr[t].top);
+        pthread_mutex_unlock(&level->mutex);
+    }
+
+    fclose(manifest);
+    return 0;
+}
+
+static const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+
+/*** SNAPSHOTS ***/
+
+/*
+ * snapshot_create:
+ * Pin the current contents of the tree. Gets and ranges on the snapshot
+ * see exactly these contents, however the tree changes afterwards
+ */
+struct snapshot *snapshot_create(struct lsm_tree *tree) {
+    struct snapshot *snap =
+        (struct snapshot *) lsm_malloc(sizeof(struct snapshot));
+    snap->nlevels = tree->nlevels;
+    snap->levels =
+        (struct level *) lsm_calloc(tree->nlevels, sizeof(struct level));
+
+    for (int i = 0; i < tree->nlevels; i++) {
+        struct level *level = tree->levels + i;
+        struct level *copy = snap->levels + i;
+        pthread_mutex_lock(&level->mutex);
+
+        copy->type = level->type;
+        copy->size = level->size;
+        copy->used = level->used;
+        copy->bloom = NULL;
+        copy->filter = NULL;
+        copy->index = NULL;
+        copy->rfilter = NULL;
+        copy->summary = NULL;
+        rtomb_init(&copy->rtombs);
+        rtomb_merge(&copy->rtombs, &level->rtombs);
+        pthread_mutex_init(&copy->mutex, NULL);
+
+        if (level->type == DISK_LEVEL) {
+            /* a second handle on the same file version */
+            fflush(level->d.file_ptr);
+            copy->d.filename = NULL;
+            copy->d.file_ptr = fopen(level->d.filename, "rb");
+            copy->d.readahead = level->d.readahead;
+            level->d.shared = 1;
+        } else {
+            snapshot_main_level(copy, level);
+        }
+        pthread_mutex_unlock(&level->mutex);
+    }
+    return snap;
+}
+
+/* main levels are copied, since they are small and change on every put */
+static void snapshot_main_level(struct level *copy, struct level *level) {
+    struct kv_pair kv;
+    copy->m.ht = NULL;
+#ifdef _USE_BTREE
+    copy->m.bt = b_tree_init();
+    for (size_t j = 0; j < level->used; j++) {
+        read_pair(level, j, &kv);
+        b_tree_insert(copy->m.bt, &kv);
+    }
+#else
+    copy->m.arr =
+        (struct kv_pair *) lsm_calloc(level->size, sizeof(struct kv_pair));
+    for (size_t j = 0; j < level->used; j++) {
+        read_pair(level, j, &kv);
+        copy->m.arr[j] = kv;
+    }
+#endif
+}
+
+void snapshot_release(struct snapshot *snap) {
+    for (int i = 0; i < snap->nlevels; i++) {
+        struct level *level = snap->levels + i;
+        if (level->type == DISK_LEVEL) {
+            fclose(level->d.file_ptr);
+        } else {
+#ifdef _USE_BTREE
+            b_tree_destroy(level->m.bt);
+#else
+            free(level->m.arr);
+#endif
+        }
+        rtomb_destroy(&level->rtombs);
+        pthread_mutex_destroy(&level->mutex);
+    }
+    free(snap->levels);
+    free(snap);
+}
+
+/*
+ * look a key up in a snapshot. Returns GET_SUCCESS and sets val if the key
+ * was present when the snapshot was taken, and GET_FAIL otherwise
+ */
+int snapshot_get(struct snapshot *snap, key_t key, val_t *val) {
+    struct kv_pair kv;
+    int r = levels_get(snap->levels, snap->nlevels, key, &kv);
+    if (r == GET_SUCCESS)
+        *val = kv.val;
+    return r;
+}
+
+/* copy the pairs in [bottom, top) as of the snapshot into buf, like range() */
+size_t snapshot_range(struct snapshot *snap, key_t bottom, key_t top,
+        struct kv_pair *buf, size_t cap) {
+    struct range_buf rb;
+    rb.buf = buf;
+    rb.cap = cap;
+    rb.num = 0;
+    levels_range_each(snap->levels, snap->nlevels, bottom, top,
+        range_buf_add, &rb);
+    return rb.num;
+}
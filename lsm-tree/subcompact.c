@@ -0,0 +1,323 @@
+/*
+ * This file contains parallel subcompactions for large disk-to-disk merges.
+ *
+ * When a flush cascades, migrate() merges each level into the next one on
+ * a single thread. Before it runs, compact() hands the cascade to
+ * subcompact(), which carries out the merges of its large levels deepest
+ * first. Each merge empties its upper level, so migrate() then finds room
+ * there and stops above it.
+ *
+ * A merge is split into key ranges at keys sampled evenly from the bigger
+ * of the two levels, and each range is merged by its own thread into its
+ * own output file. Once all of them are done their lengths are known, and
+ * the threads copy their files into place in a new version of the lower
+ * level's file, which then replaces the old version as one sorted run. The
+ * upper level is emptied by truncating its file, since a blank pair is all
+ * zero bytes. The threads stream through buffers from the tree's pool, and
+ * with set_direct_io() on they do all of this bypassing the page cache,
+ * except for writing the new file, which gets and ranges read next.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include "lsm_tree.h"
+
+/* pairs read or written at a time by each thread */
+#define SUBCOMPACT_BUF DIRECT_PAIRS
+
+/* one key range of a merge */
+struct subcompaction {
+    int src_fd;
+    int dst_fd;
+    size_t src_from, src_to;
+    size_t dst_from, dst_to;
+    int last;
+    struct io_pool *pool;
+    int direct;
+
+    /* output file, its length in pairs, and where it goes in the level */
+    int out_fd;
+    size_t out;
+    size_t offset;
+    int merged_fd;
+};
+
+static int subcompact_threads(struct lsm_tree *tree);
+static void subcompact_level(struct lsm_tree *tree, int levelno);
+static void *subcompact_merge(void *arg);
+static void *subcompact_copy(void *arg);
+static size_t subcompact_read(int fd, size_t pos, size_t to, void *buf,
+    struct kv_pair **pairs);
+
+
+/*** SCHEDULING ***/
+
+/*
+ * set_subcompactions:
+ * Use up to threads threads for each large disk-to-disk merge. 1 leaves all
+ * merges to migrate(), and 0, the default, uses one thread per core
+ */
+void set_subcompactions(struct lsm_tree *tree, int threads) {
+    assert(threads >= 0);
+    tree->subcompactions = threads;
+}
+
+/*
+ * carry out the large disk-to-disk merges of a cascade that flushing the
+ * main level is about to start, down to level deepest, deepest first
+ */
+void subcompact(struct lsm_tree *tree, int deepest) {
+    if (subcompact_threads(tree) < 2 && !tree->direct_io)
+        return;
+
+    /* a last level that cannot take the one above it is for migrate() */
+    struct level *last = tree->levels + deepest;
+    if ((last-1)->used + last->used > last->size)
+        return;
+
+    for (; deepest-1 >= tree->nlevels_main; deepest--) {
+        struct level *src = tree->levels + deepest-1;
+        if (src->used + (src+1)->used < 2*SUBCOMPACT_MIN_PAIRS)
+            break;
+        subcompact_level(tree, deepest-1);
+    }
+}
+
+static int subcompact_threads(struct lsm_tree *tree) {
+    int n = tree->subcompactions;
+    if (n == 0)
+        n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    return n < SUBCOMPACT_MAX_THREADS ? n : SUBCOMPACT_MAX_THREADS;
+}
+
+
+/*** MERGING ***/
+
+/* merge a disk level into the next one, on parallel threads */
+static void subcompact_level(struct lsm_tree *tree, int levelno) {
+    struct level *src = tree->levels + levelno;
+    struct level *dst = src + 1;
+    assert(src->type == DISK_LEVEL && dst->type == DISK_LEVEL);
+    assert(src->used + dst->used <= dst->size);
+
+    int n = (int) ((src->used + dst->used) / SUBCOMPACT_MIN_PAIRS);
+    if (n > subcompact_threads(tree))
+        n = subcompact_threads(tree);
+
+    /* split at keys sampled from the bigger level */
+    struct level *big = src->used > dst->used ? src : dst;
+    key_t *bounds = (key_t *) lsm_malloc((n+1)*sizeof(key_t));
+    for (int p = 1; p < n; p++) {
+        struct kv_pair kv;
+        read_pair(big, big->used*p / n, &kv);
+        bounds[p] = kv.key;
+    }
+
+    fflush(src->d.file_ptr);
+    fflush(dst->d.file_ptr);
+    struct subcompaction *subs = (struct subcompaction *)
+        lsm_malloc(n*sizeof(struct subcompaction));
+    int src_fd = fileno(src->d.file_ptr);
+    int dst_fd = fileno(dst->d.file_ptr);
+    if (tree->direct_io) {
+        src_fd = direct_open(src->d.filename, O_RDONLY);
+        dst_fd = direct_open(dst->d.filename, O_RDONLY);
+    }
+    for (int p = 0; p < n; p++) {
+        struct subcompaction *s = subs + p;
+        s->src_fd = src_fd;
+        s->dst_fd = dst_fd;
+        s->src_from = p == 0 ? 0 : level_find(src, bounds[p]);
+        s->src_to = p == n-1 ? src->used : level_find(src, bounds[p+1]);
+        s->dst_from = p == 0 ? 0 : level_find(dst, bounds[p]);
+        s->dst_to = p == n-1 ? dst->used : level_find(dst, bounds[p+1]);
+        s->last = levelno+1 == tree->nlevels-1;
+        s->pool = tree->io_pool;
+        s->direct = tree->direct_io;
+        s->out = 0;
+    }
+
+    /* the new version of the lower level's file */
+    char *old_name = dst->d.filename;
+    FILE *old_ptr = dst->d.file_ptr;
+    dst->d.version++;
+    dst->d.filename = (char *) lsm_malloc(PATHLEN);
+    level_filename(tree, levelno+1, dst->d.filename, PATHLEN);
+    FILE *merged = fopen(dst->d.filename, "wb+");
+
+    /* merge each range into a file of its own, unlinked right away */
+    pthread_t *tids = (pthread_t *) lsm_malloc(n*sizeof(pthread_t));
+    for (int p = 0; p < n; p++) {
+        char path[PATHLEN + 16];
+        snprintf(path, sizeof(path), "%s.%d", dst->d.filename, p);
+        subs[p].out_fd = tree->direct_io
+            ? direct_open(path, O_RDWR | O_CREAT | O_TRUNC)
+            : open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        unlink(path);
+        pthread_create(tids + p, NULL, subcompact_merge, subs + p);
+    }
+    for (int p = 0; p < n; p++)
+        pthread_join(tids[p], NULL);
+    if (tree->direct_io) {
+        close(src_fd);
+        close(dst_fd);
+    }
+
+    /* and copy them into place */
+    size_t used = 0;
+    for (int p = 0; p < n; p++) {
+        subs[p].offset = used;
+        subs[p].merged_fd = fileno(merged);
+        used += subs[p].out;
+        pthread_create(tids + p, NULL, subcompact_copy, subs + p);
+    }
+    for (int p = 0; p < n; p++) {
+        pthread_join(tids[p], NULL);
+        close(subs[p].out_fd);
+    }
+    if (ftruncate(fileno(merged), dst->size*sizeof(struct kv_pair)))
+        perror(dst->d.filename);
+
+    dst->d.file_ptr = merged;
+    dst->used = used;
+    fclose(old_ptr);
+    remove(old_name);
+    free(old_name);
+
+    if (ftruncate(fileno(src->d.file_ptr), 0) || ftruncate(
+            fileno(src->d.file_ptr), src->size*sizeof(struct kv_pair)))
+        perror(src->d.filename);
+    src->used = 0;
+
+    /*
+     * compact() rebuilds both levels' indexes once the cascade is over, but
+     * the next merge up searches this one before then
+     */
+    index_destroy(src->index);
+    index_destroy(dst->index);
+    src->index = NULL;
+    dst->index = NULL;
+
+    free(tids);
+    free(subs);
+    free(bounds);
+}
+
+/* merge one key range, keeping the upper level's pair for equal keys */
+static void *subcompact_merge(void *arg) {
+    struct subcompaction *s = (struct subcompaction *) arg;
+    void *abuf = io_pool_get(s->pool);
+    void *bbuf = io_pool_get(s->pool);
+    struct kv_pair *out = (struct kv_pair *) io_pool_get(s->pool);
+    struct kv_pair *a = NULL;
+    struct kv_pair *b = NULL;
+    size_t i = s->src_from, na = 0, ia = 0;
+    size_t j = s->dst_from, nb = 0, ib = 0;
+    size_t nout = 0;
+
+    while (1) {
+        if (ia == na && i < s->src_to) {
+            na = subcompact_read(s->src_fd, i, s->src_to, abuf, &a);
+            i += na;
+            ia = 0;
+        }
+        if (ib == nb && j < s->dst_to) {
+            nb = subcompact_read(s->dst_fd, j, s->dst_to, bbuf, &b);
+            j += nb;
+            ib = 0;
+        }
+        if (ia == na && ib == nb)
+            break;
+
+        struct kv_pair pick;
+        if (ib == nb || (ia < na && a[ia].key < b[ib].key)) {
+            pick = a[ia++];
+        } else if (ia == na || b[ib].key < a[ia].key) {
+            pick = b[ib++];
+        } else {
+            pick = a[ia++];
+            ib++;
+        }
+
+        /* deletes have nothing left to hide in the last level */
+        if (s->last && pick.op == OP_DEL)
+            continue;
+        out[nout++] = pick;
+        if (nout == SUBCOMPACT_BUF) {
+            direct_write(s->out_fd, out, nout);
+            s->out += nout;
+            nout = 0;
+        }
+    }
+    direct_write(s->out_fd, out, nout);
+    s->out += nout;
+
+    io_pool_put(s->pool, abuf);
+    io_pool_put(s->pool, bbuf);
+    io_pool_put(s->pool, out);
+    return NULL;
+}
+
+static void *subcompact_copy(void *arg) {
+    struct subcompaction *s = (struct subcompaction *) arg;
+    if (s->direct) {
+        /* a run written with O_DIRECT is read back the same way */
+        void *buf = io_pool_get(s->pool);
+        for (size_t pos = 0; pos < s->out; ) {
+            struct kv_pair *pairs;
+            size_t n = subcompact_read(s->out_fd, pos, s->out, buf, &pairs);
+            ssize_t w = pwrite(s->merged_fd, pairs, n*sizeof(struct kv_pair),
+                (s->offset + pos)*sizeof(struct kv_pair));
+            assert(w == (ssize_t) (n*sizeof(struct kv_pair)));
+            (void) w;
+            pos += n;
+        }
+        io_pool_put(s->pool, buf);
+        return NULL;
+    }
+
+    loff_t in = 0;
+    loff_t off = s->offset*sizeof(struct kv_pair);
+    size_t left = s->out*sizeof(struct kv_pair);
+    while (left > 0) {
+        ssize_t n = copy_file_range(s->out_fd, &in, s->merged_fd, &off,
+            left, 0);
+        if (n <= 0)
+            break;
+        left -= n;
+    }
+
+    /* where the file system cannot copy the rest, go through a buffer */
+    if (left > 0) {
+        void *buf = io_pool_get(s->pool);
+        while (left > 0) {
+            size_t n = left < SUBCOMPACT_BUF*sizeof(struct kv_pair) ? left
+                : SUBCOMPACT_BUF*sizeof(struct kv_pair);
+            ssize_t r = pread(s->out_fd, buf, n, in);
+            ssize_t w = pwrite(s->merged_fd, buf, n, off);
+            assert(r == (ssize_t) n && w == (ssize_t) n);
+            (void) r;
+            (void) w;
+            in += n;
+            off += n;
+            left -= n;
+        }
+        io_pool_put(s->pool, buf);
+    }
+    return NULL;
+}
+
+
+/*** HELPERS ***/
+
+/*
+ * read up to SUBCOMPACT_BUF pairs from pos, stopping at to, into a stream
+ * buffer, and point pairs at them
+ */
+static size_t subcompact_read(int fd, size_t pos, size_t to, void *buf,
+        struct kv_pair **pairs) {
+    size_t n = to - pos < SUBCOMPACT_BUF ? to - pos : SUBCOMPACT_BUF;
+    *pairs = direct_read(fd, pos, n, buf);
+    return n;
+}
@@ -0,0 +1,193 @@
+/*
+ * This file contains the write controller and the compaction rate limiter.
+ *
+ * The write controller looks at compaction debt, the fill of the fullest
+ * disk level above the last one, before every put or delete. The last
+ * level never drains, so how full it is says nothing about merges to
+ * come. Below stall_soft writes go at full speed; above it each write is
+ * delayed, linearly more up to stall_max_us at stall_hard, so writers slow
+ * down smoothly instead of running into a long merge at full speed.
+ *
+ * The rate limiter is a token bucket holding up to one second of
+ * compaction_rate bytes. Compaction charges it for the bytes it moved and
+ * waits out any deficit, which bounds the average compaction bandwidth.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include <time.h>
+#include "lsm_tree.h"
+
+struct throttle {
+    /* write controller */
+    double stall_soft;
+    double stall_hard;
+    unsigned stall_max_us;
+
+    /* compaction token bucket, in bytes (rate 0 is unlimited) */
+    size_t rate;
+    double tokens;
+    struct timespec last;
+    pthread_mutex_t mutex;
+
+    /* stats */
+    long writes_delayed;
+    long write_delay_us;
+    long compaction_bytes;
+    long compaction_wait_us;
+};
+
+static double throttle_debt(struct lsm_tree *tree);
+static void throttle_sleep(long us);
+static double throttle_elapsed(struct timespec *from, struct timespec *to);
+
+
+/*** INITIALIZATION/CLEANUP ***/
+
+/* a throttle that never delays anything */
+struct throttle *throttle_init(void) {
+    struct throttle *t =
+        (struct throttle *) lsm_malloc(sizeof(struct throttle));
+    t->stall_soft = 1;
+    t->stall_hard = 1;
+    t->stall_max_us = 0;
+    t->rate = 0;
+    t->tokens = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t->last);
+    pthread_mutex_init(&t->mutex, NULL);
+
+    t->writes_delayed = 0;
+    t->write_delay_us = 0;
+    t->compaction_bytes = 0;
+    t->compaction_wait_us = 0;
+    return t;
+}
+
+void throttle_destroy(struct throttle *t) {
+    pthread_mutex_destroy(&t->mutex);
+    free(t);
+}
+
+/*
+ * set_throttle:
+ * Delay writes once the fullest disk level other than the last is more
+ * than soft full, by up to max_delay_us per write at hard, and limit
+ * compaction to rate bytes per second (0 for unlimited)
+ */
+void set_throttle(struct lsm_tree *tree, double soft, double hard,
+        unsigned max_delay_us, size_t rate) {
+    assert(soft >= 0 && hard >= soft);
+    struct throttle *t = tree->throttle;
+
+    pthread_mutex_lock(&t->mutex);
+    t->stall_soft = soft;
+    t->stall_hard = hard;
+    t->stall_max_us = max_delay_us;
+    t->rate = rate;
+    t->tokens = rate;
+    clock_gettime(CLOCK_MONOTONIC, &t->last);
+    pthread_mutex_unlock(&t->mutex);
+}
+
+
+/*** THROTTLING ***/
+
+/*
+ * called before each write: delay it according to the current compaction
+ * debt
+ */
+void throttle_write(struct lsm_tree *tree) {
+    struct throttle *t = tree->throttle;
+    if (t->stall_max_us == 0)
+        return;
+
+    double debt = throttle_debt(tree);
+    if (debt <= t->stall_soft)
+        return;
+
+    long us = t->stall_max_us;
+    if (debt < t->stall_hard)
+        us = (long) (t->stall_max_us * (debt - t->stall_soft)
+            / (t->stall_hard - t->stall_soft));
+    if (us == 0)
+        return;
+
+    throttle_sleep(us);
+    pthread_mutex_lock(&t->mutex);
+    t->writes_delayed++;
+    t->write_delay_us += us;
+    pthread_mutex_unlock(&t->mutex);
+}
+
+/*
+ * called by compaction after moving bytes bytes: take them from the bucket
+ * and wait until it is no longer in deficit
+ */
+void throttle_compaction(struct lsm_tree *tree, size_t bytes) {
+    struct throttle *t = tree->throttle;
+    struct timespec now;
+
+    pthread_mutex_lock(&t->mutex);
+    t->compaction_bytes += bytes;
+    if (t->rate == 0) {
+        pthread_mutex_unlock(&t->mutex);
+        return;
+    }
+
+    /* refill, holding at most one second's worth */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    t->tokens += throttle_elapsed(&t->last, &now) * t->rate;
+    if (t->tokens > t->rate)
+        t->tokens = t->rate;
+    t->last = now;
+
+    t->tokens -= bytes;
+    long us = t->tokens < 0 ? (long) (-t->tokens * 1e6 / t->rate) : 0;
+    t->compaction_wait_us += us;
+    pthread_mutex_unlock(&t->mutex);
+
+    if (us > 0)
+        throttle_sleep(us);
+}
+
+/*
+ * compaction debt: the fill of the fullest disk level that still merges
+ * into a level below it
+ */
+static double throttle_debt(struct lsm_tree *tree) {
+    double debt = 0;
+    for (int i = tree->nlevels_main; i < tree->nlevels-1; i++) {
+        struct level *level = tree->levels + i;
+        double fill = (double) level->used / level->size;
+        if (fill > debt)
+            debt = fill;
+    }
+    return debt;
+}
+
+static void throttle_sleep(long us) {
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
+static double throttle_elapsed(struct timespec *from, struct timespec *to) {
+    return (double) (to->tv_sec - from->tv_sec)
+        + (double) (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+
+/*** STATS ***/
+
+void throttle_stat(struct lsm_tree *tree) {
+    struct throttle *t = tree->throttle;
+    if (t->stall_max_us == 0 && t->rate == 0)
+        return;
+
+    pthread_mutex_lock(&t->mutex);
+    printf("Write stalls: %ld writes delayed, %ld us total, debt %.2f\n",
+        t->writes_delayed, t->write_delay_us, throttle_debt(tree));
+    printf("Compaction: %ld bytes, %ld us throttled at %zu bytes/s\n",
+        t->compaction_bytes, t->compaction_wait_us, t->rate);
+    pthread_mutex_unlock(&t->mutex);
+}
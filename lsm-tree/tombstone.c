@@ -0,0 +1,106 @@
+/*
+ * This file contains the range tombstones written by range_delete(). Each
+ * level keeps its tombstones as a sorted set of disjoint intervals
+ * [bottom, top), and the tombstones of a level only ever hide pairs in
+ * deeper levels: range_delete() drops the covered pairs of the main level
+ * right away, and compaction drops the covered pairs of the next level
+ * before pushing the tombstones down into it.
+ */
+
+#include "lsm_tree.h"
+
+static size_t rtomb_find(struct rtomb_set *set, key_t key);
+
+void rtomb_init(struct rtomb_set *set) {
+    set->num = 0;
+    set->cap = 0;
+    set->arr = NULL;
+}
+
+void rtomb_destroy(struct rtomb_set *set) {
+    free(set->arr);
+    rtomb_init(set);
+}
+
+void rtomb_clear(struct rtomb_set *set) {
+    set->num = 0;
+}
+
+/*
+ * add the interval [bottom, top) to the set, coalescing it with any
+ * intervals it overlaps or touches
+ */
+void rtomb_add(struct rtomb_set *set, key_t bottom, key_t top) {
+    if (top <= bottom)
+        return;
+
+    /* the first interval that ends at or after bottom */
+    size_t first = rtomb_find(set, bottom);
+    if (first > 0 && set->arr[first-1].top >= bottom)
+        first--;
+
+    /* and the intervals from there on that start at or before top */
+    size_t last = first;
+    while (last < set->num && set->arr[last].bottom <= top) {
+        if (set->arr[last].bottom < bottom)
+            bottom = set->arr[last].bottom;
+        if (set->arr[last].top > top)
+            top = set->arr[last].top;
+        last++;
+    }
+
+    if (first == last) {
+        if (set->num == set->cap) {
+            set->cap = set->cap ? 2*set->cap : 4;
+            set->arr = (struct range_tombstone *) lsm_realloc(set->arr,
+                set->cap*sizeof(struct range_tombstone));
+        }
+        memmove(set->arr+first+1, set->arr+first,
+            (set->num-first)*sizeof(struct range_tombstone));
+        set->num++;
+    } else {
+        memmove(set->arr+first+1, set->arr+last,
+            (set->num-last)*sizeof(struct range_tombstone));
+        set->num -= last - first - 1;
+    }
+    set->arr[first].bottom = bottom;
+    set->arr[first].top = top;
+}
+
+/* add every interval of src to dst */
+void rtomb_merge(struct rtomb_set *dst, struct rtomb_set *src) {
+    for (size_t i = 0; i < src->num; i++)
+        rtomb_add(dst, src->arr[i].bottom, src->arr[i].top);
+}
+
+/* check whether key falls in one of the intervals of the set */
+int rtomb_covers(struct rtomb_set *set, key_t key) {
+    size_t pos = rtomb_find(set, key);
+    if (pos > 0 && set->arr[pos-1].top > key)
+        return 1;
+    return pos < set->num && set->arr[pos].bottom == key;
+}
+
+/* check whether an interval of the set meets the closed interval [lo, hi] */
+int rtomb_overlaps(struct rtomb_set *set, key_t lo, key_t hi) {
+    size_t pos = rtomb_find(set, hi);
+    if (pos < set->num && set->arr[pos].bottom == hi)
+        return 1;
+    return pos > 0 && set->arr[pos-1].top > lo;
+}
+
+/* position of the first interval starting at or after key */
+static size_t rtomb_find(struct rtomb_set *set, key_t key) {
+    size_t bottom = 0;
+    size_t top = set->num;
+    size_t middle;
+
+    while (top > bottom) {
+        middle = (top + bottom)/2;
+        if (set->arr[middle].bottom < key)
+            bottom = middle+1;
+        else
+            top = middle;
+    }
+    return bottom;
+}
@@ -0,0 +1,361 @@
+/*
+ * This file contains operation tracing, for finding out afterwards what the
+ * tree was doing when it slowed down.
+ *
+ * While a trace is on, every operation on the tree is recorded as a fixed
+ * size struct trace_event: when it started, how long it took and what its
+ * arguments were. Each thread records into a ring of its own, so an event
+ * costs two clock reads and a few stores, and no lock. A writer thread
+ * drains the rings into the trace file every TRACE_FLUSH_MS milliseconds,
+ * or sooner once a ring is half full. An event that finds its ring full is
+ * dropped and counted rather than making the operation wait. Write batches
+ * are the exception: one may not fit in a ring at all, so it is recorded
+ * in pieces, and a piece that finds no room drains the rings itself.
+ *
+ * Flushes of the main level are recorded too. They run on whichever thread
+ * filled the level and are rare, so they share one ring under the trace's
+ * lock.
+ *
+ * The file is a struct trace_header followed by the events in the order
+ * they were drained, which is time order within each thread but not across
+ * threads. The replay tool reruns a trace against a tree.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include <time.h>
+#include "lsm_tree.h"
+
+/* the events of one thread, from tail up to head */
+struct trace_ring {
+    struct trace_event events[TRACE_RING];
+
+    /* head is only written by the thread, and tail by the writer */
+    size_t head;
+    size_t tail;
+    uint16_t id;
+    int dead;
+    long dropped;
+};
+
+struct trace {
+    FILE *file;
+    struct timespec start;
+    pthread_key_t key;
+
+    /* guards the ring list, the shared ring and the file */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t writer;
+    int stop;
+
+    struct trace_ring **rings;
+    size_t nrings;
+    size_t cap;
+    uint16_t next_id;
+
+    /* where flushes are recorded */
+    struct trace_ring *shared;
+
+    /* stats */
+    long written;
+    long dropped;
+};
+
+static struct trace_ring *trace_ring_new(struct trace *t);
+static struct trace_ring *trace_ring(struct trace *t);
+static void trace_ring_release(void *ring);
+static int trace_room(struct trace_ring *r, size_t n);
+static void trace_make_room(struct trace *t, struct trace_ring *r, size_t n);
+static struct trace_event *trace_slot(struct trace_ring *r, size_t i);
+static void trace_commit(struct trace *t, struct trace_ring *r, size_t n);
+static void *trace_writer(void *arg);
+static void trace_drain(struct trace *t);
+
+
+/*** INITIALIZATION/CLEANUP ***/
+
+/*
+ * set_trace:
+ * Record every operation on the tree to filename, replacing any trace
+ * being recorded. NULL stops tracing. Returns 0, or -1 if the file cannot
+ * be created. Not safe while other operations are running
+ */
+int set_trace(struct lsm_tree *tree, const char *filename) {
+    trace_destroy(tree->trace);
+    tree->trace = filename ? trace_init(filename) : NULL;
+    return filename && !tree->trace ? -1 : 0;
+}
+
+struct trace *trace_init(const char *filename) {
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+        return NULL;
+
+    struct trace_header h;
+    h.magic = TRACE_MAGIC;
+    h.version = TRACE_VERSION;
+    fwrite(&h, sizeof(h), 1, file);
+
+    struct trace *t = (struct trace *) lsm_malloc(sizeof(struct trace));
+    t->file = file;
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+    pthread_key_create(&t->key, trace_ring_release);
+    pthread_mutex_init(&t->mutex, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    t->stop = 0;
+    t->rings = NULL;
+    t->nrings = 0;
+    t->cap = 0;
+    t->next_id = 0;
+    t->written = 0;
+    t->dropped = 0;
+    t->shared = trace_ring_new(t);
+
+    pthread_create(&t->writer, NULL, trace_writer, t);
+    return t;
+}
+
+/* stop tracing, writing out whatever the rings still hold */
+void trace_destroy(struct trace *t) {
+    if (!t)
+        return;
+
+    pthread_mutex_lock(&t->mutex);
+    t->stop = 1;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->mutex);
+    pthread_join(t->writer, NULL);
+
+    pthread_key_delete(t->key);
+    for (size_t i = 0; i < t->nrings; i++)
+        free(t->rings[i]);
+    free(t->rings);
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->mutex);
+    fclose(t->file);
+    free(t);
+}
+
+static struct trace_ring *trace_ring_new(struct trace *t) {
+    struct trace_ring *r =
+        (struct trace_ring *) lsm_malloc(sizeof(struct trace_ring));
+    r->head = 0;
+    r->tail = 0;
+    r->dead = 0;
+    r->dropped = 0;
+
+    pthread_mutex_lock(&t->mutex);
+    if (t->nrings == t->cap) {
+        t->cap = t->cap ? 2*t->cap : 16;
+        t->rings = (struct trace_ring **) lsm_realloc(t->rings,
+            t->cap*sizeof(struct trace_ring *));
+    }
+    r->id = t->next_id++;
+    t->rings[t->nrings++] = r;
+    pthread_mutex_unlock(&t->mutex);
+    return r;
+}
+
+/* the ring of the calling thread, created on first use */
+static struct trace_ring *trace_ring(struct trace *t) {
+    struct trace_ring *r = (struct trace_ring *) pthread_getspecific(t->key);
+    if (!r) {
+        r = trace_ring_new(t);
+        pthread_setspecific(t->key, r);
+    }
+    return r;
+}
+
+/* a thread has exited, so the writer frees its ring once it is drained */
+static void trace_ring_release(void *ring) {
+    __sync_synchronize();
+    ((struct trace_ring *) ring)->dead = 1;
+}
+
+
+/*** RECORDING ***/
+
+/* ns since tracing started, or 0 if there is no trace */
+uint64_t trace_now(struct trace *t) {
+    if (!t)
+        return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) (now.tv_sec - t->start.tv_sec) * 1000000000
+        + now.tv_nsec - t->start.tv_nsec;
+}
+
+/* record an operation that started at start (from trace_now) */
+void trace_op(struct trace *t, int type, key_t key, int32_t arg,
+        uint64_t start) {
+    if (!t)
+        return;
+    struct trace_ring *r = trace_ring(t);
+    if (!trace_room(r, 1))
+        return;
+
+    struct trace_event *ev = trace_slot(r, 0);
+    ev->time = start;
+    ev->latency = (uint32_t) (trace_now(t) - start);
+    ev->type = type;
+    ev->thread = r->id;
+    ev->key = key;
+    ev->arg = arg;
+    trace_commit(t, r, 1);
+}
+
+/*
+ * record a write batch and its pairs, in pieces of up to TRACE_BATCH_MAX
+ * pairs that split its time between them
+ */
+void trace_batch(struct trace *t, struct kv_pair *kvs, size_t num,
+        uint64_t start) {
+    if (!t)
+        return;
+    struct trace_ring *r = trace_ring(t);
+    uint64_t latency = trace_now(t) - start;
+
+    size_t done = 0;
+    do {
+        size_t n = num - done < TRACE_BATCH_MAX ? num - done
+            : TRACE_BATCH_MAX;
+        trace_make_room(t, r, n+1);
+
+        struct trace_event *ev = trace_slot(r, 0);
+        ev->time = num ? start + latency*done/num : start;
+        ev->latency = (uint32_t) (num ? latency*n/num : latency);
+        ev->type = TRACE_BATCH;
+        ev->thread = r->id;
+        ev->key = 0;
+        ev->arg = (int32_t) n;
+        for (size_t i = 0; i < n; i++) {
+            struct kv_pair *kv = kvs + done + i;
+            ev = trace_slot(r, i+1);
+            ev->time = start;
+            ev->latency = 0;
+            ev->type = kv->op == OP_DEL ? TRACE_DELETE : TRACE_PUT;
+            ev->thread = r->id;
+            ev->key = kv->key;
+            ev->arg = kv->val;
+        }
+        trace_commit(t, r, n+1);
+        done += n;
+    } while (done < num);
+}
+
+/* record a flush of pairs from the main level down to level */
+void trace_compaction(struct trace *t, int type, int level, int32_t pairs,
+        uint64_t start) {
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->mutex);
+    if (trace_room(t->shared, 1)) {
+        struct trace_event *ev = trace_slot(t->shared, 0);
+        ev->time = start;
+        ev->latency = (uint32_t) (trace_now(t) - start);
+        ev->type = type;
+        ev->thread = t->shared->id;
+        ev->key = level;
+        ev->arg = pairs;
+        trace_commit(t, t->shared, 1);
+    }
+    pthread_mutex_unlock(&t->mutex);
+}
+
+/* whether n more events fit in the ring, counting them as dropped if not */
+static int trace_room(struct trace_ring *r, size_t n) {
+    size_t tail = __sync_fetch_and_add(&r->tail, 0);
+    if (r->head - tail + n <= TRACE_RING)
+        return 1;
+    __sync_fetch_and_add(&r->dropped, n);
+    return 0;
+}
+
+/*
+ * make sure n more events fit in the ring, draining the rings on this
+ * thread if they do not
+ */
+static void trace_make_room(struct trace *t, struct trace_ring *r, size_t n) {
+    assert(n <= TRACE_RING);
+    size_t tail = __sync_fetch_and_add(&r->tail, 0);
+    if (r->head - tail + n <= TRACE_RING)
+        return;
+    pthread_mutex_lock(&t->mutex);
+    trace_drain(t);
+    pthread_mutex_unlock(&t->mutex);
+}
+
+/* the i-th event past the head */
+static struct trace_event *trace_slot(struct trace_ring *r, size_t i) {
+    return r->events + (r->head + i) % TRACE_RING;
+}
+
+/* publish n events written past the head, waking the writer at half full */
+static void trace_commit(struct trace *t, struct trace_ring *r, size_t n) {
+    size_t before = r->head - __sync_fetch_and_add(&r->tail, 0);
+    __sync_synchronize();
+    r->head += n;
+    if (before < TRACE_RING/2 && before + n >= TRACE_RING/2)
+        pthread_cond_signal(&t->cond);
+}
+
+
+/*** WRITING ***/
+
+static void *trace_writer(void *arg) {
+    struct trace *t = (struct trace *) arg;
+
+    pthread_mutex_lock(&t->mutex);
+    while (!t->stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += TRACE_FLUSH_MS*1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000;
+        until.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&t->cond, &t->mutex, &until);
+        trace_drain(t);
+    }
+    trace_drain(t);
+    pthread_mutex_unlock(&t->mutex);
+    return NULL;
+}
+
+/* write out every ring, and free those of exited threads. Holds the lock */
+static void trace_drain(struct trace *t) {
+    for (size_t i = 0; i < t->nrings; i++) {
+        struct trace_ring *r = t->rings[i];
+        int dead = __sync_fetch_and_add(&r->dead, 0);
+        size_t head = __sync_fetch_and_add(&r->head, 0);
+
+        /* the events may wrap around the end of the ring */
+        size_t from = r->tail % TRACE_RING;
+        size_t n = head - r->tail;
+        size_t first = from + n > TRACE_RING ? TRACE_RING - from : n;
+        fwrite(r->events + from, sizeof(struct trace_event), first, t->file);
+        fwrite(r->events, sizeof(struct trace_event), n - first, t->file);
+        t->written += n;
+        t->dropped += __sync_lock_test_and_set(&r->dropped, 0);
+
+        __sync_synchronize();
+        r->tail = head;
+        if (dead) {
+            free(r);
+            t->rings[i--] = t->rings[--t->nrings];
+        }
+    }
+    fflush(t->file);
+}
+
+
+/*** STATS ***/
+
+void trace_stat(struct lsm_tree *tree) {
+    struct trace *t = tree->trace;
+    if (!t)
+        return;
+
+    pthread_mutex_lock(&t->mutex);
+    printf("Trace: %ld events written, %ld dropped, %zu threads\n",
+        t->written, t->dropped, t->nrings - 1);
+    pthread_mutex_unlock(&t->mutex);
+}
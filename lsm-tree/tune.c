@@ -0,0 +1,273 @@
+/*
+ * This file contains the auto-tuner, which shapes the tree to the mix of
+ * operations it actually serves.
+ *
+ * Once set_autotune() turns it on, puts, deletes, gets and range queries
+ * are counted, and every TUNE_INTERVAL flushes compact() lets the tuner
+ * weigh the mix seen since. A cost model for a leveled tree, after Monkey
+ * and Dostoevsky, gives the expected I/Os of each operation under a design
+ * with size ratio T, a buffer of P pairs and b filter bits per key, for N
+ * pairs in blocks of B:
+ *
+ *   write   L*T/B       each pair is merged about T/2 times into each of
+ *                       the L levels it takes to hold N pairs, read and
+ *                       written each time
+ *   get     R + h       R the false positive rates summed over the levels,
+ *                       e^(-b ln(2)^2) * T^(T/(T-1)) / (T-1) with Monkey's
+ *                       split of the bits, and h the share of gets that
+ *                       find their key and read its block
+ *   range   L + s/B     a seek in each level, and the s pairs returned
+ *
+ * The memory budget is split between the buffer and the filters, so a
+ * larger buffer, which needs fewer levels, leaves fewer bits per key. The
+ * tuner tries every size ratio up to TUNE_MAX_RATIO with every tenth of
+ * the budget given to the buffer, and keeps the design whose costs,
+ * weighted by the share of each operation in the mix, are least. The
+ * counts are then halved, so the mix follows the workload as it changes.
+ *
+ * A new design is applied through the compactions that follow: the main
+ * level takes its new size once a flush has emptied it, disk levels grow
+ * at once but shrink only when they hold no more than their new size,
+ * levels are added when the data outgrows the tree, and filters take the
+ * new bits per key as their levels are rewritten. The tree only levels,
+ * so there is no merge policy to choose.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include <math.h>
+#include <unistd.h>
+#include "lsm_tree.h"
+
+struct tuner {
+    /* operations of each TRACE_* type, gets that hit and pairs ranged */
+    long ops[TRACE_TYPES];
+    long get_hits;
+    long range_pairs;
+
+    /* memory to split between buffer and filters, in bytes */
+    size_t budget;
+    int flushes;
+
+    /* the design last chosen */
+    int ratio;
+    size_t buffer;
+    double bits;
+    int levels;
+};
+
+static double tune_cost(struct tuner *t, double n, double buffer,
+    double bits, int ratio, int *levels);
+static void tune_apply(struct lsm_tree *tree);
+static void tune_resize(struct lsm_tree *tree, int levelno, size_t size);
+static void tune_add_level(struct lsm_tree *tree, size_t size);
+static size_t tune_pairs(struct lsm_tree *tree);
+
+
+/*** SETUP ***/
+
+/*
+ * set_autotune:
+ * Let the tree pick its size ratio, number of levels, main level size and
+ * filter bits from the operations it serves, spending up to budget bytes
+ * on the main level and filters together. A budget of 0 is what the tree
+ * as set up would take once full. Grows the tree to at most
+ * TUNE_MAX_LEVELS levels, which init() leaves room for
+ */
+void set_autotune(struct lsm_tree *tree, size_t budget) {
+    assert(tree->nlevels_main == 1 && tree->nlevels >= 2
+        && tree->nlevels <= TUNE_MAX_LEVELS);
+    if (!tree->tuner)
+        tree->tuner = (struct tuner *) lsm_calloc(1, sizeof(struct tuner));
+    struct tuner *t = tree->tuner;
+
+    if (budget == 0) {
+        budget = tree->levels->size*sizeof(struct kv_pair);
+        for (int i = 1; i < tree->nlevels; i++)
+            budget += (size_t) (tree->filter_bits*tree->levels[i].size/8);
+    }
+    t->budget = budget;
+    t->buffer = tree->levels->size;
+    t->bits = tree->filter_bits;
+    t->levels = tree->nlevels - 1;
+    t->ratio = (int) (tree->levels[1].size / tree->levels->size);
+    if (t->ratio < 2)
+        t->ratio = 2;
+}
+
+void tune_destroy(struct tuner *t) {
+    free(t);
+}
+
+/* count an operation of a TRACE_* type, with its pair count or get result */
+void tune_op(struct tuner *t, int type, long n) {
+    if (!t)
+        return;
+    if (type == TRACE_BATCH) {
+        __sync_fetch_and_add(&t->ops[TRACE_PUT], n);
+        return;
+    }
+    __sync_fetch_and_add(&t->ops[type], 1);
+    if (type == TRACE_GET)
+        __sync_fetch_and_add(&t->get_hits, n);
+    else if (type == TRACE_RANGE || type == TRACE_AGGREGATE)
+        __sync_fetch_and_add(&t->range_pairs, n);
+}
+
+void tune_stat(struct lsm_tree *tree) {
+    struct tuner *t = tree->tuner;
+    if (!t)
+        return;
+    printf("Auto-tuning: size ratio %d, %d disk levels, buffer %zu pairs, "
+        "%.1f filter bits per key\n", t->ratio, t->levels, t->buffer,
+        t->bits);
+}
+
+
+/*** TUNING ***/
+
+/*
+ * called by compact() after each flush: every TUNE_INTERVAL flushes choose
+ * a design for the mix seen since, and move the tree towards it
+ */
+void tune_compaction(struct lsm_tree *tree) {
+    struct tuner *t = tree->tuner;
+    if (!t)
+        return;
+
+    /* with nothing counted every design costs the same, so keep this one */
+    long ops = t->ops[TRACE_PUT] + t->ops[TRACE_DELETE] + t->ops[TRACE_GET]
+        + t->ops[TRACE_RANGE] + t->ops[TRACE_AGGREGATE];
+    if (++t->flushes % TUNE_INTERVAL == 0 && ops > 0) {
+        double n = (double) tune_pairs(tree);
+        double best = -1;
+        for (int ratio = 2; ratio <= TUNE_MAX_RATIO; ratio++) {
+            for (int tenth = 1; tenth < 10; tenth++) {
+                double buffer = (double) t->budget*tenth/10
+                    / sizeof(struct kv_pair);
+                if (buffer < TUNE_MIN_BUFFER)
+                    continue;
+                double bits = n > 0 ? (double) t->budget*(10-tenth)/10*8/n
+                    : FILTER_BITS;
+                if (bits > TUNE_MAX_BITS)
+                    bits = TUNE_MAX_BITS;
+                int levels;
+                double cost = tune_cost(t, n, buffer, bits, ratio, &levels);
+                if (best < 0 || cost < best) {
+                    best = cost;
+                    t->ratio = ratio;
+                    t->buffer = (size_t) buffer;
+                    t->bits = bits;
+                    t->levels = levels;
+                }
+            }
+        }
+
+        for (int op = 0; op < TRACE_TYPES; op++)
+            t->ops[op] /= 2;
+        t->get_hits /= 2;
+        t->range_pairs /= 2;
+        tree->filter_bits = t->bits;
+    }
+    tune_apply(tree);
+}
+
+/* expected I/Os per operation of the mix under a design */
+static double tune_cost(struct tuner *t, double n, double buffer,
+        double bits, int ratio, int *levels) {
+    /* levels needed to hold n pairs, with some room to spare */
+    double cap = 0;
+    double level = buffer;
+    *levels = 0;
+    do {
+        level *= ratio;
+        cap += level;
+        (*levels)++;
+    } while (cap < TUNE_HEADROOM*n && *levels < TUNE_MAX_LEVELS-1);
+
+    double writes = t->ops[TRACE_PUT] + t->ops[TRACE_DELETE];
+    double gets = t->ops[TRACE_GET];
+    double ranges = t->ops[TRACE_RANGE] + t->ops[TRACE_AGGREGATE];
+    double total = writes + gets + ranges;
+
+    double write_cost = (double) *levels*ratio/BLOCK_PAIRS;
+    double fpr = exp(-bits*LN2*LN2)*pow(ratio, (double) ratio/(ratio-1))
+        / (ratio-1);
+    if (fpr > *levels)
+        fpr = *levels;
+    double get_cost = fpr + (gets > 0 ? t->get_hits/gets : 0);
+    double range_cost = *levels + (ranges > 0
+        ? t->range_pairs/ranges/BLOCK_PAIRS : 0);
+    return (writes*write_cost + gets*get_cost + ranges*range_cost) / total;
+}
+
+/* move the tree towards the chosen design as far as it can go now */
+static void tune_apply(struct lsm_tree *tree) {
+    struct tuner *t = tree->tuner;
+
+    /* the main level is empty right after a flush */
+    if (tree->levels->used == 0 && tree->levels->size != t->buffer)
+        tune_resize(tree, 0, t->buffer);
+
+    size_t size = tree->levels->size;
+    for (int i = 1; i < tree->nlevels; i++) {
+        size *= t->ratio;
+        struct level *level = tree->levels + i;
+        size_t want = size > level->used ? size : level->used;
+        if (want != level->size)
+            tune_resize(tree, i, want);
+    }
+
+    /* the last level must be able to take all of the one above it */
+    while (tree->nlevels < TUNE_MAX_LEVELS && (tree->nlevels-1 < t->levels
+            || tree->levels[tree->nlevels-1].used
+            + tree->levels[tree->nlevels-2].size
+            > tree->levels[tree->nlevels-1].size)) {
+        size *= t->ratio;
+        tune_add_level(tree, size);
+    }
+}
+
+/*
+ * change the capacity of a level, which must hold no more than size pairs.
+ * A blank pair is all zero bytes, so disk level files just change length
+ */
+static void tune_resize(struct lsm_tree *tree, int levelno, size_t size) {
+    struct level *level = tree->levels + levelno;
+    assert(level->used <= size);
+    if (level->type == MAIN_LEVEL) {
+        if (level->m.ht) {
+            hash_table_destroy(level->m.ht);
+            level->m.ht = hash_table_init(size);
+        }
+#ifndef _USE_BTREE
+        if (level->m.arr) {
+            free(level->m.arr);
+            level->m.arr = (struct kv_pair *) lsm_calloc(size,
+                sizeof(struct kv_pair));
+        }
+#endif
+    } else {
+        level_unshare(tree, levelno);
+        fflush(level->d.file_ptr);
+        if (ftruncate(fileno(level->d.file_ptr), size*sizeof(struct kv_pair)))
+            perror(level->d.filename);
+    }
+    level->size = size;
+}
+
+static void tune_add_level(struct lsm_tree *tree, size_t size) {
+    size_t *sizes = (size_t *) lsm_malloc((tree->nlevels+1)*sizeof(size_t));
+    sizes[tree->nlevels] = size;
+    disk_level_init(tree, sizes, tree->nlevels);
+    free(sizes);
+    tree->nlevels_disk++;
+    tree->nlevels++;
+}
+
+/* pairs in the disk levels */
+static size_t tune_pairs(struct lsm_tree *tree) {
+    size_t n = 0;
+    for (int i = 1; i < tree->nlevels; i++)
+        n += tree->levels[i].used;
+    return n;
+}
@@ -1,19 +1,133 @@
 #include <sys/time.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 #include "hashtable.h"
+#include "chashtable.h"
 
 #define HTNAME "name"
 #define HTSIZE 13
+#define BATCH 1000
+
+// the mixed workload: operations over a set of keys, of which 80% are gets,
+// 10% puts and 10% erases
+#define MIXED_KEYS (1 << 20)
+#define MIXED_OPS 8000000
 
 // This code is designed to stress test your hash table implementation. You do
 // not need to significantly change it, but you may want to vary the value of
 // num_tests to control the amount of time and memory that benchmarking takes
 // up. Compile and run it in the command line by typing:
 // make benchmark; ./benchmark
+//
+// Run it with a number of threads, as in ./benchmark 8, to time the mixed
+// workload on 1 up to that many threads, both on a hashtable behind one
+// global lock and on a chashtable.
+
+struct worker {
+  int nthreads;
+  unsigned int seed;
+  hashtable* ht;
+  pthread_mutex_t* lock;
+  chashtable* cht;
+};
+
+static double elapsed(struct timeval* start, struct timeval* stop) {
+  return (double)(stop->tv_usec - start->tv_usec) / 1000000 + (double)(stop->tv_sec - start->tv_sec);
+}
+
+// xorshift, since rand() is neither per thread nor free of locks
+static unsigned int next(unsigned int* x) {
+  *x ^= *x << 13;
+  *x ^= *x >> 17;
+  *x ^= *x << 5;
+  return *x;
+}
+
+static void* work(void* arg) {
+  struct worker* w = arg;
+  val_t results[1];
+  for (int i = 0; i < MIXED_OPS / w->nthreads; i += 1) {
+    unsigned int r = next(&w->seed);
+    key_t key = r % MIXED_KEYS;
+    int op = (r >> 24) % 10;
+    if (w->cht) {
+      if (op < 8)
+        cget(w->cht, key, results, 1);
+      else if (op == 8)
+        cput(w->cht, key, i);
+      else
+        cerase(w->cht, key);
+    } else {
+      pthread_mutex_lock(w->lock);
+      if (op < 8)
+        get(w->ht, key, results, 1);
+      else if (op == 8)
+        put(w->ht, key, i);
+      else
+        erase(w->ht, key);
+      pthread_mutex_unlock(w->lock);
+    }
+  }
+  return NULL;
+}
+
+// run the mixed workload on nthreads threads, striped or behind one lock
+static double mixed(int nthreads, int striped) {
+  hashtable* ht = NULL;
+  chashtable* cht = NULL;
+  pthread_mutex_t lock;
+  pthread_mutex_init(&lock, NULL);
+  if (striped)
+    cht = cinit(HTNAME, HTSIZE);
+  else
+    ht = init(HTNAME, HTSIZE);
+
+  // start with half the keys in
+  for (int i = 0; i < MIXED_KEYS; i += 2) {
+    if (striped)
+      cput(cht, i, i);
+    else
+      put(ht, i, i);
+  }
+
+  pthread_t threads[nthreads];
+  struct worker workers[nthreads];
+  struct timeval stop, start;
+  gettimeofday(&start, NULL);
+  for (int t = 0; t < nthreads; t += 1) {
+    struct worker w = {nthreads, 2 + t, ht, &lock, cht};
+    workers[t] = w;
+    pthread_create(&threads[t], NULL, work, &workers[t]);
+  }
+  for (int t = 0; t < nthreads; t += 1)
+    pthread_join(threads[t], NULL);
+  gettimeofday(&stop, NULL);
+
+  if (striped)
+    cdestroy(cht);
+  else
+    destroy(ht);
+  pthread_mutex_destroy(&lock);
+  return elapsed(&start, &stop);
+}
+
+static int scaling(int max_threads) {
+  printf("Mixed workload of %d operations, in millions per second.\n", MIXED_OPS);
+  printf("threads  global lock  striped\n");
+  for (int t = 1; t <= max_threads; t += 1) {
+    double global = mixed(t, 0);
+    double striped = mixed(t, 1);
+    printf("%7d  %11.2f  %7.2f\n", t, MIXED_OPS / global / 1000000, MIXED_OPS / striped / 1000000);
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1)
+    return scaling(atoi(argv[1]));
 
-int main(void) {
   hashtable* ht=NULL;
   ht = init(HTNAME, HTSIZE);
 
@@ -25,16 +139,58 @@ int main(void) {
   struct timeval stop, start;
   gettimeofday(&start, NULL);
 
+  // time every BATCH insertions too, since a put that resizes stands out
+  struct timeval before = start, after;
+  double slowest = 0;
   for (int i = 0; i < num_tests; i += 1) {
     int key = rand();
     int val = rand();
     put(ht, key, val);
+    if ((i + 1) % BATCH == 0) {
+      gettimeofday(&after, NULL);
+      double batch = (double)(after.tv_usec - before.tv_usec) / 1000000 + (double)(after.tv_sec - before.tv_sec);
+      if (batch > slowest)
+        slowest = batch;
+      before = after;
+    }
   }
 
-  destroy(ht);
   gettimeofday(&stop, NULL);
   double secs = (double)(stop.tv_usec - start.tv_usec) / 1000000 + (double)(stop.tv_sec - start.tv_sec); 
   printf("50 million insertions took %f seconds\n", secs);
+  printf("The slowest %d insertions took %f seconds\n", BATCH, slowest);
+
+  // look the same keys up again, one at a time and then with get_batch(),
+  // counting those that give back their value
+  key_t keys[BATCH];
+  val_t vals[BATCH];
+  val_t results[BATCH];
+  int counts[BATCH];
+  for (int batched = 0; batched < 2; batched += 1) {
+    srand(seed);
+    int found = 0;
+    gettimeofday(&start, NULL);
+
+    for (int i = 0; i < num_tests; i += BATCH) {
+      for (int j = 0; j < BATCH; j += 1) {
+        keys[j] = rand();
+        vals[j] = rand();
+      }
+      if (batched) {
+        get_batch(ht, keys, BATCH, results, counts);
+      } else {
+        for (int j = 0; j < BATCH; j += 1)
+          get(ht, keys[j], results + j, 1);
+      }
+      for (int j = 0; j < BATCH; j += 1)
+        found += results[j] == vals[j];
+    }
 
+    gettimeofday(&stop, NULL);
+    secs = (double)(stop.tv_usec - start.tv_usec) / 1000000 + (double)(stop.tv_sec - start.tv_sec); 
+    printf("50 million %s took %f seconds, %d found their value\n", batched ? "batched lookups" : "lookups", secs, found);
+  }
+
+  destroy(ht);
   return 0;
 }
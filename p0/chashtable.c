@@ -0,0 +1,98 @@
+/*
+ * This file contains the implementation of the thread-safe hashtable API
+ * defined in chashtable.h
+ *
+ * The table stripes its locks over the keys: a hash of a key picks one of
+ * NSTRIPES stripes, each a hashtable of its own behind a read-write lock.
+ * Gets take the lock of their stripe to read and can run side by side,
+ * while puts and erases, which may also move a group of a resizing stripe,
+ * take it to write. Threads working on keys in different stripes never
+ * wait for one another, and each stripe resizes on its own. The hash that
+ * picks the stripe is not the one the stripe hashes with, so the keys of a
+ * stripe still spread over all of its slots.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "chashtable.h"
+
+#define NSTRIPES (1 << STRIPE_BITS)
+
+// a hashtable and the lock that guards it
+struct stripe {
+    pthread_rwlock_t lock;
+    hashtable* table;
+};
+
+struct chashtable {
+    char* name;
+    struct stripe stripes[NSTRIPES];
+};
+
+static struct stripe* stripe(chashtable* table, key_t key) {
+    // the top bits of a Fibonacci hash
+    unsigned int h = (unsigned int) key * 0x9e3779b1u;
+    return table->stripes + (h >> (32 - STRIPE_BITS));
+}
+
+chashtable* cinit(const char* name, key_t nslots) {
+    assert(name);
+
+    chashtable* table = malloc(sizeof(chashtable));
+    table->name = malloc(strlen(name) + 1);
+    strcpy(table->name, name);
+
+    // the slots are shared out between the stripes
+    for (int i = 0; i < NSTRIPES; i++) {
+        pthread_rwlock_init(&table->stripes[i].lock, NULL);
+        table->stripes[i].table = init(name, nslots / NSTRIPES);
+    }
+    return table;
+}
+
+// no other thread may be using the table
+int cdestroy(chashtable* table) {
+    for (int i = 0; i < NSTRIPES; i++) {
+        pthread_rwlock_destroy(&table->stripes[i].lock);
+        destroy(table->stripes[i].table);
+    }
+    free(table->name);
+    free(table);
+    return 0;
+}
+
+int cput(chashtable* table, key_t key, val_t val) {
+    struct stripe* s = stripe(table, key);
+    pthread_rwlock_wrlock(&s->lock);
+    int r = put(s->table, key, val);
+    pthread_rwlock_unlock(&s->lock);
+    return r;
+}
+
+int cget(chashtable* table, key_t key, val_t* val, int num_val) {
+    struct stripe* s = stripe(table, key);
+    pthread_rwlock_rdlock(&s->lock);
+    int r = get(s->table, key, val, num_val);
+    pthread_rwlock_unlock(&s->lock);
+    return r;
+}
+
+int cerase(chashtable* table, key_t key) {
+    struct stripe* s = stripe(table, key);
+    pthread_rwlock_wrlock(&s->lock);
+    int r = erase(s->table, key);
+    pthread_rwlock_unlock(&s->lock);
+    return r;
+}
+
+int creserve(chashtable* table, int nkeys) {
+    for (int i = 0; i < NSTRIPES; i++) {
+        struct stripe* s = table->stripes + i;
+        pthread_rwlock_wrlock(&s->lock);
+        reserve(s->table, nkeys / NSTRIPES);
+        pthread_rwlock_unlock(&s->lock);
+    }
+    return 0;
+}
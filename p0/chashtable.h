@@ -0,0 +1,25 @@
+/*
+ * This include file defines the interface to our thread-safe hash tables.
+ * They take the same calls as a hashtable, from any number of threads.
+ */
+#ifndef CHASHTABLE_H
+#define CHASHTABLE_H
+
+#include "hashtable.h"
+
+// the keys are split between 2^STRIPE_BITS hashtables, each with its own lock
+#define STRIPE_BITS 6
+
+typedef struct chashtable chashtable;
+
+chashtable* cinit(const char*, key_t nslots);
+int cdestroy(chashtable*);
+
+int cput(chashtable*, key_t, val_t);
+int cget(chashtable*, key_t, val_t*, int);
+
+int cerase(chashtable*, key_t);
+
+int creserve(chashtable*, int nkeys);
+
+#endif
@@ -1,13 +1,285 @@
 /*
- * This file contains the implementation of the hashtable API 
+ * This file contains the implementation of the hashtable API
  * defined in htable.h
+ *
+ * The table is a Swiss table: open addressing over slots that hold their
+ * key and value inline, with a control byte per slot that is EMPTY, DELETED
+ * or the sign bit over the low 7 bits of the hash of the key in the slot.
+ * EMPTY is zero, so a new array of them is had from calloc(), whose pages
+ * the kernel only zeroes as they are first touched. Slots come in
+ * groups of GROUP_SIZE, and a lookup compares the control bytes of a whole
+ * group against the 7 bits of its key at once with SSE2, so it only reads
+ * the slots that are likely to hold the key. Groups are probed
+ * quadratically from the one the rest of the hash picks, until one with an
+ * EMPTY slot. A key put more than once keeps its newest value in its slot
+ * and the older ones in a list of overflow nodes. These come from slabs of
+ * SLAB_NODES kept by the table: erase() puts a key's nodes on the table's
+ * free list for later puts to reuse, and destroy() frees whole slabs.
+ *
+ * Once 7/8 of the slots are full or deleted the table moves to a new array,
+ * but it does so a little at a time: the old array is kept, and every put
+ * and erase moves RESIZE_STEP of its groups into the new one, so no single
+ * operation pays for the whole move. Until the old array is empty, lookups
+ * try the new array and then the old one, where the groups already moved
+ * still guide probes but their slots no longer count.
+ *
+ * On a table larger than the cache nearly every lookup waits on memory
+ * twice, for its control bytes and then for its slot. put_batch() and
+ * get_batch() overlap those waits across BATCH_WINDOW keys at a time: they
+ * hash all of the keys and prefetch their first groups' control bytes,
+ * then match those and prefetch the slots, and only then do the lookups,
+ * whose reads by now mostly hit the cache.
  */
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "hashtable.h"
 
+#define EMPTY ((signed char) 0)
+#define DELETED ((signed char) 1)
+#define FULL(h) ((signed char) (0x80 | ((h) & 0x7f)))
+
+// the table is resized once 7/8 of its slots are full or deleted
+#define MAX_LOAD(nslots) ((nslots) / 8 * 7)
+
+// groups of the old array moved by each put and erase while resizing
+#define RESIZE_STEP 1
+
+// keys of a batch whose memory is fetched together
+#define BATCH_WINDOW 16
+
+static unsigned int hash(key_t key) {
+    // the murmur3 finalizer, so that every bit of the key moves every bit
+    unsigned int h = (unsigned int) key;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+// a bit for each control byte of a group equal to c
+static unsigned int match(const signed char* group, signed char c) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i*) group);
+    return (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl,
+        _mm_set1_epi8(c)));
+#else
+    unsigned int bits = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        bits |= (unsigned int) (group[i] == c) << i;
+    return bits;
+#endif
+}
+
+// a bit for each EMPTY or DELETED slot of a group, the ones without the sign
+// bit
+static unsigned int match_free(const signed char* group) {
+#ifdef __SSE2__
+    return ~(unsigned int) _mm_movemask_epi8(_mm_loadu_si128(
+        (const __m128i*) group)) & 0xffff;
+#else
+    unsigned int bits = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        bits |= (unsigned int) (group[i] >= 0) << i;
+    return bits;
+#endif
+}
+
+// the first group a key with hash h probes
+static int home(struct hashtable_array* a, unsigned int h) {
+    return (int) (h >> 7) & (a->nslots / GROUP_SIZE - 1);
+}
+
+// the slot of an array holding key outside its first skip groups, or -1
+static int find(struct hashtable_array* a, int skip, key_t key,
+        unsigned int h) {
+    int mask = a->nslots / GROUP_SIZE - 1;
+    int g = home(a, h);
+    for (int step = 1; ; step++) {
+        const signed char* group = a->ctrl + g * GROUP_SIZE;
+        for (unsigned int bits = g < skip ? 0 : match(group, FULL(h)); bits;
+                bits &= bits - 1) {
+            int pos = g * GROUP_SIZE + __builtin_ctz(bits);
+            if (a->slots[pos].key == key)
+                return pos;
+        }
+        if (match(group, EMPTY))
+            return -1;
+        g = (g + step) & mask;
+    }
+}
+
+// the first EMPTY or DELETED slot a key with hash h probes
+static int find_free(struct hashtable_array* a, unsigned int h) {
+    int mask = a->nslots / GROUP_SIZE - 1;
+    int g = home(a, h);
+    for (int step = 1; ; step++) {
+        unsigned int bits = match_free(a->ctrl + g * GROUP_SIZE);
+        if (bits)
+            return g * GROUP_SIZE + __builtin_ctz(bits);
+        g = (g + step) & mask;
+    }
+}
+
+static void alloc_array(struct hashtable_array* a, int nslots) {
+    a->ctrl = calloc(nslots, 1);
+    a->slots = malloc(nslots * sizeof(struct hashtable_slot));
+    a->nslots = nslots;
+}
+
+// the slot a new key with hash h goes in
+static struct hashtable_slot* insert(hashtable* table, unsigned int h) {
+    int pos = find_free(&table->cur, h);
+    if (table->cur.ctrl[pos] == DELETED)
+        table->ndeleted--;
+    table->cur.ctrl[pos] = FULL(h);
+    return table->cur.slots + pos;
+}
+
+// move up to n more groups of the old array into the new one
+static void move_groups(hashtable* table, int n) {
+    struct hashtable_array* old = &table->old;
+    if (!old->ctrl)
+        return;
+
+    int ngroups = old->nslots / GROUP_SIZE;
+    for (; n > 0 && table->moved < ngroups; n--, table->moved++) {
+        int first = table->moved * GROUP_SIZE;
+        for (int pos = first; pos < first + GROUP_SIZE; pos++) {
+            if (old->ctrl[pos] < 0)
+                *insert(table, hash(old->slots[pos].key)) = old->slots[pos];
+        }
+    }
+    if (table->moved == ngroups) {
+        free(old->ctrl);
+        free(old->slots);
+        old->ctrl = NULL;
+    }
+}
+
+// start moving every key into a new array of nslots slots
+static void resize(hashtable* table, int nslots) {
+    // a resize still going must finish first
+    move_groups(table, table->old.nslots);
+
+    table->old = table->cur;
+    table->moved = 0;
+    alloc_array(&table->cur, nslots);
+    table->ndeleted = 0;
+}
+
+// the slot holding key in either array, or NULL
+static struct hashtable_slot* lookup(hashtable* table, key_t key,
+        unsigned int h) {
+    int pos = find(&table->cur, 0, key, h);
+    if (pos >= 0)
+        return table->cur.slots + pos;
+    if (table->old.ctrl) {
+        pos = find(&table->old, table->moved, key, h);
+        if (pos >= 0)
+            return table->old.slots + pos;
+    }
+    return NULL;
+}
+
+// the size to give an array for nkeys keys
+static int array_size(int nkeys) {
+    int size = GROUP_SIZE;
+    while (MAX_LOAD(size) <= nkeys)
+        size *= 2;
+    return size;
+}
+
+static struct hashtable_node* alloc_node(hashtable* table) {
+    if (!table->free_nodes) {
+        struct hashtable_slab* slab = malloc(sizeof(struct hashtable_slab));
+        slab->next_slab = table->slabs;
+        table->slabs = slab;
+        for (int i = 0; i < SLAB_NODES - 1; i++)
+            slab->nodes[i].next_node = slab->nodes + i + 1;
+        slab->nodes[SLAB_NODES - 1].next_node = NULL;
+        table->free_nodes = slab->nodes;
+    }
+    struct hashtable_node* node = table->free_nodes;
+    table->free_nodes = node->next_node;
+    return node;
+}
+
+// put the overflow nodes of a slot on the free list
+static void free_overflow(hashtable* table, struct hashtable_slot* slot) {
+    struct hashtable_node* last = slot->overflow;
+    if (!last)
+        return;
+    while (last->next_node)
+        last = last->next_node;
+    last->next_node = table->free_nodes;
+    table->free_nodes = slot->overflow;
+}
+
+static void put_hashed(hashtable* table, key_t key, val_t val,
+        unsigned int h) {
+    move_groups(table, RESIZE_STEP);
+
+    struct hashtable_slot* slot = lookup(table, key, h);
+    if (slot) {
+        // the newest value stays in the slot, older ones go behind it
+        struct hashtable_node* new_node = alloc_node(table);
+        new_node->value = slot->value;
+        new_node->next_node = slot->overflow;
+        slot->overflow = new_node;
+        slot->value = val;
+        return;
+    }
+
+    // grow, unless it is deleted slots that fill the table
+    if (table->nkeys + table->ndeleted >= MAX_LOAD(table->cur.nslots)) {
+        if (table->nkeys >= MAX_LOAD(table->cur.nslots) / 2)
+            resize(table, table->cur.nslots * 2);
+        else
+            resize(table, table->cur.nslots);
+    }
+
+    slot = insert(table, h);
+    slot->key = key;
+    slot->value = val;
+    slot->overflow = NULL;
+    table->nkeys++;
+}
+
+// start fetching the control bytes of the first group of each key
+static void prefetch_groups(hashtable* table, const unsigned int* h, int n) {
+    for (int i = 0; i < n; i++)
+        __builtin_prefetch(table->cur.ctrl + home(&table->cur, h[i])
+            * GROUP_SIZE);
+}
+
+// then the slot of that group each key most likely wants: the first that
+// matches it, or for a put of a new key, the first free one
+static void prefetch_slots(hashtable* table, const unsigned int* h, int n,
+        int for_put) {
+    struct hashtable_array* a = &table->cur;
+    for (int i = 0; i < n; i++) {
+        int g = home(a, h[i]);
+        unsigned int bits = match(a->ctrl + g * GROUP_SIZE, FULL(h[i]));
+        if (!bits && for_put)
+            bits = match_free(a->ctrl + g * GROUP_SIZE);
+        if (!bits)
+            continue;
+        struct hashtable_slot* slot = a->slots + g * GROUP_SIZE
+            + __builtin_ctz(bits);
+        if (for_put)
+            __builtin_prefetch(slot, 1);
+        else
+            __builtin_prefetch(slot);
+    }
+}
+
 hashtable* init(const char* name, key_t nslots) {
     assert(name);
 
@@ -18,62 +290,142 @@ hashtable* init(const char* name, key_t nslots) {
     table->name = malloc(strlen(name) + 1);
     strcpy(table->name, name);
 
-    // allocate node slots
-    table->nodes = calloc(nslots, sizeof(struct hashtable_node*));
-
-    // set the nslots
-    table->nslots = nslots;
+    // allocate slots, a power of two number of groups
+    int size = GROUP_SIZE;
+    while (size < nslots)
+        size *= 2;
+    alloc_array(&table->cur, size);
+    table->old.ctrl = NULL;
+    table->nkeys = 0;
+    table->ndeleted = 0;
+    table->slabs = NULL;
+    table->free_nodes = NULL;
 
     return table;
 }
 
 int destroy(hashtable* table) {
+    struct hashtable_slab* slab = table->slabs;
+    struct hashtable_slab* next;
+    while (slab) {
+        next = slab->next_slab;
+        free(slab);
+        slab = next;
+    }
+
+    free(table->cur.ctrl);
+    free(table->cur.slots);
+    if (table->old.ctrl) {
+        free(table->old.ctrl);
+        free(table->old.slots);
+    }
     free(table->name);
-    free(table->nodes);
     free(table);
     return 0;
 }
 
-int hash(hashtable* table, key_t key) {
-    return (int) (key % (key_t) table->nslots);
+// make room for nkeys keys in all, so that no put grows the table until then
+int reserve(hashtable* table, int nkeys) {
+    int size = array_size(nkeys);
+    if (size > table->cur.nslots)
+        resize(table, size);
+    return 0;
 }
 
 int put(hashtable* table, key_t key, val_t val) {
-    int pos = hash(table, key);
-    
-    struct hashtable_node* new_node = (struct hashtable_node*) malloc(sizeof(struct hashtable_node));
-
-    new_node->value = val;
-    new_node->next_node = table->nodes[pos];
-    new_node->last_node = NULL;
-    if (table->nodes[pos]) 
-        table->nodes[pos]->last_node = new_node;
-    table->nodes[pos] = new_node;
+    put_hashed(table, key, val, hash(key));
     return 0;
 }
 
-int get(hashtable* table, key_t key, val_t* val, int num_val) {
-    int pos = hash(table, key);
-    struct hashtable_node* current = table->nodes[pos];
-    
-    int idx = 0;
-    while (current && idx < num_val) {
-        val[idx++] = current->value;
-        current = current->next_node;
+// puts vals[i] under keys[i] for each of n keys, in order
+int put_batch(hashtable* table, const key_t* keys, const val_t* vals, int n) {
+    unsigned int h[BATCH_WINDOW];
+    for (int start = 0; start < n; start += BATCH_WINDOW) {
+        int m = n - start < BATCH_WINDOW ? n - start : BATCH_WINDOW;
+        for (int i = 0; i < m; i++)
+            h[i] = hash(keys[start + i]);
+        prefetch_groups(table, h, m);
+        prefetch_slots(table, h, m, 1);
+        for (int i = 0; i < m; i++)
+            put_hashed(table, keys[start + i], vals[start + i], h[i]);
     }
     return 0;
 }
 
+// fills in up to num_val values of key, newest first, and returns how many
+// it has in all
+int get(hashtable* table, key_t key, val_t* val, int num_val) {
+    struct hashtable_slot* slot = lookup(table, key, hash(key));
+    if (!slot)
+        return 0;
+
+    if (num_val > 0)
+        val[0] = slot->value;
+    int idx = 1;
+    for (struct hashtable_node* current = slot->overflow; current;
+            current = current->next_node) {
+        if (idx < num_val)
+            val[idx] = current->value;
+        idx++;
+    }
+    return idx;
+}
+
+// for each of n keys, sets vals[i] to the newest value of keys[i] and
+// nvals[i] to how many it has in all, and returns how many keys were found
+int get_batch(hashtable* table, const key_t* keys, int n, val_t* vals,
+        int* nvals) {
+    unsigned int h[BATCH_WINDOW];
+    int found = 0;
+    for (int start = 0; start < n; start += BATCH_WINDOW) {
+        int m = n - start < BATCH_WINDOW ? n - start : BATCH_WINDOW;
+        for (int i = 0; i < m; i++)
+            h[i] = hash(keys[start + i]);
+        prefetch_groups(table, h, m);
+        prefetch_slots(table, h, m, 0);
+        for (int i = 0; i < m; i++) {
+            struct hashtable_slot* slot = lookup(table, keys[start + i],
+                h[i]);
+            int count = 0;
+            if (slot) {
+                vals[start + i] = slot->value;
+                count = 1;
+                for (struct hashtable_node* current = slot->overflow;
+                        current; current = current->next_node)
+                    count++;
+                found++;
+            }
+            nvals[start + i] = count;
+        }
+    }
+    return found;
+}
+
 int erase(hashtable* table, key_t key) {
-    int pos = hash(table, key);
-    
-    struct hashtable_node* current = table->nodes[pos];
-    struct hashtable_node* next;
-    while (current) {
-        next = current->next_node;
-        free(current);
-        current = next;    
+    move_groups(table, RESIZE_STEP);
+
+    unsigned int h = hash(key);
+    struct hashtable_array* a = &table->cur;
+    int pos = find(a, 0, key, h);
+    if (pos < 0 && table->old.ctrl) {
+        a = &table->old;
+        pos = find(a, table->moved, key, h);
+    }
+    if (pos < 0)
+        return 0;
+
+    free_overflow(table, a->slots + pos);
+    table->nkeys--;
+
+    // lookups stop at a group with an EMPTY slot, so none probe past it.
+    // The old array is never inserted into, so it needs no count
+    if (a == &table->old) {
+        a->ctrl[pos] = DELETED;
+    } else if (match(a->ctrl + pos / GROUP_SIZE * GROUP_SIZE, EMPTY)) {
+        a->ctrl[pos] = EMPTY;
+    } else {
+        a->ctrl[pos] = DELETED;
+        table->ndeleted++;
     }
     return 0;
 }
-
@@ -2,20 +2,53 @@
  * This include file defines the interface to our hash tables.
  * By Carl Denton
  */
+#ifndef HASHTABLE_H
+#define HASHTABLE_H
 
 typedef int key_t ;
 typedef int val_t;
 
+// slots whose control bytes are probed at once
+#define GROUP_SIZE 16
+
+// overflow nodes taken from the system at a time
+#define SLAB_NODES 1024
+
+// a power of two number of groups of slots
+struct hashtable_array {
+    int nslots;
+    signed char* ctrl;
+    struct hashtable_slot* slots;
+};
+
 typedef struct hashtable {
     char* name;
-    int nslots;
-    struct hashtable_node** nodes;
+    int nkeys;
+    int ndeleted;
+    struct hashtable_array cur;
+    // while resizing, the slots being moved into cur, and the groups moved
+    struct hashtable_array old;
+    int moved;
+    // the slabs overflow nodes come from, and the nodes free in them
+    struct hashtable_slab* slabs;
+    struct hashtable_node* free_nodes;
 } hashtable;
 
+// a key and its newest value, with any older values put under it
+struct hashtable_slot {
+    key_t key;
+    val_t value;
+    struct hashtable_node* overflow;
+};
+
 struct hashtable_node {
-    key_t value;
-    struct hashtable_node* next_node;    
-    struct hashtable_node* last_node;
+    val_t value;
+    struct hashtable_node* next_node;
+};
+
+struct hashtable_slab {
+    struct hashtable_slab* next_slab;
+    struct hashtable_node nodes[SLAB_NODES];
 };
 
 hashtable* init(const char*, key_t nslots);
@@ -25,3 +58,10 @@ int put(hashtable*, key_t, val_t);
 int get(hashtable*, key_t, val_t*, int);
 
 int erase(hashtable*, key_t);
+
+int reserve(hashtable*, int nkeys);
+
+int put_batch(hashtable*, const key_t*, const val_t*, int n);
+int get_batch(hashtable*, const key_t*, int n, val_t*, int*);
+
+#endif
@@ -1,11 +1,15 @@
 #include <time.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 #include "hashtable.h"
+#include "chashtable.h"
 
 #define HTNAME "name"
 #define HTSIZE 15485867
+#define NTHREADS 4
+#define THREAD_KEYS 20000
 
 
 // This code is designed to test the correctness of your implementation. 
@@ -13,6 +17,28 @@
 // Compile and run it in the command line by typing: 
 // make test; ./test
 
+struct worker {
+  chashtable* cht;
+  int id;
+};
+
+// each thread puts two values under its own keys, then erases every other
+// one, while reading the keys of the thread before it
+static void* work(void* arg) {
+  struct worker* w = arg;
+  val_t results[2];
+  for (int i = 0; i < THREAD_KEYS; i += 1) {
+    key_t key = i * NTHREADS + w->id;
+    cput(w->cht, key, key);
+    cput(w->cht, key, -key);
+    cget(w->cht, i * NTHREADS + (w->id + NTHREADS - 1) % NTHREADS, results, 2);
+  }
+  for (int i = 0; i < THREAD_KEYS; i += 2) {
+    cerase(w->cht, i * NTHREADS + w->id);
+  }
+  return NULL;
+}
+
 int main(void) {
   hashtable* ht=NULL;
   ht = init(HTNAME, HTSIZE);
@@ -59,6 +85,83 @@ int main(void) {
   }
   destroy(ht);
   printf("Passed tests for erasing.\n");
+
+  printf("Now testing several values under a key in a growing table.\n");
+  ht = init(HTNAME, 13);
+  for (int i = 0; i < num_tests; i += 1) {
+    put(ht, i, i);
+    put(ht, i, -i);
+  }
+  for (int i = 0; i < num_tests; i += 2) {
+    erase(ht, i);
+  }
+  for (int i = 0; i < num_tests; i += 1) {
+    int num_matches = get(ht, i, results, num_values);
+    int expected = i % 2 ? 2 : 0;
+    if (num_matches != expected || (expected && results[0] != -i)) {
+      printf("Test failed with key %d. Got %d matches, newest %d. Expected %d matches, newest %d.\n", i, num_matches, results[0], expected, -i);
+      return 1;
+    }
+  }
+  destroy(ht);
+  printf("Passed tests for several values.\n");
+
+  printf("Now testing batches.\n");
+  ht = init(HTNAME, 13);
+  put_batch(ht, keys, values, num_tests);
+  put_batch(ht, keys, keys, num_tests / 2);
+  val_t batch_values[num_tests];
+  int counts[num_tests];
+  get_batch(ht, keys, num_tests, batch_values, counts);
+  for (int i = 0; i < num_tests; i += 1) {
+    // the newest value is from the second batch if the key was in it, and
+    // otherwise from the last time the first batch drew it
+    val_t expected = values[i];
+    for (int j = 0; j < num_tests; j += 1) {
+      if (keys[j] == keys[i]) {
+        expected = values[j];
+      }
+    }
+    for (int j = 0; j < num_tests / 2; j += 1) {
+      if (keys[j] == keys[i]) {
+        expected = keys[i];
+      }
+    }
+    if (counts[i] < 1 || batch_values[i] != expected) {
+      printf("Test failed with key %d. Got %d matches, newest %d. Expected newest %d.\n", keys[i], counts[i], batch_values[i], expected);
+      return 1;
+    }
+  }
+  key_t missing = -1;
+  if (get_batch(ht, &missing, 1, batch_values, counts) != 0 || counts[0] != 0) {
+    printf("Test failed with missing key %d. Got %d matches.\n", missing, counts[0]);
+    return 1;
+  }
+  destroy(ht);
+  printf("Passed tests for batches.\n");
+
+  printf("Now testing %d threads on a thread-safe table.\n", NTHREADS);
+  chashtable* cht = cinit(HTNAME, 13);
+  pthread_t threads[NTHREADS];
+  struct worker workers[NTHREADS];
+  for (int t = 0; t < NTHREADS; t += 1) {
+    workers[t].cht = cht;
+    workers[t].id = t;
+    pthread_create(&threads[t], NULL, work, &workers[t]);
+  }
+  for (int t = 0; t < NTHREADS; t += 1) {
+    pthread_join(threads[t], NULL);
+  }
+  for (int key = 0; key < THREAD_KEYS * NTHREADS; key += 1) {
+    int num_matches = cget(cht, key, results, num_values);
+    int expected = (key / NTHREADS) % 2 ? 2 : 0;
+    if (num_matches != expected || (expected && results[0] != -key)) {
+      printf("Test failed with key %d. Got %d matches, newest %d. Expected %d matches, newest %d.\n", key, num_matches, results[0], expected, -key);
+      return 1;
+    }
+  }
+  cdestroy(cht);
+  printf("Passed tests for threads.\n");
   printf("All tests have been successfully passed.\n");
   return 0;
 }